@@ -0,0 +1,189 @@
+#include "checkpoint.h"
+#include "ext4.h"
+#include "ext4_bg.h"
+#include "extent-allocator.h"
+#include "fat.h"
+#include "partition.h"
+#include "stream-archiver.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Once the metadata stream is complete, nothing but the stream, the
+// allocator state and the superblock is needed to build the ext4 metadata, and
+// building it only writes to regions the allocator considers used. Replaying
+// that phase from the checkpoint therefore produces the same file system,
+// regardless of where a previous run was interrupted.
+//
+// The checkpoint is a stream archiver chain in otherwise free clusters. It is
+// referenced from the boot code area of the FAT boot sector, which neither the
+// FAT BPB nor the ext4 superblock (at byte 1024) overlap.
+
+constexpr uint32_t CHECKPOINT_REF_OFFSET = sizeof(struct boot_sector);
+constexpr uint64_t CHECKPOINT_MAGIC = 0x31544b504353464f;  // "OFSCPKT1"
+constexpr uint32_t CHECKPOINT_CHUNK_SIZE = 512;
+
+struct checkpoint_ref {
+    uint64_t magic;
+    uint32_t journal_cluster;
+    uint32_t checksum;
+};
+
+struct checkpoint_header {
+    uint32_t phase;
+    uint32_t metadata_cluster;  // First page of the metadata stream
+    uint32_t index_in_fat;
+    uint32_t blocked_extent_index;
+    uint32_t bitmap_size;
+    uint8_t boot_code[sizeof(checkpoint_ref)];  // Overwritten by the reference
+};
+
+checkpoint_ref *checkpoint_reference() {
+    return reinterpret_cast<checkpoint_ref *>(meta_info.fs_start + CHECKPOINT_REF_OFFSET);
+}
+
+// FNV-1a, only meant to detect a torn or foreign reference
+uint32_t ref_checksum(const checkpoint_ref *ref) {
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(ref);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < offsetof(checkpoint_ref, checksum); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+bool has_checkpoint(const uint8_t *boot_sector) {
+    checkpoint_ref ref;
+    memcpy(&ref, boot_sector + CHECKPOINT_REF_OFFSET, sizeof ref);
+    return ref.magic == CHECKPOINT_MAGIC && ref.checksum == ref_checksum(&ref);
+}
+
+bool has_checkpoint() {
+    return has_checkpoint(meta_info.fs_start);
+}
+
+void write_blob(StreamArchiver *journal, const void *data, uint32_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (uint32_t offset = 0; offset < size; offset += CHECKPOINT_CHUNK_SIZE) {
+        void *chunk = iterateStreamArchiver(journal, true, CHECKPOINT_CHUNK_SIZE);
+        memcpy(chunk, bytes + offset, min(CHECKPOINT_CHUNK_SIZE, size - offset));
+    }
+}
+
+bool read_blob(StreamArchiver *journal, void *data, uint32_t size) {
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    for (uint32_t offset = 0; offset < size; offset += CHECKPOINT_CHUNK_SIZE) {
+        void *chunk = iterateStreamArchiver(journal, false, CHECKPOINT_CHUNK_SIZE);
+        if (!chunk) {
+            fprintf(stderr, "Checkpoint journal is truncated, cannot resume the conversion\n");
+            return false;
+        }
+        memcpy(bytes + offset, chunk, min(CHECKPOINT_CHUNK_SIZE, size - offset));
+    }
+    return true;
+}
+
+Page *journal_start() {
+    return reinterpret_cast<Page *>(cluster_start(checkpoint_reference()->journal_cluster));
+}
+
+bool save_checkpoint(Partition *partition, const StreamArchiver *metadata_stream) {
+    if (partition->file < 0) {
+        return true;  // Nothing survives a restart anyway
+    }
+
+    checkpoint_header header;
+    header.phase = CHECKPOINT_METADATA_READ;
+    header.metadata_cluster = cluster_no_of(metadata_stream->page);
+    header.index_in_fat = context->allocator.index_in_fat;
+    header.blocked_extent_index = static_cast<uint32_t>(context->allocator.blocked_extent_current - context->allocator.blocked_extents);
+    header.bitmap_size = allocation_bitmap_size();
+    memcpy(header.boot_code, checkpoint_reference(), sizeof header.boot_code);
+
+    StreamArchiver journal;
+    memset(&journal, 0, sizeof journal);
+    cutStreamArchiver(&journal);
+    Page *first_page = journal.page;
+    *static_cast<checkpoint_header *>(iterateStreamArchiver(&journal, true, sizeof header)) = header;
+    write_blob(&journal, &context->sb, sizeof context->sb);
+    write_blob(&journal, context->allocation_bitmap, header.bitmap_size);
+    cutStreamArchiver(&journal);
+
+    // Writing the journal moved the allocator. Rewind it, so that this run
+    // continues exactly like a resumed one would.
+    context->allocator.index_in_fat = header.index_in_fat;
+    context->allocator.blocked_extent_current = context->allocator.blocked_extents + header.blocked_extent_index;
+
+    // Everything the checkpoint refers to has to be on disk before the
+    // reference, which marks the point from which the FAT is overwritten
+    if (!syncPartition(partition)) {
+        fprintf(stderr, "Failed to write the checkpoint journal\n");
+        return false;
+    }
+    checkpoint_ref ref = {CHECKPOINT_MAGIC, cluster_no_of(first_page), 0};
+    ref.checksum = ref_checksum(&ref);
+    memcpy(checkpoint_reference(), &ref, sizeof ref);
+    if (!syncPartitionRange(partition, 0, CHECKPOINT_REF_OFFSET + sizeof ref)) {
+        fprintf(stderr, "Failed to write the checkpoint journal\n");
+        return false;
+    }
+    return true;
+}
+
+CheckpointStatus load_checkpoint(StreamArchiver *metadata_stream) {
+    if (!has_checkpoint()) {
+        return CHECKPOINT_ABSENT;
+    }
+
+    pageSize = meta_info.cluster_size;
+    StreamArchiver journal;
+    attachStreamArchiver(&journal, journal_start());
+    checkpoint_header *header = getNext<checkpoint_header>(&journal);
+    if (!header || header->phase != CHECKPOINT_METADATA_READ || header->bitmap_size != allocation_bitmap_size()) {
+        fprintf(stderr, "Checkpoint journal does not match the partition, cannot resume the conversion\n");
+        return CHECKPOINT_INVALID;
+    }
+
+    if (!read_blob(&journal, &context->sb, sizeof context->sb)) {
+        return CHECKPOINT_INVALID;
+    }
+    update_geometry();
+    uint8_t *bitmap = static_cast<uint8_t *>(context_malloc(header->bitmap_size));
+    uint32_t bg_count = block_group_count();
+    fat_extent *bg_meta_extents = NULL;
+    if (!read_blob(&journal, bitmap, header->bitmap_size)
+        || !(bg_meta_extents = create_block_group_meta_extents(bg_count))) {
+        context_free(bitmap);
+        return CHECKPOINT_INVALID;
+    }
+    restore_extent_allocator(bg_meta_extents, bg_count, bitmap, header->index_in_fat, header->blocked_extent_index);
+    // The bitmap was saved while the journal was still growing
+    for (Page *page = journal_start(); page; page = nextPage(page)) {
+        set_used(cluster_no_of(page));
+    }
+
+    attachStreamArchiver(metadata_stream, reinterpret_cast<Page *>(cluster_start(header->metadata_cluster)));
+    return CHECKPOINT_LOADED;
+}
+
+bool clear_checkpoint(Partition *partition) {
+    if (!has_checkpoint()) {
+        return true;
+    }
+
+    // The converted file system has to be complete on disk before the
+    // reference to the journal is dropped
+    if (!syncPartition(partition)) {
+        fprintf(stderr, "Failed to write the converted file system\n");
+        return false;
+    }
+    StreamArchiver journal;
+    attachStreamArchiver(&journal, journal_start());
+    checkpoint_header *header = getNext<checkpoint_header>(&journal);
+    memcpy(checkpoint_reference(), header->boot_code, sizeof header->boot_code);
+    syncPartitionRange(partition, 0, CHECKPOINT_REF_OFFSET + sizeof(checkpoint_ref));
+    return true;
+}
@@ -0,0 +1,27 @@
+#ifndef OFS_CONVERT_CHECKPOINT_H
+#define OFS_CONVERT_CHECKPOINT_H
+
+#include <stdint.h>
+
+struct Partition;
+struct StreamArchiver;
+
+// Phases after which the conversion records a checkpoint. Before
+// CHECKPOINT_METADATA_READ, the FAT is still intact and an interrupted
+// conversion is simply restarted.
+constexpr uint32_t CHECKPOINT_METADATA_READ = 1;
+
+enum CheckpointStatus {
+    CHECKPOINT_ABSENT,
+    CHECKPOINT_LOADED,
+    CHECKPOINT_INVALID,  // The partition references a journal that cannot be resumed from
+};
+
+// Whether the boot sector references the checkpoint of an interrupted conversion
+bool has_checkpoint(const uint8_t *boot_sector);
+// These return false if the partition could not be synced
+bool save_checkpoint(Partition *partition, const StreamArchiver *metadata_stream);
+CheckpointStatus load_checkpoint(StreamArchiver *metadata_stream);
+bool clear_checkpoint(Partition *partition);
+
+#endif //OFS_CONVERT_CHECKPOINT_H
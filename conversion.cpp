@@ -0,0 +1,360 @@
+#include "checkpoint.h"
+#include "conversion.h"
+#include "conversion_context.h"
+#include "ext4.h"
+#include "ext4_bg.h"
+#include "ext4_check.h"
+#include "ext4_journal.h"
+#include "ext4_layout.h"
+#include "extent-allocator.h"
+#include "fat_check.h"
+#include "metadata_reader.h"
+#include "partition.h"
+#include "perf_counters.h"
+#include "visualizer.h"
+#include "stream-archiver.h"
+#include "tree_builder.h"
+#include "undo_file.h"
+#include "util.h"
+#include "verify.h"
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+conversion_options default_conversion_options() {
+    return {0, JOURNAL_SIZE_DEFAULT, SPARSE_NONE, false, false, CHECK_OFF, DIRTY_LIMIT_DEFAULT_MB, false,
+            INODE_HEADROOM_DEFAULT, false, NULL, 0};
+}
+
+// Checks the metadata written so far if every phase should be checked. Until
+// the conversion is finalized, the group descriptors are only in memory.
+bool check_phase(const conversion_options& options, const char *phase, uint32_t checks) {
+    if (options.check_mode != CHECK_EACH_PHASE || check_ext4(context->group_descs, checks)) {
+        return true;
+    }
+    fprintf(stderr, "Metadata is inconsistent after %s\n", phase);
+    return false;
+}
+
+// Also cleans up after fail_conversion(), wherever it ended the conversion.
+// What else it still holds on the heap goes with its context.
+bool abort_conversion(Partition *partition, verify_records& fat_records) {
+    stopArchiverSegments();
+    stop_inode_cache();
+    stop_perf_counters();
+    stop_undo_file();
+    free_verify_records(fat_records);
+    free_ext4_group_descs();
+    free_extent_allocator();
+    if (partition->ptr) {
+        closePartition(partition);
+    }
+    return false;
+}
+
+// Checks the finished ext4 metadata, with the group descriptors on disk
+bool check_result() {
+    auto *disk_descs = reinterpret_cast<const ext4_group_desc *>(block_start(context->sb.s_first_data_block + 1));
+    bool is_consistent = check_ext4(disk_descs, CHECK_ALL);
+    if (is_consistent) {
+        printf("Checked the ext4 metadata\n");
+    }
+    return is_consistent;
+}
+
+double monotonic_seconds() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+bool convert_fat_partition(const conversion_options& options, conversion_stats *stats, Partition& partition,
+                           verify_records& fat_records) {
+    double start_seconds = monotonic_seconds();
+    if (!openPartition(&partition)) {
+        fprintf(stderr, "Failed to open partition");
+        return false;
+    }
+    startBoundedWriteback(&partition, static_cast<uint64_t>(options.dirty_limit_mb) << 20);
+    read_boot_sector(partition.ptr);
+    if (!set_meta_info(partition.ptr)) {
+        closePartition(&partition);
+        return false;
+    }
+
+    if (options.perf) {
+        start_perf_counters();
+    }
+    StreamArchiver read_stream;
+    CheckpointStatus checkpoint = load_checkpoint(&read_stream);
+    if (checkpoint == CHECKPOINT_INVALID) {
+        return abort_conversion(&partition, fat_records);
+    } else if (checkpoint == CHECKPOINT_LOADED) {
+        if (options.verify) {
+            // The FAT file system may already be partly overwritten
+            fprintf(stderr, "Cannot verify a resumed conversion, resume it without --verify\n");
+            return abort_conversion(&partition, fat_records);
+        }
+        if (options.undo_path) {
+            // What the interrupted run overwrote is not in the mapping anymore
+            fprintf(stderr, "Cannot write an undo file for a resumed conversion, resume it without --undo\n");
+            return abort_conversion(&partition, fat_records);
+        }
+        printf("Resuming interrupted conversion\n");
+    } else if (is_converted(partition.ptr)) {
+        printf("Partition has already been converted\n");
+        if (stats) {
+            stats->is_ext4 = true;
+        }
+        // For example after it was changed or repaired since
+        bool is_consistent = true;
+        if (options.check_mode != CHECK_OFF) {
+            is_consistent = read_ext4_sb(partition.ptr, partition.size) && check_result();
+        }
+        stop_perf_counters();
+        closePartition(&partition);
+        return is_consistent;
+    } else {
+        // Loops and cross-links would make the tree walks below spin or
+        // convert the same clusters twice
+        perf_begin(PERF_FAT_CHECK);
+        bool is_consistent = check_fat_consistency();
+        perf_end(PERF_FAT_CHECK);
+        if (!is_consistent) {
+            stop_perf_counters();
+            closePartition(&partition);
+            return false;
+        }
+        if (options.undo_path && !start_undo_file(&partition, options.undo_path)) {
+            stop_perf_counters();
+            closePartition(&partition);
+            return false;
+        }
+        perf_begin(PERF_ALLOCATOR_INIT);
+        // Every file and directory becomes an inode
+        uint32_t used_inodes = EXT4_FIRST_NON_RSV_INODE + count_fat_tree();
+        if (!init_ext4_sb(options.requested_block_size, used_inodes, options.inode_headroom_percent)) {
+            return abort_conversion(&partition, fat_records);
+        }
+        if (options.optimize_layout) {
+            optimize_layout();
+        }
+        if (!init_journal(options.journal_size_mb)) {
+            return abort_conversion(&partition, fat_records);
+        }
+        set_sparse_mode(options.sparse_mode, &partition);
+        int bg_count = block_group_count();
+        fat_extent *bg_meta_extents = create_block_group_meta_extents(bg_count);
+        if (!bg_meta_extents) {
+            return abort_conversion(&partition, fat_records);
+        }
+        init_extent_allocator(bg_meta_extents, bg_count);
+        perf_end(PERF_ALLOCATOR_INIT);
+        if (options.verify) {
+            fat_records = read_fat_tree();
+        }
+
+        StreamArchiver write_stream;
+        startArchiverSegments();
+        init_stream_archiver(&write_stream, meta_info.cluster_size);
+        StreamArchiver extent_stream = write_stream;
+        read_stream = write_stream;
+
+        perf_begin(PERF_TRAVERSE);
+        aggregate_extents(boot_sector.root_cluster_no, true, &write_stream);
+        traverse(&extent_stream, &write_stream);
+        // The unused tail of the last segment has to go back to the allocator
+        // before save_checkpoint() stores the allocation bitmap
+        stopArchiverSegments();
+        flushMappedWrites();
+        check_journal_space();
+        if (!save_checkpoint(&partition, &read_stream)) {
+            return abort_conversion(&partition, fat_records);
+        }
+        perf_end(PERF_TRAVERSE);
+    }
+
+    perf_begin(PERF_GROUP_DESCS);
+    init_ext4_group_descs();
+    perf_end(PERF_GROUP_DESCS);
+    perf_begin(PERF_TREE_BUILD);
+    build_ext4_root();
+    start_inode_cache();
+    build_ext4_metadata_tree(EXT4_ROOT_INODE, EXT4_ROOT_INODE, &read_stream);
+    stop_inode_cache();
+    flushMappedWrites();
+    // The link count of the root is only complete with lost+found
+    if (!check_phase(options, "building the directory tree", CHECK_TREE)) {
+        return abort_conversion(&partition, fat_records);
+    }
+    build_lost_found();
+    perf_end(PERF_TREE_BUILD);
+    if (!check_phase(options, "building lost+found", CHECK_TREE | CHECK_LINKS)) {
+        return abort_conversion(&partition, fat_records);
+    }
+    perf_begin(PERF_JOURNAL);
+    if (!build_journal()) {
+        return abort_conversion(&partition, fat_records);
+    }
+    flushMappedWrites();
+    perf_end(PERF_JOURNAL);
+    if (!check_phase(options, "building the journal", CHECK_TREE | CHECK_LINKS)) {
+        return abort_conversion(&partition, fat_records);
+    }
+    perf_begin(PERF_FINALIZE);
+    finalize_block_groups_on_disk();
+    // Still covered by the checkpoint, a run interrupted after dropping it
+    // must find the partition converted
+    retire_fat_boot_sector(partition.ptr);
+    if (!clear_checkpoint(&partition)) {
+        return abort_conversion(&partition, fat_records);
+    }
+    perf_end(PERF_FINALIZE);
+    // Only once the checkpoint is gone, it lives in blocks that are free in ext4
+    if (options.discard) {
+        discard_free_blocks(&partition);
+    }
+    // Also after the discard, which saves what it drops
+    bool is_undo_complete = finish_undo_file();
+    bool is_verified = true;
+    if (fat_records.records) {
+        is_verified = verify_ext4_tree(fat_records);
+        if (is_verified) {
+            printf("Verified %u files and directories\n", fat_records.count - 1);
+        }
+        free_verify_records(fat_records);
+    }
+    bool is_consistent = true;
+    if (options.check_mode != CHECK_OFF) {
+        is_consistent = check_result();
+    }
+    uint64_t used_blocks = block_count() - from_lo_hi(context->sb.s_free_blocks_count_lo, context->sb.s_free_blocks_count_hi);
+    report_perf_counters(used_blocks / blocks_per_cluster());
+    if (stats) {
+        *stats = {true, true, partition.size, used_blocks * block_size(), context->sb.s_inodes_count - context->sb.s_free_inodes_count,
+                  monotonic_seconds() - start_seconds};
+    }
+    stop_perf_counters();
+    free_ext4_group_descs();
+    free_extent_allocator();
+
+    closePartition(&partition);
+    visualizer_render_to_file("partition.svg", partition.size / block_size());
+    return is_verified && is_consistent && is_undo_complete;
+}
+
+// Runs the conversion until it returns or fail_conversion() jumps back here.
+// What has to be cleaned up then is not local to this function, so it keeps
+// its value across the jump.
+bool run_conversion(const conversion_options& options, conversion_stats *stats, Partition *partition,
+                    verify_records *fat_records) {
+    jmp_buf failure;
+    if (setjmp(failure)) {
+        conversion_failure = NULL;
+        return abort_conversion(partition, *fat_records);
+    }
+    conversion_failure = &failure;
+    bool is_converted = convert_fat_partition(options, stats, *partition, *fat_records);
+    conversion_failure = NULL;
+    return is_converted;
+}
+
+bool convert_partition(const partition_location& location, const conversion_options& options,
+                       conversion_stats *stats) {
+    if (stats) {
+        memset(stats, 0, sizeof *stats);
+    }
+    Partition partition = {.path = location.path, .offset = location.offset, .size = location.size};
+    verify_records fat_records = {NULL, 0, 0};
+    conversion_context ctx;
+    start_conversion_context(&ctx, static_cast<uint64_t>(options.memory_limit_mb) << 20);
+    bool is_converted = run_conversion(options, stats, &partition, &fat_records);
+    stop_conversion_context();
+    return is_converted;
+}
+
+struct batch {
+    const partition_location *locations;
+    uint32_t count;
+    const conversion_options *options;
+    conversion_stats *stats;
+    // Shared by all workers
+    uint32_t next, failed_count;
+};
+
+void *convert_batch_partitions(void *arg) {
+    batch *work = static_cast<batch *>(arg);
+    for (uint32_t i = __sync_fetch_and_add(&work->next, 1); i < work->count;
+         i = __sync_fetch_and_add(&work->next, 1)) {
+        if (!convert_partition(work->locations[i], *work->options, &work->stats[i])) {
+            fprintf(stderr, "Failed to convert ");
+            print_location(stderr, work->locations[i]);
+            fprintf(stderr, "\n");
+            __sync_fetch_and_add(&work->failed_count, 1);
+        }
+    }
+    return NULL;
+}
+
+// Prints a line for each partition and their total, which took seconds
+void report_conversions(const partition_location *locations, const conversion_stats *stats, uint32_t count,
+                        double seconds) {
+    constexpr double MIB = 1 << 20;
+    conversion_stats total = {true, true, 0, 0, 0, seconds};
+    uint32_t converted_count = 0;
+    printf("%-40s %12s %12s %10s %9s %9s\n", "partition", "size MiB", "used MiB", "inodes", "seconds", "MiB/s");
+    for (uint32_t i = 0; i < count; i++) {
+        const conversion_stats& partition = stats[i];
+        char name[4096];
+        if (locations[i].number) {
+            snprintf(name, sizeof name, "%s partition %u", locations[i].path, locations[i].number);
+        } else {
+            snprintf(name, sizeof name, "%s", locations[i].path);
+        }
+        if (!partition.is_converted) {
+            printf("%-40s %12s\n", name, partition.is_ext4 ? "converted before" : "failed");
+            continue;
+        }
+        printf("%-40s %12.1f %12.1f %10u %9.2f %9.1f\n", name, partition.size / MIB, partition.used_size / MIB,
+               partition.used_inodes, partition.seconds, partition.used_size / MIB / partition.seconds);
+        converted_count++;
+        total.size += partition.size;
+        total.used_size += partition.used_size;
+        total.used_inodes += partition.used_inodes;
+    }
+    if (converted_count > 1) {
+        printf("%-40s %12.1f %12.1f %10u %9.2f %9.1f\n", "total", total.size / MIB, total.used_size / MIB,
+               total.used_inodes, total.seconds, total.used_size / MIB / total.seconds);
+    }
+}
+
+bool convert_partitions(const partition_location *locations, uint32_t count, uint32_t jobs,
+                        const conversion_options& options, conversion_stats *stats) {
+    double start_seconds = monotonic_seconds();
+    batch work = {locations, count, &options, stats, 0, 0};
+    if (jobs > count) {
+        jobs = count;
+    }
+
+    // The calling thread is one of the workers
+    auto *threads = static_cast<pthread_t *>(malloc(jobs * sizeof(pthread_t)));
+    uint32_t started = 0;
+    for (; started + 1 < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, convert_batch_partitions, &work)) {
+            perror("Failed to start conversion thread");
+            break;
+        }
+    }
+    convert_batch_partitions(&work);
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    report_conversions(locations, stats, count, monotonic_seconds() - start_seconds);
+    return !work.failed_count;
+}
+
@@ -0,0 +1,61 @@
+#ifndef OFS_CONVERT_CONVERSION_H
+#define OFS_CONVERT_CONVERSION_H
+
+#include <stdint.h>
+
+#include "metadata_reader.h"
+#include "partition_table.h"
+
+constexpr uint32_t DIRTY_LIMIT_DEFAULT_MB = 256;
+
+enum CheckMode {
+    CHECK_OFF,
+    CHECK_RESULT,  // Checks the finished ext4 metadata, see ext4_check.h, also of partitions converted before
+    CHECK_EACH_PHASE,  // Also checks after each step that writes metadata, to find the one that broke it
+};
+
+struct conversion_options {
+    uint32_t requested_block_size;  // 0 selects the default
+    int64_t journal_size_mb;  // JOURNAL_SIZE_DEFAULT, or 0 for no journal
+    SparseMode sparse_mode;
+    bool discard;
+    bool verify;  // Compares the converted files with the FAT ones, see verify.h
+    CheckMode check_mode;
+    uint32_t dirty_limit_mb;  // Bounds the unwritten data, see startBoundedWriteback()
+    bool optimize_layout;  // Fits the block groups around the FAT data, see ext4_layout.h
+    int32_t inode_headroom_percent;  // INODE_HEADROOM_DEFAULT, or the inodes beyond those of the FAT files
+    bool perf;  // Reports hardware counters for each phase, see perf_counters.h
+    const char *undo_path;  // NULL for none, otherwise the e2undo file to write, see undo_file.h
+    uint32_t memory_limit_mb;  // 0 for none, otherwise the heap memory the conversion may hold, see conversion_context.h
+};
+
+conversion_options default_conversion_options();
+
+// What a conversion achieved, for the report of a whole batch
+struct conversion_stats {
+    bool is_ext4;  // The partition holds ext4 now, also if it was converted before
+    bool is_converted;  // By this conversion, only then the other fields are set
+    uint64_t size;  // Of the partition in bytes
+    uint64_t used_size;  // Of the ext4 blocks in use, in bytes
+    uint32_t used_inodes;
+    double seconds;
+};
+
+// Converts the FAT partition at location, or resumes its interrupted
+// conversion. Returns false if the partition could not be opened or
+// converted, or if the verification or a check failed. A failed conversion
+// only ends itself, the partition may be left partly converted then.
+// Each conversion has a context of its own, and the rest of its state is
+// thread-local, so several threads can each convert a different partition at
+// the same time, also of the same device.
+bool convert_partition(const partition_location& location, const conversion_options& options,
+                       conversion_stats *stats = NULL);
+
+// Converts count partitions in place with up to jobs threads, each taking the
+// next partition once it is done with the previous one. Fills in the stats of
+// each partition and prints them with their total. Returns false if any
+// partition failed.
+bool convert_partitions(const partition_location *locations, uint32_t count, uint32_t jobs,
+                        const conversion_options& options, conversion_stats *stats);
+
+#endif //OFS_CONVERT_CONVERSION_H
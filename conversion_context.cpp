@@ -0,0 +1,110 @@
+#include "conversion_context.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Precedes each heap block of a context, which keeps them in a list
+struct alignas(alignof(max_align_t)) context_allocation {
+    context_allocation *previous, *next;
+    size_t size;
+};
+
+__thread conversion_context *context;
+
+void start_conversion_context(conversion_context *ctx, uint64_t memory_limit) {
+    memset(ctx, 0, sizeof *ctx);
+    ctx->memory_limit = memory_limit;
+    context = ctx;
+}
+
+void stop_conversion_context() {
+    context_allocation *allocation = context->allocations;
+    while (allocation) {
+        context_allocation *next = allocation->next;
+        free(allocation);
+        allocation = next;
+    }
+    context = NULL;
+}
+
+void reserve_memory(uint64_t size) {
+    context->memory_used += size;
+    if (context->memory_limit && context->memory_used > context->memory_limit) {
+        fprintf(stderr, "The conversion needs more than its memory limit of %llu MiB\n",
+                static_cast<unsigned long long>(context->memory_limit >> 20));
+        fail_conversion();
+    }
+}
+
+void link_allocation(context_allocation *allocation) {
+    allocation->previous = NULL;
+    allocation->next = context->allocations;
+    if (allocation->next) {
+        allocation->next->previous = allocation;
+    }
+    context->allocations = allocation;
+}
+
+void unlink_allocation(context_allocation *allocation) {
+    if (allocation->previous) {
+        allocation->previous->next = allocation->next;
+    } else {
+        context->allocations = allocation->next;
+    }
+    if (allocation->next) {
+        allocation->next->previous = allocation->previous;
+    }
+}
+
+void *context_malloc(size_t size) {
+    reserve_memory(size);
+    auto *allocation = static_cast<context_allocation *>(malloc(sizeof(context_allocation) + size));
+    if (!allocation) {
+        fprintf(stderr, "Out of memory\n");
+        fail_conversion();
+    }
+    allocation->size = size;
+    link_allocation(allocation);
+    return allocation + 1;
+}
+
+void *context_calloc(size_t count, size_t size) {
+    void *ptr = context_malloc(count * size);
+    memset(ptr, 0, count * size);
+    return ptr;
+}
+
+void *context_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return context_malloc(size);
+    }
+    context_allocation *allocation = static_cast<context_allocation *>(ptr) - 1;
+    if (size > allocation->size) {
+        reserve_memory(size - allocation->size);
+    } else {
+        context->memory_used -= allocation->size - size;
+    }
+    unlink_allocation(allocation);
+    auto *moved = static_cast<context_allocation *>(realloc(allocation, sizeof(context_allocation) + size));
+    if (!moved) {
+        // Still allocated, and freed with the context
+        link_allocation(allocation);
+        fprintf(stderr, "Out of memory\n");
+        fail_conversion();
+    }
+    moved->size = size;
+    link_allocation(moved);
+    return moved + 1;
+}
+
+void context_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    context_allocation *allocation = static_cast<context_allocation *>(ptr) - 1;
+    context->memory_used -= allocation->size;
+    unlink_allocation(allocation);
+    free(allocation);
+}
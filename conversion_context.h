@@ -0,0 +1,60 @@
+#ifndef OFS_CONVERT_CONVERSION_CONTEXT_H
+#define OFS_CONVERT_CONVERSION_CONTEXT_H
+
+#include "ext4.h"
+#include "extent-allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ext4_group_desc;
+struct context_allocation;
+
+// The state of a single conversion: the ext4 superblock and geometry, the
+// group descriptors and the cluster allocator, and everything it holds on
+// the heap. Each conversion has its own, so several of them can run at the
+// same time. The functions work on that of the calling thread.
+struct conversion_context {
+    ext4_super_block sb;
+    ext4_geometry geometry;
+    ext4_group_desc *group_descs;
+    extent_allocator allocator;
+    uint8_t *allocation_bitmap;
+    uint64_t memory_limit;  // In bytes, 0 for none
+    uint64_t memory_used;
+    context_allocation *allocations;  // Not yet freed, see context_malloc()
+};
+
+extern __thread conversion_context *context;
+
+// Makes ctx the context of the calling thread
+void start_conversion_context(conversion_context *ctx, uint64_t memory_limit);
+// Frees what the conversion still holds on the heap, also after
+// fail_conversion() ended it anywhere, and ends the context
+void stop_conversion_context();
+
+// Heap blocks of the context. They count against its memory limit, and
+// exceeding it fails the conversion.
+void *context_malloc(size_t size);
+void *context_calloc(size_t count, size_t size);
+void *context_realloc(void *ptr, size_t size);
+void context_free(void *ptr);
+
+inline uint32_t block_size() {
+    return context->geometry.block_size;
+}
+
+// Number of ext4 blocks per cluster, which is always the FAT cluster size
+inline uint32_t blocks_per_cluster() {
+    return 1u << context->geometry.cluster_ratio_log2;
+}
+
+inline uint64_t block_count() {
+    return context->geometry.block_count;
+}
+
+inline uint8_t *block_start(uint64_t block_no) {
+    return meta_info.fs_start + (block_no << context->geometry.block_size_log2);
+}
+
+#endif //OFS_CONVERT_CONVERSION_CONTEXT_H
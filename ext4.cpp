@@ -11,59 +11,144 @@
 #include <uuid/uuid.h>
 
 
-// Simplified because we don't use clusters
-constexpr uint32_t EXT4_MAX_BLOCKS_PER_GROUP = (1 << 16) - 8;
-
+constexpr uint32_t EXT4_MAX_CLUSTERS_PER_GROUP = (1 << 16) - 8;
+
+
+void update_geometry() {
+    context->geometry.block_size_log2 = context->sb.s_log_block_size + EXT4_BLOCK_SIZE_MIN_LOG2;
+    context->geometry.block_size = 1u << context->geometry.block_size_log2;
+    context->geometry.cluster_ratio_log2 = context->sb.s_log_cluster_size - context->sb.s_log_block_size;
+    context->geometry.block_count = from_lo_hi(context->sb.s_blocks_count_lo, context->sb.s_blocks_count_hi);
+    context->geometry.block_group_count = static_cast<uint32_t>(ceildiv<uint64_t>(context->geometry.block_count, context->sb.s_blocks_per_group));
+    context->geometry.gdt_block_count = ceildiv(context->geometry.block_group_count, context->geometry.block_size / context->sb.s_desc_size);
+    context->geometry.inode_table_blocks = ceildiv(context->sb.s_inodes_per_group * context->sb.s_inode_size, context->geometry.block_size);
+    // Not yet known while the block count is determined
+    if (context->sb.s_inodes_per_group > 1) {
+        context->geometry.inodes_per_group = init_fast_divisor(context->sb.s_inodes_per_group);
+    }
+}
 
-ext4_super_block sb;
+// Checks for the superblock written at the end of a conversion, which also
+// retires the FAT boot sector. A FAT volume can still carry the superblock of
+// an ext4 file system it was formatted over.
+bool is_converted(uint8_t *fs) {
+    ext4_super_block *existing_sb = reinterpret_cast<ext4_super_block *>(fs + 1024);
+    return existing_sb->s_magic == EXT4_MAGIC && existing_sb->s_rev_level == EXT4_DYNAMIC_REV
+           && !is_fat32_boot_sector(fs);
+}
 
+bool is_power_of_two(uint32_t value) {
+    return value && !(value & (value - 1));
+}
 
-uint32_t block_size() {
-    return 1u << (sb.s_log_block_size + EXT4_BLOCK_SIZE_MIN_LOG2);
+bool read_ext4_sb(const uint8_t *fs, uint64_t partition_size) {
+    memcpy(&context->sb, fs + 1024, sizeof context->sb);
+    // update_geometry() divides by these
+    uint32_t sb_block_size = context->sb.s_log_block_size <= EXT4_BLOCK_SIZE_MAX_LOG2 - EXT4_BLOCK_SIZE_MIN_LOG2
+                             ? 1u << (context->sb.s_log_block_size + EXT4_BLOCK_SIZE_MIN_LOG2) : 0;
+    if (!sb_block_size || !context->sb.s_blocks_per_group || context->sb.s_inodes_per_group < EXT4_FIRST_NON_RSV_INODE
+        || context->sb.s_desc_size < 32 || !is_power_of_two(context->sb.s_desc_size) || context->sb.s_desc_size > sb_block_size
+        || context->sb.s_log_cluster_size < context->sb.s_log_block_size || context->sb.s_log_cluster_size - context->sb.s_log_block_size > 16) {
+        fprintf(stderr, "Check failed: the superblock has an invalid geometry\n");
+        return false;
+    }
+    update_geometry();
+    // Everything else is found through these, and has to lie within the partition
+    uint64_t cluster_size = static_cast<uint64_t>(block_size()) << context->geometry.cluster_ratio_log2;
+    if (block_count() > partition_size >> context->geometry.block_size_log2 || cluster_size != meta_info.cluster_size
+        || context->sb.s_first_data_block >= block_count()
+        || block_count() - context->sb.s_first_data_block <= context->geometry.gdt_block_count
+        || context->sb.s_blocks_per_group != static_cast<uint64_t>(context->sb.s_clusters_per_group) << context->geometry.cluster_ratio_log2
+        || context->sb.s_clusters_per_group > block_size() * 8 || context->sb.s_clusters_per_group % 8
+        || context->sb.s_inodes_per_group > block_size() * 8
+        || context->sb.s_inode_size < 128 || !is_power_of_two(context->sb.s_inode_size) || context->sb.s_inode_size > block_size()
+        || context->sb.s_inodes_count != static_cast<uint64_t>(context->sb.s_inodes_per_group) * block_group_count()) {
+        fprintf(stderr, "Check failed: the superblock does not fit the partition\n");
+        return false;
+    }
+    return true;
 }
 
+uint32_t inodes_per_group_alignment() {
+    // Like mke2fs, fill whole inode table blocks and whole bitmap bytes
+    uint32_t inodes_per_block = block_size() / EXT4_INODE_SIZE;
+    return inodes_per_block < 8 ? 8 : inodes_per_block;
+}
 
-uint8_t *block_start(uint64_t block_no) {
-    return meta_info.fs_start + block_no * block_size();
+uint32_t fit_inodes_per_group(uint64_t inodes) {
+    uint32_t max_inodes = min(
+            // Inodes per group need to fit into a one page bitmap
+            block_size() * 8,
+            // and the 16 bit free inode counts
+            (1u << 16) - block_size() / EXT4_INODE_SIZE);
+    uint32_t fitted = inodes < max_inodes ? static_cast<uint32_t>(inodes) : max_inodes;
+    return fitted - fitted % inodes_per_group_alignment();
 }
 
-uint64_t block_count() {
-    return from_lo_hi(sb.s_blocks_count_lo, sb.s_blocks_count_hi);
+uint32_t inodes_per_group_for(uint64_t inode_count) {
+    uint32_t bg_count = block_group_count();
+    uint64_t inodes_per_group = (inode_count + bg_count - 1) / bg_count;
+    // The reserved inodes are all in the first group
+    if (inodes_per_group < EXT4_FIRST_NON_RSV_INODE) {
+        inodes_per_group = EXT4_FIRST_NON_RSV_INODE;
+    }
+    return fit_inodes_per_group(inodes_per_group + inodes_per_group_alignment() - 1);
 }
 
-void init_ext4_sb() {
-    uint32_t bytes_per_block = boot_sector.bytes_per_sector * boot_sector.sectors_per_cluster;
+bool init_ext4_sb(uint32_t requested_block_size, uint32_t used_inodes, int32_t inode_headroom_percent) {
+    uint32_t bytes_per_cluster = boot_sector.bytes_per_sector * boot_sector.sectors_per_cluster;
     uint64_t partition_bytes = boot_sector.bytes_per_sector * static_cast<uint64_t>(sector_count());
 
-    if (bytes_per_block < 1024) {
+    if (bytes_per_cluster < 1024) {
         fprintf(stderr, "This tool only works for FAT partitions with cluster size >= 1kB\n");
-        exit(1);
+        return false;
     }
 
-    memset(&sb, 0, sizeof(sb));
-    sb.s_magic = EXT4_MAGIC;
-    sb.s_state = EXT4_STATE_CLEANLY_UNMOUNTED;
-    sb.s_feature_compat = EXT4_FEATURE_COMPAT_SPARSE_SUPER2;
-    sb.s_feature_incompat = EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_EXTENTS;
-    sb.s_desc_size = EXT4_64BIT_DESC_SIZE;
-    sb.s_inode_size = EXT4_INODE_SIZE;
-    sb.s_rev_level = EXT4_DYNAMIC_REV;
-    sb.s_errors = EXT4_ERRORS_DEFAULT;
-    sb.s_first_ino = EXT4_FIRST_NON_RSV_INODE;
-    sb.s_max_mnt_count = UINT16_MAX;
-    sb.s_mkfs_time = static_cast<uint32_t>(time(NULL));
-    uuid_generate(sb.s_uuid);
-    read_volume_label(reinterpret_cast<uint8_t *>(sb.s_volume_name));
-
-    sb.s_log_block_size = log2(bytes_per_block) - EXT4_BLOCK_SIZE_MIN_LOG2;
-    sb.s_first_data_block = bytes_per_block == 1024 ? 1 : 0;
-    sb.s_blocks_per_group = min(bytes_per_block * 8, EXT4_MAX_BLOCKS_PER_GROUP);
-    uint64_t block_count = partition_bytes / bytes_per_block;
-    set_lo_hi(sb.s_blocks_count_lo, sb.s_blocks_count_hi, block_count);
-
-    // These have to have these values even if bigalloc is disabled
-    sb.s_log_cluster_size = sb.s_log_block_size;
-    sb.s_clusters_per_group = sb.s_blocks_per_group;
+    uint32_t bytes_per_block = requested_block_size ? requested_block_size
+                                                    : min(bytes_per_cluster, EXT4_DEFAULT_BLOCK_SIZE);
+    if (bytes_per_block < 1024 || bytes_per_block > bytes_per_cluster
+            || (bytes_per_block & (bytes_per_block - 1))) {
+        fprintf(stderr, "The block size has to be a power of two between 1024 and the cluster size (%u)\n",
+                bytes_per_cluster);
+        return false;
+    }
+    // With 1k blocks, the superblock is in the second block of the first
+    // cluster, which we don't support
+    if (bytes_per_block == 1024 && bytes_per_cluster > 1024) {
+        fprintf(stderr, "A block size of 1024 is only supported for FAT partitions with 1kB clusters\n");
+        return false;
+    }
+    uint32_t cluster_ratio = bytes_per_cluster / bytes_per_block;
+
+    memset(&context->sb, 0, sizeof(context->sb));
+    context->sb.s_magic = EXT4_MAGIC;
+    context->sb.s_state = EXT4_STATE_CLEANLY_UNMOUNTED;
+    context->sb.s_feature_compat = EXT4_FEATURE_COMPAT_SPARSE_SUPER2;
+    context->sb.s_feature_incompat = EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_EXTENTS;
+    if (cluster_ratio > 1) {
+        context->sb.s_feature_ro_compat = EXT4_FEATURE_RO_COMPAT_BIGALLOC;
+    }
+    context->sb.s_desc_size = EXT4_64BIT_DESC_SIZE;
+    context->sb.s_inode_size = EXT4_INODE_SIZE;
+    context->sb.s_rev_level = EXT4_DYNAMIC_REV;
+    context->sb.s_errors = EXT4_ERRORS_DEFAULT;
+    context->sb.s_first_ino = EXT4_FIRST_NON_RSV_INODE;
+    context->sb.s_max_mnt_count = UINT16_MAX;
+    context->sb.s_mkfs_time = static_cast<uint32_t>(time(NULL));
+    uuid_generate(context->sb.s_uuid);
+    read_volume_label(reinterpret_cast<uint8_t *>(context->sb.s_volume_name));
+
+    // Block and cluster bitmaps are one block each. Without bigalloc, clusters
+    // and blocks are the same.
+    context->sb.s_log_block_size = log2(bytes_per_block) - EXT4_BLOCK_SIZE_MIN_LOG2;
+    context->sb.s_log_cluster_size = log2(bytes_per_cluster) - EXT4_BLOCK_SIZE_MIN_LOG2;
+    context->sb.s_first_data_block = bytes_per_block == 1024 ? 1 : 0;
+    context->sb.s_clusters_per_group = min(bytes_per_block * 8, EXT4_MAX_CLUSTERS_PER_GROUP);
+    context->sb.s_blocks_per_group = context->sb.s_clusters_per_group * cluster_ratio;
+    // A trailing partial cluster can't be allocated, just like in the FAT
+    uint64_t block_count = partition_bytes / bytes_per_cluster * cluster_ratio;
+    set_lo_hi(context->sb.s_blocks_count_lo, context->sb.s_blocks_count_hi, block_count);
+    update_geometry();
 
     // Same logic as used in mke2fs: If the last block group would support have
     // fewer than 50 data blocks, than reduce the block count and ignore the
@@ -73,23 +158,39 @@ void init_ext4_sb() {
     // bytes_per_block * 8, but this is easier to implement.
     // We use the sparse_super2 logic from mke2fs, meaning that the last block
     // group always has a super block copy.
-    if (block_count % sb.s_blocks_per_group < block_group_overhead(true) + 50) {
-        set_lo_hi(sb.s_blocks_count_lo, sb.s_blocks_count_hi, block_count);
+    if (block_count % context->sb.s_blocks_per_group < block_group_overhead(true) + 50) {
+        set_lo_hi(context->sb.s_blocks_count_lo, context->sb.s_blocks_count_hi, block_count);
+        update_geometry();
     }
 
     // Same logic as in mke2fs
     uint32_t bg_count = block_group_count();
     if (bg_count > 1) {
-        sb.s_backup_bgs[0] = 1;
+        context->sb.s_backup_bgs[0] = 1;
         if (bg_count > 2) {
-            sb.s_backup_bgs[1] = block_group_count() - 1;
+            context->sb.s_backup_bgs[1] = block_group_count() - 1;
         }
     }
 
-    sb.s_inodes_per_group = min(
-            // This is the same logic as used by mke2fs to determine the inode count
-            sb.s_blocks_per_group * bytes_per_block / EXT4_INODE_RATIO,
-            // Inodes per group need to fit into a one page bitmap
-            bytes_per_block * 8);
-    sb.s_inodes_count = sb.s_inodes_per_group * block_group_count();
+    uint64_t wanted_inodes = used_inodes;
+    if (inode_headroom_percent == INODE_HEADROOM_DEFAULT) {
+        // This is the same logic as used by mke2fs to determine the inode count
+        context->sb.s_inodes_per_group = fit_inodes_per_group(
+                static_cast<uint64_t>(context->sb.s_blocks_per_group) * bytes_per_block / EXT4_INODE_RATIO);
+    } else {
+        wanted_inodes += wanted_inodes * inode_headroom_percent / 100;
+        context->sb.s_inodes_per_group = 0;
+    }
+    // Running out of inodes midway would leave a half converted partition
+    if (static_cast<uint64_t>(context->sb.s_inodes_per_group) * bg_count < wanted_inodes) {
+        context->sb.s_inodes_per_group = inodes_per_group_for(wanted_inodes);
+    }
+    if (static_cast<uint64_t>(context->sb.s_inodes_per_group) * bg_count < used_inodes) {
+        fprintf(stderr, "The %u files and directories need more inodes than the %u block groups can hold\n",
+                used_inodes - EXT4_FIRST_NON_RSV_INODE, bg_count);
+        return false;
+    }
+    context->sb.s_inodes_count = context->sb.s_inodes_per_group * bg_count;
+    update_geometry();
+    return true;
 }
@@ -4,8 +4,10 @@
 #include <stdint.h>
 
 #include "fat.h"
+#include "util.h"
 
 constexpr uint32_t EXT4_ROOT_INODE = 2;
+constexpr uint32_t EXT4_JOURNAL_INODE = 8;
 constexpr uint32_t EXT4_LOST_FOUND_INODE = 11;
 constexpr uint32_t EXT4_FIRST_NON_RSV_INODE = 11;
 constexpr uint16_t EXT4_MAGIC = 0xEF53;
@@ -13,18 +15,23 @@ constexpr uint16_t EXT4_STATE_CLEANLY_UNMOUNTED = 0x0001;
 // Signals support for dynamic inode sizes
 constexpr uint32_t EXT4_DYNAMIC_REV = 1;
 constexpr uint32_t EXT4_BLOCK_SIZE_MIN_LOG2 = 10;
+constexpr uint32_t EXT4_BLOCK_SIZE_MAX_LOG2 = 16;
 constexpr uint32_t EXT4_64BIT_DESC_SIZE = 64;
 constexpr uint16_t EXT4_ERRORS_DEFAULT = 1;  // Continue after error
+// s_jnl_blocks contains a copy of the journal inode's i_block and size
+constexpr uint8_t EXT4_JNL_BACKUP_BLOCKS = 1;
 
+constexpr uint32_t EXT4_FEATURE_COMPAT_HAS_JOURNAL = 0x0004;
 constexpr uint32_t EXT4_FEATURE_COMPAT_SPARSE_SUPER2 = 0x0200;
 constexpr uint32_t EXT4_FEATURE_INCOMPAT_EXTENTS = 0x0040;
 constexpr uint32_t EXT4_FEATURE_INCOMPAT_64BIT = 0x0080;
+constexpr uint32_t EXT4_FEATURE_RO_COMPAT_BIGALLOC = 0x0200;
 
 // Defaults copied from mkfs.ext4
 constexpr uint32_t EXT4_INODE_RATIO = 16384;
 constexpr uint32_t EXT4_INODE_SIZE = 256;
-
-extern struct ext4_super_block sb;
+// Largest block size that can be mounted on systems with 4k pages
+constexpr uint32_t EXT4_DEFAULT_BLOCK_SIZE = 4096;
 
 struct ext4_super_block {
     uint32_t s_inodes_count;        /* Inodes count */
@@ -144,11 +151,45 @@ struct ext4_super_block {
     uint32_t s_checksum;        /* crc32c(superblock) */
 };
 
-void init_ext4_sb();
+// Sizes the inode tables by EXT4_INODE_RATIO, like mke2fs
+constexpr int32_t INODE_HEADROOM_DEFAULT = -1;
+
+// A requested_block_size of 0 selects the default. If the block size is
+// smaller than the FAT cluster size, bigalloc is used with clusters of the
+// FAT cluster size.
+// used_inodes are the inodes the conversion needs, including the reserved
+// ones; there are always at least that many. An inode_headroom_percent other
+// than INODE_HEADROOM_DEFAULT creates only that many more.
+// Returns false if the FAT partition cannot be converted with these parameters
+bool init_ext4_sb(uint32_t requested_block_size, uint32_t used_inodes, int32_t inode_headroom_percent);
+// Returns the inodes per group that hold inode_count inodes in all groups,
+// as far as a group can hold them
+uint32_t inodes_per_group_for(uint64_t inode_count);
+
+bool is_converted(uint8_t *fs);
+// Loads the superblock of a partition that was converted before, to check it.
+// Returns false if its geometry is invalid or doesn't fit the partition.
+bool read_ext4_sb(const uint8_t *fs, uint64_t partition_size);
+
+// Values derived from the superblock, which are needed for almost every block
+// and inode access. Block and cluster sizes are powers of two, so they are
+// stored as shifts.
+struct ext4_geometry {
+    uint32_t block_size;
+    uint32_t block_size_log2;
+    uint32_t cluster_ratio_log2;  // ext4 blocks per cluster
+    uint64_t block_count;
+    uint32_t block_group_count;
+    uint32_t gdt_block_count;
+    uint32_t inode_table_blocks;
+    fast_divisor inodes_per_group;
+};
 
-uint32_t block_size();
+// Has to be called whenever the superblock's layout fields change
+void update_geometry();
 
-uint64_t block_count();
+// The superblock and geometry belong to the conversion context, which also
+// has the block helpers
+#include "conversion_context.h"
 
-uint8_t *block_start(uint64_t block_no);
 #endif //OFS_CONVERT_EXT4_H
@@ -2,44 +2,58 @@
 #include <stdio.h>
 #include <string.h>
 #include "ext4_bg.h"
+#include "partition.h"
+#include "undo_file.h"
 #include "util.h"
 #include "visualizer.h"
 
 
-ext4_group_desc *group_descs;
+// Inode-table blocks staged by the inode cache at a time
+constexpr uint32_t INODE_CACHE_BYTES = 256 * 1024;
+
+// The inode-table blocks of the inodes built last, see start_inode_cache().
+// They are a window of consecutive blocks of a single table.
+struct inode_cache {
+    uint8_t *blocks;  // NULL if the cache is off
+    uint32_t block_capacity;
+    uint32_t first_inode_no;  // Of the first staged block, 0 if nothing is staged
+    uint32_t inode_count;  // Inodes the window covers, up to the end of its table
+    uint32_t used_blocks;  // Staged blocks that hold built inodes
+    uint8_t *table_start;  // Where the first staged block goes
+};
+
+__thread inode_cache staged_inodes;
 
 
 uint32_t block_group_count() {
-    uint64_t block_count = from_lo_hi(sb.s_blocks_count_lo, sb.s_blocks_count_hi);
-    return static_cast<uint32_t>(ceildiv<uint64_t>(block_count, sb.s_blocks_per_group));
+    return context->geometry.block_group_count;
 }
 
 
 uint32_t gdt_block_count() {
-    return ceildiv(block_group_count(), block_size() / sb.s_desc_size);
+    return context->geometry.gdt_block_count;
 }
 
 
 uint32_t block_group_block_count(uint32_t num) {
     uint64_t start = block_group_start(num);
-    uint64_t blocks_total = from_lo_hi(sb.s_blocks_count_lo, sb.s_blocks_count_hi);
-    return min(sb.s_blocks_per_group, static_cast<uint32_t>(blocks_total - start));
+    return min(context->sb.s_blocks_per_group, static_cast<uint32_t>(block_count() - start));
 }
 
 
 uint32_t inode_table_blocks() {
-    return ceildiv(sb.s_inodes_per_group * sb.s_inode_size, block_size());
+    return context->geometry.inode_table_blocks;
 }
 
 
 bool block_group_has_sb_copy(uint32_t bg_num) {
-    return bg_num == 0 || bg_num == sb.s_backup_bgs[0] || bg_num == sb.s_backup_bgs[1];
+    return bg_num == 0 || bg_num == context->sb.s_backup_bgs[0] || bg_num == context->sb.s_backup_bgs[1];
 }
 
 
 uint32_t block_group_overhead(bool has_sb_copy) {
     if (has_sb_copy) {
-        return 3 + gdt_block_count() + sb.s_reserved_gdt_blocks + inode_table_blocks();
+        return 3 + gdt_block_count() + context->sb.s_reserved_gdt_blocks + inode_table_blocks();
     }
 
     return 2 + inode_table_blocks();
@@ -51,40 +65,48 @@ uint32_t block_group_overhead(uint32_t bg_num) {
 }
 
 
+// The group metadata is packed into as few clusters as possible
+uint32_t block_group_overhead_clusters(bool has_sb_copy) {
+    return ceildiv(block_group_overhead(has_sb_copy), blocks_per_cluster());
+}
+
+
 uint64_t block_group_start(uint32_t num) {
-    return sb.s_blocks_per_group * num + sb.s_first_data_block;
+    return context->sb.s_blocks_per_group * num + context->sb.s_first_data_block;
 }
 
 
 fat_extent *create_block_group_meta_extents(uint32_t bg_count) {
-    auto * extents = static_cast<fat_extent *>(malloc((bg_count + 1) * sizeof(fat_extent)));
+    auto * extents = static_cast<fat_extent *>(context_malloc((bg_count + 1) * sizeof(fat_extent)));
 
     for (uint32_t i = 0; i < bg_count; ++i) {
         uint32_t bg_overhead = block_group_overhead(i);
-        if (bg_overhead > 0xFFFF) {
+        uint32_t bg_overhead_clusters = block_group_overhead_clusters(block_group_has_sb_copy(i));
+        if (bg_overhead_clusters > 0xFFFF) {
             fprintf(stderr, "Block group overhead too large\n");
-            exit(1);
+            context_free(extents);
+            return NULL;
         }
 
         uint64_t bg_start = block_group_start(i);
         uint32_t start_cluster = e4blk_to_fat_cl(bg_start);
 
         if (start_cluster) {
-            extents[i] = {0, static_cast<uint16_t>(bg_overhead), start_cluster};
+            extents[i] = {0, static_cast<uint16_t>(bg_overhead_clusters), start_cluster, 0};
         } else {
             // extent would begin before first data cluster
-            uint32_t end_cluster = e4blk_to_fat_cl(bg_start + bg_overhead);
+            uint32_t end_cluster = e4blk_to_fat_cl(bg_start + bg_overhead_clusters * blocks_per_cluster());
             if (end_cluster) {
-                extents[i] = {0, static_cast<uint16_t>(end_cluster - FAT_START_INDEX), FAT_START_INDEX};
+                extents[i] = {0, static_cast<uint16_t>(end_cluster - FAT_START_INDEX), FAT_START_INDEX, 0};
             } else {
                 // if it's entirely before first data cluster, create dummy extent
-                extents[i] = {0, 0, 0};
+                extents[i] = {0, 0, 0, 0};
             }
         }
         visualizer_add_block_range({BlockRange::BlockGroupHeader, bg_start, bg_overhead});
     }
 
-    extents[bg_count] = {0, 1, static_cast<uint32_t>(data_cluster_count())};  // end of the filesystem
+    extents[bg_count] = {0, 1, static_cast<uint32_t>(data_cluster_count()), 0};  // end of the filesystem
 
     return extents;
 }
@@ -95,21 +117,24 @@ void init_ext4_group_descs() {
     uint32_t gdt_blocks = gdt_block_count();
     uint32_t blk_size = block_size();
     uint32_t itable_blocks = inode_table_blocks();
+    uint32_t cluster_ratio = blocks_per_cluster();
 
-    group_descs = static_cast<ext4_group_desc *>(malloc(bg_count * sizeof(ext4_group_desc)));
-    memset(group_descs, 0, bg_count * sizeof(ext4_group_desc));
+    context->group_descs = static_cast<ext4_group_desc *>(context_malloc(bg_count * sizeof(ext4_group_desc)));
+    memset(context->group_descs, 0, bg_count * sizeof(ext4_group_desc));
+    reset_inode_numbers();
 
     for (uint32_t i = 0; i < bg_count; ++i) {
-        ext4_group_desc& bg = group_descs[i];
+        ext4_group_desc& bg = context->group_descs[i];
         uint64_t bg_start_block = block_group_start(i);
-        uint32_t block_count = block_group_block_count(i);
+        // The block bitmap and the free counts are in clusters
+        uint32_t cluster_count = block_group_block_count(i) / cluster_ratio;
         uint32_t used_inodes = i == 0 ? EXT4_FIRST_NON_RSV_INODE : 0;
         bool has_sb_copy = block_group_has_sb_copy(i);
-        uint32_t bg_overhead = block_group_overhead(has_sb_copy);
+        uint32_t bg_overhead_clusters = block_group_overhead_clusters(has_sb_copy);
 
         uint64_t block_bitmap_block;
         if (has_sb_copy) {
-            block_bitmap_block = bg_start_block + 1 + gdt_blocks + sb.s_reserved_gdt_blocks;
+            block_bitmap_block = bg_start_block + 1 + gdt_blocks + context->sb.s_reserved_gdt_blocks;
         } else {
             block_bitmap_block = bg_start_block;
         }
@@ -120,40 +145,106 @@ void init_ext4_group_descs() {
         set_lo_hi(bg.bg_inode_bitmap_lo, bg.bg_inode_bitmap_hi, inode_bitmap_block);
         set_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi, inode_table_block);
         set_lo_hi(bg.bg_free_inodes_count_lo, bg.bg_free_inodes_count_hi,
-                  sb.s_inodes_per_group - used_inodes);
+                  context->sb.s_inodes_per_group - used_inodes);
         set_lo_hi(bg.bg_free_blocks_count_lo, bg.bg_free_blocks_count_hi,
-                  block_count - bg_overhead);
+                  cluster_count - bg_overhead_clusters);
 
         uint8_t *block_bitmap = block_start(block_bitmap_block);
         uint8_t *inode_bitmap = block_start(inode_bitmap_block);
         uint8_t *inode_table = block_start(inode_table_block);
 
         memset(block_bitmap, 0, blk_size);
-        bitmap_set_bits(block_bitmap, 0, bg_overhead);
-        bitmap_set_bits(block_bitmap, block_count, blk_size * 8);
+        bitmap_set_bits(block_bitmap, 0, bg_overhead_clusters);
+        bitmap_set_bits(block_bitmap, cluster_count, blk_size * 8);
         memset(inode_bitmap, 0, blk_size);
         bitmap_set_bits(inode_bitmap, 0, used_inodes);
-        bitmap_set_bits(inode_bitmap, sb.s_inodes_per_group, blk_size * 8);
-        memset(inode_table, 0, blk_size * itable_blocks);
+        bitmap_set_bits(inode_bitmap, context->sb.s_inodes_per_group, blk_size * 8);
+        zeroMapped(inode_table, static_cast<uint64_t>(blk_size) * itable_blocks);
     }
 }
 
 
+void start_inode_cache() {
+    staged_inodes.block_capacity = INODE_CACHE_BYTES / block_size();
+    staged_inodes.blocks = static_cast<uint8_t *>(context_malloc(INODE_CACHE_BYTES));
+    staged_inodes.first_inode_no = 0;
+}
+
+
+// Writes the staged blocks to the inode table as one sequential run
+void flush_staged_inodes() {
+    if (staged_inodes.first_inode_no) {
+        copyMapped(staged_inodes.table_start, staged_inodes.blocks,
+                   static_cast<uint64_t>(staged_inodes.used_blocks) * block_size());
+        staged_inodes.first_inode_no = 0;
+    }
+}
+
+
+void stop_inode_cache() {
+    if (staged_inodes.blocks) {
+        flush_staged_inodes();
+        context_free(staged_inodes.blocks);
+        staged_inodes.blocks = NULL;
+    }
+}
+
+
+// Moves the window to start at the block of a new inode. Inodes are built in
+// ascending order, so the blocks after it only hold zeros yet, and only the
+// first block may hold inodes built before.
+void stage_inode_block(uint32_t bg_num, uint32_t num_in_bg) {
+    flush_staged_inodes();
+    uint32_t blk_size = block_size();
+    uint32_t inodes_per_block = blk_size / context->sb.s_inode_size;
+    uint32_t first_num_in_bg = num_in_bg / inodes_per_block * inodes_per_block;
+    ext4_group_desc& bg = context->group_descs[bg_num];
+    staged_inodes.table_start = block_start(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi))
+                                + static_cast<uint64_t>(first_num_in_bg) * context->sb.s_inode_size;
+    staged_inodes.first_inode_no = bg_num * context->sb.s_inodes_per_group + first_num_in_bg + 1;
+    staged_inodes.inode_count = min(staged_inodes.block_capacity * inodes_per_block,
+                                    context->sb.s_inodes_per_group - first_num_in_bg);
+    staged_inodes.used_blocks = 1;
+    memcpy(staged_inodes.blocks, staged_inodes.table_start, blk_size);
+    memset(staged_inodes.blocks + blk_size, 0, (staged_inodes.block_capacity - 1) * blk_size);
+}
+
+
+// The staged copy of an inode, NULL if it is not staged
+ext4_inode *staged_inode(uint32_t inode_num) {
+    uint32_t index = inode_num - staged_inodes.first_inode_no;
+    if (!staged_inodes.first_inode_no || index >= staged_inodes.inode_count) {
+        return NULL;
+    }
+    return reinterpret_cast<ext4_inode *>(staged_inodes.blocks + index * context->sb.s_inode_size);
+}
+
+
 void add_inode(const ext4_inode& inode, uint32_t inode_num) {
-    uint32_t bg_num = (inode_num - 1) / sb.s_inodes_per_group;
+    uint32_t bg_num = fast_div(inode_num - 1, context->geometry.inodes_per_group);
     if (bg_num >= block_group_count()) {
-        fprintf(stderr, "Not enough inodes in your file system. All your data is trashed now, sorry!");
-        exit(1);
+        fprintf(stderr, "Not enough inodes in your file system. All your data is trashed now, sorry!\n");
+        fail_conversion();
     }
 
-    uint32_t num_in_bg = (inode_num - 1) % sb.s_inodes_per_group;
-    ext4_group_desc& bg = group_descs[bg_num];
+    uint32_t num_in_bg = fast_mod(inode_num - 1, context->geometry.inodes_per_group);
+    ext4_group_desc& bg = context->group_descs[bg_num];
 
     uint8_t *inode_bitmap = block_start(from_lo_hi(bg.bg_inode_bitmap_lo, bg.bg_inode_bitmap_hi));
-    uint8_t *inode_table = block_start(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi));
-
     bitmap_set_bit(inode_bitmap, num_in_bg);
-    memcpy(inode_table + num_in_bg * sb.s_inode_size, &inode, sizeof(inode));
+    if (staged_inodes.blocks) {
+        ext4_inode *staged = staged_inode(inode_num);
+        if (!staged) {
+            stage_inode_block(bg_num, num_in_bg);
+            staged = staged_inode(inode_num);
+        }
+        uint32_t block_no = (inode_num - staged_inodes.first_inode_no) * context->sb.s_inode_size / block_size();
+        staged_inodes.used_blocks = block_no + 1;
+        memcpy(staged, &inode, sizeof(inode));
+    } else {
+        uint8_t *inode_table = block_start(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi));
+        memcpy(inode_table + num_in_bg * context->sb.s_inode_size, &inode, sizeof(inode));
+    }
 
     decr_lo_hi(bg.bg_free_inodes_count_lo, bg.bg_free_inodes_count_hi);
     if (inode.i_mode & S_IFDIR) {
@@ -163,12 +254,10 @@ void add_inode(const ext4_inode& inode, uint32_t inode_num) {
 
 
 void add_reserved_inode(const ext4_inode& inode, uint32_t inode_num) {
-    uint32_t bg_num = (inode_num - 1) / sb.s_inodes_per_group;
-    uint32_t num_in_bg = (inode_num - 1) % sb.s_inodes_per_group;
-    ext4_group_desc& bg = group_descs[bg_num];
+    uint32_t bg_num = fast_div(inode_num - 1, context->geometry.inodes_per_group);
+    ext4_group_desc& bg = context->group_descs[bg_num];
 
-    uint8_t *inode_table = block_start(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi));
-    memcpy(inode_table + num_in_bg * sb.s_inode_size, &inode, sizeof(inode));
+    memcpy(&get_existing_inode(inode_num), &inode, sizeof(inode));
     if (inode.i_mode & S_IFDIR) {
         incr_lo_hi(bg.bg_used_dirs_count_lo, bg.bg_used_dirs_count_hi);
     }
@@ -177,51 +266,110 @@ void add_reserved_inode(const ext4_inode& inode, uint32_t inode_num) {
 
 void add_extent_to_block_bitmap(uint64_t blocks_begin, uint64_t blocks_end) {
     // We assume the extent is correct, i.e. only inside a single block group
-    auto bg_num = static_cast<uint32_t>((blocks_begin - sb.s_first_data_block) / sb.s_blocks_per_group);
-    ext4_group_desc& bg = group_descs[bg_num];
+    auto bg_num = static_cast<uint32_t>((blocks_begin - context->sb.s_first_data_block) / context->sb.s_blocks_per_group);
+    ext4_group_desc& bg = context->group_descs[bg_num];
     uint64_t bg_block_start = block_group_start(bg_num);
     uint8_t *block_bitmap = block_start(from_lo_hi(bg.bg_block_bitmap_lo, bg.bg_block_bitmap_hi));
 
-    bitmap_set_bits(block_bitmap,
-                    static_cast<uint32_t>(blocks_begin - bg_block_start),
-                    static_cast<uint32_t>(blocks_end - bg_block_start));
-    decr_lo_hi(bg.bg_free_blocks_count_lo, bg.bg_free_blocks_count_hi,
-               static_cast<uint32_t>(blocks_end - blocks_begin));
+    uint32_t clusters_begin = static_cast<uint32_t>((blocks_begin - bg_block_start) >> context->geometry.cluster_ratio_log2);
+    uint32_t clusters_end = ceildiv<uint64_t>(blocks_end - bg_block_start, blocks_per_cluster());
+    bitmap_set_bits(block_bitmap, clusters_begin, clusters_end);
+    decr_lo_hi(bg.bg_free_blocks_count_lo, bg.bg_free_blocks_count_hi, clusters_end - clusters_begin);
 }
 
 
 ext4_inode& get_existing_inode(uint32_t inode_num) {
-    uint32_t bg_num = (inode_num - 1) / sb.s_inodes_per_group;
-    uint32_t num_in_bg = (inode_num - 1) % sb.s_inodes_per_group;
-    ext4_group_desc& bg = group_descs[bg_num];
+    ext4_inode *staged = staged_inode(inode_num);
+    if (staged) {
+        return *staged;
+    }
+    uint32_t bg_num = fast_div(inode_num - 1, context->geometry.inodes_per_group);
+    uint32_t num_in_bg = fast_mod(inode_num - 1, context->geometry.inodes_per_group);
+    ext4_group_desc& bg = context->group_descs[bg_num];
     uint8_t *inode_table = block_start(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi));
-    return *reinterpret_cast<ext4_inode*>(inode_table + num_in_bg * sb.s_inode_size);
+    return *reinterpret_cast<ext4_inode*>(inode_table + num_in_bg * context->sb.s_inode_size);
 }
 
 
 void write_sb_copy(uint32_t bg_num) {
-    ext4_super_block sb_copy = sb;
+    ext4_super_block sb_copy = context->sb;
     sb_copy.s_block_group_nr = bg_num;
     uint64_t bg_block_start = block_group_start(bg_num);
     uint32_t sb_offset = (bg_num == 0 && block_size() != 1024) ? 1024 : 0;
     memcpy(block_start(bg_block_start) + sb_offset, &sb_copy,
            sizeof(ext4_super_block));
-    memcpy(block_start(bg_block_start + 1), group_descs,
+    memcpy(block_start(bg_block_start + 1), context->group_descs,
            block_group_count() * sizeof(ext4_group_desc));
 }
 
 
+void free_ext4_group_descs() {
+    context_free(context->group_descs);
+    context->group_descs = NULL;
+}
+
+
 void finalize_block_groups_on_disk() {
     uint32_t bg_count = block_group_count();
     for (uint16_t i = 0; i < bg_count; ++i) {
-        ext4_group_desc& bg = group_descs[i];
-        sb.s_free_inodes_count += from_lo_hi(bg.bg_free_inodes_count_lo,
+        ext4_group_desc& bg = context->group_descs[i];
+        context->sb.s_free_inodes_count += from_lo_hi(bg.bg_free_inodes_count_lo,
                                              bg.bg_free_inodes_count_hi);
-        incr_lo_hi(sb.s_free_blocks_count_lo, sb.s_free_blocks_count_hi,
-                   from_lo_hi(bg.bg_free_blocks_count_lo, bg.bg_free_blocks_count_hi));
+        // The group descriptors count free clusters, the superblock free blocks
+        incr_lo_hi(context->sb.s_free_blocks_count_lo, context->sb.s_free_blocks_count_hi,
+                   static_cast<uint64_t>(from_lo_hi(bg.bg_free_blocks_count_lo, bg.bg_free_blocks_count_hi))
+                   * blocks_per_cluster());
     }
 
     write_sb_copy(0);
-    write_sb_copy(sb.s_backup_bgs[0]);
-    write_sb_copy(sb.s_backup_bgs[1]);
+    write_sb_copy(context->sb.s_backup_bgs[0]);
+    write_sb_copy(context->sb.s_backup_bgs[1]);
+}
+
+
+bool discard_run(Partition *partition, uint64_t begin_block, uint64_t end_block, uint64_t& discarded_blocks) {
+    if (begin_block == end_block) {
+        return true;
+    }
+    uint64_t offset = begin_block * block_size(), length = (end_block - begin_block) * block_size();
+    if (!save_undo_range(offset, length)) {
+        return false;
+    }
+    if (!discardPartitionRange(partition, offset, length)) {
+        perror("Failed to discard free blocks");
+        return false;
+    }
+    discarded_blocks += end_block - begin_block;
+    return true;
+}
+
+
+// Free runs are coalesced, also across block group boundaries, so that each
+// run takes a single request
+void discard_free_blocks(Partition *partition) {
+    uint32_t cluster_ratio = blocks_per_cluster();
+    uint64_t run_begin = 0, run_end = 0, discarded_blocks = 0;
+    for (uint32_t i = 0; i < block_group_count(); ++i) {
+        uint64_t bg_start_block = block_group_start(i);
+        uint32_t cluster_count = block_group_block_count(i) / cluster_ratio;
+        uint8_t *block_bitmap = block_start(from_lo_hi(context->group_descs[i].bg_block_bitmap_lo, context->group_descs[i].bg_block_bitmap_hi));
+
+        for (uint32_t cluster = 0; cluster < cluster_count; ++cluster) {
+            if (block_bitmap[cluster / 8] & (1 << (cluster % 8))) {
+                continue;
+            }
+            uint64_t block = bg_start_block + static_cast<uint64_t>(cluster) * cluster_ratio;
+            if (block != run_end) {
+                if (!discard_run(partition, run_begin, run_end, discarded_blocks)) {
+                    return;
+                }
+                run_begin = block;
+            }
+            run_end = block + cluster_ratio;
+        }
+    }
+    if (discard_run(partition, run_begin, run_end, discarded_blocks)) {
+        printf("Discarded %llu MiB of free blocks\n",
+               static_cast<unsigned long long>(discarded_blocks * block_size() / (1024 * 1024)));
+    }
 }
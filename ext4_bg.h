@@ -5,7 +5,7 @@
 #include "ext4.h"
 #include "ext4_inode.h"
 
-extern struct ext4_group_desc *group_descs;
+struct Partition;
 
 struct ext4_group_desc {
     uint32_t bg_block_bitmap_lo; /* Blocks bitmap block */
@@ -38,12 +38,25 @@ uint64_t block_group_start(uint32_t num);
 uint32_t gdt_block_count();
 uint32_t block_group_overhead(bool has_sb_copy);
 uint32_t block_group_overhead(uint32_t bg_num);
+uint32_t block_group_overhead_clusters(bool has_sb_copy);
+uint32_t block_group_block_count(uint32_t num);
+bool block_group_has_sb_copy(uint32_t bg_num);
+// Returns NULL if the metadata of a block group does not fit in a FAT extent
 fat_extent *create_block_group_meta_extents(uint32_t bg_count);
 void init_ext4_group_descs();
+// Stages the inode-table blocks of the inodes built next in memory. The tree
+// builder modifies an inode repeatedly while it builds it, and the staged
+// blocks are written out in inode order as whole blocks once it has moved on.
+// get_existing_inode() returns the staged copy of a staged inode.
+void start_inode_cache();
+// Writes out the staged blocks, the inode tables are complete afterwards
+void stop_inode_cache();
 void add_inode(const ext4_inode& inode, uint32_t inode_num);
 void add_reserved_inode(const ext4_inode& inode, uint32_t inode_num);
 void add_extent_to_block_bitmap(uint64_t blocks_begin, uint64_t blocks_end);
 ext4_inode& get_existing_inode(uint32_t inode_num);
+void free_ext4_group_descs();
 void finalize_block_groups_on_disk();
+void discard_free_blocks(Partition *partition);
 
 #endif //OFS_CONVERT_EXT4_BG_H
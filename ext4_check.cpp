@@ -0,0 +1,414 @@
+#include "ext4.h"
+#include "ext4_bg.h"
+#include "ext4_check.h"
+#include "ext4_dentry.h"
+#include "ext4_extent.h"
+#include "ext4_inode.h"
+#include "util.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Further problems are only counted
+constexpr uint32_t CHECK_MAX_REPORTS = 20;
+
+struct ext4_checker {
+    const ext4_group_desc *descs;
+    uint32_t checks;
+    // According to the extent trees and group metadata. Counted from
+    // s_first_data_block, so that each group starts at a whole byte.
+    uint8_t *used_clusters;
+    uint64_t cluster_count;
+    uint32_t *link_counts;  // Number of dentries per inode, up to max_inode_no
+    uint32_t max_inode_no;
+    uint32_t *used_dirs;  // Per block group
+    uint32_t error_count;
+};
+
+void report(ext4_checker *checker, const char *format, ...) {
+    if (checker->error_count++ >= CHECK_MAX_REPORTS) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "Check failed: ");
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+bool is_bit_set(const uint8_t *bitmap, uint64_t bit_num) {
+    return bitmap[bit_num / 8] & (1 << (bit_num % 8));
+}
+
+// Whether blocks [first_block, first_block + count) lie within the file system
+bool is_block_range_valid(uint64_t first_block, uint64_t count) {
+    return first_block >= context->sb.s_first_data_block && first_block < block_count() && count <= block_count() - first_block;
+}
+
+// The accessors below trust these, so check_ext4() checks them first
+uint8_t *group_block_bitmap(const ext4_checker *checker, uint32_t bg_num) {
+    const ext4_group_desc& bg = checker->descs[bg_num];
+    return block_start(from_lo_hi(bg.bg_block_bitmap_lo, bg.bg_block_bitmap_hi));
+}
+
+uint8_t *group_inode_bitmap(const ext4_checker *checker, uint32_t bg_num) {
+    const ext4_group_desc& bg = checker->descs[bg_num];
+    return block_start(from_lo_hi(bg.bg_inode_bitmap_lo, bg.bg_inode_bitmap_hi));
+}
+
+bool is_inode_used(const ext4_checker *checker, uint32_t inode_no) {
+    uint32_t bg_num = fast_div(inode_no - 1, context->geometry.inodes_per_group);
+    return is_bit_set(group_inode_bitmap(checker, bg_num), fast_mod(inode_no - 1, context->geometry.inodes_per_group));
+}
+
+const ext4_inode *checked_inode(const ext4_checker *checker, uint32_t inode_no) {
+    const ext4_group_desc& bg = checker->descs[fast_div(inode_no - 1, context->geometry.inodes_per_group)];
+    uint8_t *inode_table = block_start(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi));
+    return reinterpret_cast<const ext4_inode *>(inode_table + fast_mod(inode_no - 1, context->geometry.inodes_per_group) * context->sb.s_inode_size);
+}
+
+// Marks the clusters of [begin_block, end_block) as used by owner, an inode
+// number or 0 for group metadata. Returns the number of clusters marked.
+uint64_t mark_clusters(ext4_checker *checker, uint64_t begin_block, uint64_t end_block, uint32_t owner) {
+    if (begin_block < context->sb.s_first_data_block || begin_block >= end_block || end_block > block_count()) {
+        report(checker, "blocks %llu to %llu of inode %u are outside the file system",
+               static_cast<unsigned long long>(begin_block), static_cast<unsigned long long>(end_block), owner);
+        return 0;
+    }
+
+    uint64_t begin = (begin_block - context->sb.s_first_data_block) >> context->geometry.cluster_ratio_log2,
+             end = ((end_block - 1 - context->sb.s_first_data_block) >> context->geometry.cluster_ratio_log2) + 1;
+    for (uint64_t cluster = begin; cluster < end; cluster++) {
+        if (is_bit_set(checker->used_clusters, cluster)) {
+            report(checker, "block %llu is used twice, the second time by %s %u",
+                   static_cast<unsigned long long>((cluster << context->geometry.cluster_ratio_log2) + context->sb.s_first_data_block),
+                   owner ? "inode" : "block group", owner);
+            return cluster - begin;
+        }
+        checker->used_clusters[cluster / 8] |= 1 << (cluster % 8);
+    }
+    return end - begin;
+}
+
+struct extent_walk {
+    uint32_t inode_no;
+    uint64_t clusters;
+    uint64_t next_logical_block;
+    uint64_t initialized_end;  // Logical block after the last initialized one
+};
+
+void check_extent_node(ext4_checker *checker, extent_walk& walk, const ext4_extent_header *header, uint16_t depth) {
+    if (!is_valid_extent_node(header) || header->eh_depth != depth) {
+        report(checker, "inode %u has an invalid extent tree node", walk.inode_no);
+        return;
+    }
+
+    if (depth) {
+        auto *idx = reinterpret_cast<const ext4_extent_idx *>(header + 1);
+        for (uint16_t i = 0; i < header->eh_entries; i++) {
+            uint64_t child_block = from_lo_hi(idx[i].ei_leaf_lo, idx[i].ei_leaf_hi);
+            if (!is_block_range_valid(child_block, 1)) {
+                report(checker, "index %u of inode %u points to block %llu outside the file system",
+                       i, walk.inode_no, static_cast<unsigned long long>(child_block));
+                continue;
+            }
+            // A block used before, like an ancestor, is not followed again
+            uint64_t marked = mark_clusters(checker, child_block, child_block + 1, walk.inode_no);
+            walk.clusters += marked;
+            if (!marked) {
+                continue;
+            }
+
+            auto *child = reinterpret_cast<const ext4_extent_header *>(block_start(child_block));
+            // The first entry of extents and indexes alike is its logical block
+            if (child->eh_entries && *reinterpret_cast<const uint32_t *>(child + 1) != idx[i].ei_block) {
+                report(checker, "index %u of inode %u starts at logical block %u, its child at %u",
+                       i, walk.inode_no, idx[i].ei_block, *reinterpret_cast<const uint32_t *>(child + 1));
+            }
+            check_extent_node(checker, walk, child, depth - 1);
+        }
+        return;
+    }
+
+    auto *extents = reinterpret_cast<const ext4_extent *>(header + 1);
+    for (uint16_t i = 0; i < header->eh_entries; i++) {
+        bool is_unwritten = extents[i].ee_len > EXT4_MAX_INIT_EXTENT_LEN;
+        uint32_t length = is_unwritten ? extents[i].ee_len - EXT4_MAX_INIT_EXTENT_LEN : extents[i].ee_len;
+        if (!length || extents[i].ee_block < walk.next_logical_block) {
+            report(checker, "extent %u of inode %u is empty, unsorted or overlapping", i, walk.inode_no);
+            continue;
+        }
+
+        uint64_t start_block = from_lo_hi(extents[i].ee_start_lo, extents[i].ee_start_hi);
+        walk.clusters += mark_clusters(checker, start_block, start_block + length, walk.inode_no);
+        walk.next_logical_block = extents[i].ee_block + length;
+        if (!is_unwritten) {
+            walk.initialized_end = walk.next_logical_block;
+        }
+    }
+}
+
+bool is_dot_dentry(const ext4_dentry *dentry, uint16_t dot_count) {
+    return dentry->name_len == dot_count && !memcmp(dentry->name, "..", dot_count);
+}
+
+void check_directory(ext4_checker *checker, uint32_t inode_no, const ext4_inode *inode) {
+    uint64_t size = from_lo_hi(inode->i_size_lo, inode->i_size_high);
+    if (!size || size % block_size()) {
+        report(checker, "directory inode %u has a size of %llu", inode_no, static_cast<unsigned long long>(size));
+        return;
+    }
+
+    for (uint32_t block = 0; block < size / block_size(); block++) {
+        uint64_t block_no = map_logical_block(inode, block);
+        if (!block_no) {
+            report(checker, "block %u of directory inode %u is not mapped within the file system", block, inode_no);
+            return;
+        }
+
+        uint8_t *dir_block = block_start(block_no);
+        uint32_t position = 0;
+        for (uint32_t index = 0; position < block_size(); index++) {
+            auto *dentry = reinterpret_cast<const ext4_dentry *>(dir_block + position);
+            if (dentry->rec_len < 8 || dentry->rec_len % 4 || dentry->rec_len > block_size() - position
+                || dentry->name_len + 8u > dentry->rec_len) {
+                report(checker, "directory inode %u has an invalid entry in block %u at offset %u",
+                       inode_no, block, position);
+                return;
+            }
+            if (block == 0 && index < 2 && (!is_dot_dentry(dentry, index + 1) || (index == 0 && dentry->inode != inode_no))) {
+                report(checker, "directory inode %u does not start with . and ..", inode_no);
+            }
+
+            if (dentry->inode) {
+                if (dentry->inode > context->sb.s_inodes_count || !is_inode_used(checker, dentry->inode)) {
+                    report(checker, "directory inode %u refers to unused inode %u", inode_no, dentry->inode);
+                } else if (dentry->inode <= checker->max_inode_no) {
+                    checker->link_counts[dentry->inode]++;
+                }
+            }
+            position += dentry->rec_len;
+        }
+    }
+}
+
+void check_inode(ext4_checker *checker, uint32_t inode_no, uint32_t bg_num) {
+    const ext4_inode *inode = checked_inode(checker, inode_no);
+    if (!inode->i_mode) {
+        // The reserved inodes are marked as used whether they exist or not,
+        // lost+found already before it is built
+        bool is_built = inode_no == EXT4_LOST_FOUND_INODE ? checker->checks & CHECK_LINKS : inode_no >= context->sb.s_first_ino;
+        if (is_built) {
+            report(checker, "inode %u is marked as used, but empty", inode_no);
+        }
+        return;
+    }
+
+    if (inode->ext_header.eh_depth > EXT4_MAX_EXTENT_DEPTH) {
+        report(checker, "inode %u has an extent tree of depth %u", inode_no, inode->ext_header.eh_depth);
+        return;
+    }
+    extent_walk walk = {inode_no, 0, 0, 0};
+    check_extent_node(checker, walk, &inode->ext_header, inode->ext_header.eh_depth);
+    uint64_t expected_blocks = walk.clusters * (meta_info.cluster_size / 512);
+    if (from_lo_hi(inode->i_blocks_lo, inode->l_i_blocks_high) != expected_blocks) {
+        report(checker, "inode %u has an i_blocks of %llu instead of %llu", inode_no,
+               static_cast<unsigned long long>(from_lo_hi(inode->i_blocks_lo, inode->l_i_blocks_high)),
+               static_cast<unsigned long long>(expected_blocks));
+    }
+
+    if ((inode->i_mode & 0xF000) == S_IFDIR) {
+        checker->used_dirs[bg_num]++;
+        check_directory(checker, inode_no, inode);
+    } else {
+        uint64_t size = from_lo_hi(inode->i_size_lo, inode->i_size_high);
+        if (walk.initialized_end > (size + block_size() - 1) >> context->geometry.block_size_log2) {
+            report(checker, "inode %u has initialized blocks past its end", inode_no);
+        }
+    }
+}
+
+uint32_t find_max_inode_no(const ext4_checker *checker) {
+    for (uint32_t bg_num = block_group_count(); bg_num-- > 0; ) {
+        uint8_t *inode_bitmap = group_inode_bitmap(checker, bg_num);
+        for (uint32_t i = context->sb.s_inodes_per_group; i-- > 0; ) {
+            if (is_bit_set(inode_bitmap, i)) {
+                return bg_num * context->sb.s_inodes_per_group + i + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Calls check_inode() or the link count check for every used inode
+void check_inodes(ext4_checker *checker, bool check_links) {
+    for (uint32_t bg_num = 0; bg_num < block_group_count(); bg_num++) {
+        uint8_t *inode_bitmap = group_inode_bitmap(checker, bg_num);
+        for (uint32_t i = 0; i < context->sb.s_inodes_per_group; i++) {
+            if (!is_bit_set(inode_bitmap, i)) {
+                continue;
+            }
+            uint32_t inode_no = bg_num * context->sb.s_inodes_per_group + i + 1;
+            if (!check_links) {
+                check_inode(checker, inode_no, bg_num);
+                continue;
+            }
+
+            const ext4_inode *inode = checked_inode(checker, inode_no);
+            // The journal is the only inode without a directory entry
+            if (inode->i_mode && inode_no != context->sb.s_journal_inum
+                && inode->i_links_count != checker->link_counts[inode_no]) {
+                report(checker, "inode %u has a link count of %u instead of %u", inode_no,
+                       inode->i_links_count, checker->link_counts[inode_no]);
+            }
+        }
+    }
+}
+
+uint32_t count_free_bits(const uint8_t *bitmap, uint32_t begin, uint32_t end) {
+    uint32_t free_bits = 0;
+    for (; begin < end && begin % 8; begin++) {
+        free_bits += !is_bit_set(bitmap, begin);
+    }
+    for (; begin + 8 <= end; begin += 8) {
+        free_bits += 8 - __builtin_popcount(bitmap[begin / 8]);
+    }
+    for (; begin < end; begin++) {
+        free_bits += !is_bit_set(bitmap, begin);
+    }
+    return free_bits;
+}
+
+// Returns the first bit in [0, bit_count) that differs, or bit_count
+uint32_t find_bitmap_difference(const uint8_t *bitmap, const uint8_t *other, uint32_t bit_count) {
+    uint32_t bit = 0;
+    // Skips the equal part bytewise, as memcmp() cannot tell where it ends
+    while (bit + 8 <= bit_count && bitmap[bit / 8] == other[bit / 8]) {
+        bit += 8;
+    }
+    while (bit < bit_count && is_bit_set(bitmap, bit) == is_bit_set(other, bit)) {
+        bit++;
+    }
+    return bit;
+}
+
+void check_block_groups(ext4_checker *checker, uint64_t& free_clusters, uint64_t& free_inodes) {
+    for (uint32_t bg_num = 0; bg_num < block_group_count(); bg_num++) {
+        const ext4_group_desc& bg = checker->descs[bg_num];
+        uint64_t bg_start_block = block_group_start(bg_num);
+        uint32_t cluster_count = block_group_block_count(bg_num) >> context->geometry.cluster_ratio_log2;
+        uint32_t overhead = block_group_overhead_clusters(block_group_has_sb_copy(bg_num));
+        mark_clusters(checker, bg_start_block, bg_start_block + (static_cast<uint64_t>(overhead) << context->geometry.cluster_ratio_log2), 0);
+
+        uint8_t *block_bitmap = group_block_bitmap(checker, bg_num);
+        const uint8_t *used_clusters = checker->used_clusters + static_cast<uint64_t>(bg_num) * (context->sb.s_clusters_per_group / 8);
+        uint32_t cluster = find_bitmap_difference(block_bitmap, used_clusters, cluster_count);
+        if (cluster < cluster_count) {
+            bool is_used = is_bit_set(used_clusters, cluster);
+            report(checker, "block %llu is %s, but marked as %s in the block bitmap",
+                   static_cast<unsigned long long>(bg_start_block + (static_cast<uint64_t>(cluster) << context->geometry.cluster_ratio_log2)),
+                   is_used ? "used" : "free", is_used ? "free" : "used");
+        }
+
+        uint8_t *inode_bitmap = group_inode_bitmap(checker, bg_num);
+        uint32_t free_bg_clusters = count_free_bits(block_bitmap, 0, cluster_count);
+        uint32_t free_bg_inodes = count_free_bits(inode_bitmap, 0, context->sb.s_inodes_per_group);
+        if (count_free_bits(block_bitmap, cluster_count, block_size() * 8)
+            || count_free_bits(inode_bitmap, context->sb.s_inodes_per_group, block_size() * 8)) {
+            report(checker, "the bitmap padding of block group %u is not set", bg_num);
+        }
+        if (from_lo_hi(bg.bg_free_blocks_count_lo, bg.bg_free_blocks_count_hi) != free_bg_clusters
+            || from_lo_hi(bg.bg_free_inodes_count_lo, bg.bg_free_inodes_count_hi) != free_bg_inodes
+            || from_lo_hi(bg.bg_used_dirs_count_lo, bg.bg_used_dirs_count_hi) != checker->used_dirs[bg_num]) {
+            report(checker, "the counters of block group %u don't match its bitmaps", bg_num);
+        }
+        free_clusters += free_bg_clusters;
+        free_inodes += free_bg_inodes;
+    }
+}
+
+void check_superblocks(ext4_checker *checker, uint64_t free_clusters, uint64_t free_inodes) {
+    auto *primary_sb = reinterpret_cast<const ext4_super_block *>(meta_info.fs_start + 1024);
+    if (from_lo_hi(primary_sb->s_free_blocks_count_lo, primary_sb->s_free_blocks_count_hi)
+            != free_clusters << context->geometry.cluster_ratio_log2
+        || primary_sb->s_free_inodes_count != free_inodes) {
+        report(checker, "the superblock's free counters don't match the block groups");
+    }
+
+    uint8_t *primary_gdt = block_start(context->sb.s_first_data_block + 1);
+    for (uint32_t i = 0; i < 2; i++) {
+        uint32_t bg_num = primary_sb->s_backup_bgs[i];
+        if (!bg_num) {
+            continue;
+        }
+        if (bg_num >= block_group_count()) {
+            report(checker, "the superblock has its copy in block group %u, which doesn't exist", bg_num);
+            continue;
+        }
+        uint64_t bg_block_start = block_group_start(bg_num);
+        ext4_super_block expected_sb = *primary_sb;
+        expected_sb.s_block_group_nr = bg_num;
+        if (memcmp(block_start(bg_block_start), &expected_sb, sizeof expected_sb)
+            || memcmp(block_start(bg_block_start + 1), primary_gdt, block_group_count() * context->sb.s_desc_size)) {
+            report(checker, "the superblock or GDT copy in block group %u differs", bg_num);
+        }
+    }
+}
+
+// Counts the problems beyond the reported ones, returns whether there were none
+bool end_check(const ext4_checker *checker) {
+    if (checker->error_count > CHECK_MAX_REPORTS) {
+        fprintf(stderr, "Check failed: %u more problems\n", checker->error_count - CHECK_MAX_REPORTS);
+    }
+    return !checker->error_count;
+}
+
+// Reports the groups whose bitmaps or inode table lie outside the file system
+bool check_group_locations(ext4_checker *checker) {
+    bool are_valid = true;
+    for (uint32_t bg_num = 0; bg_num < block_group_count(); bg_num++) {
+        const ext4_group_desc& bg = checker->descs[bg_num];
+        if (!is_block_range_valid(from_lo_hi(bg.bg_block_bitmap_lo, bg.bg_block_bitmap_hi), 1)
+            || !is_block_range_valid(from_lo_hi(bg.bg_inode_bitmap_lo, bg.bg_inode_bitmap_hi), 1)
+            || !is_block_range_valid(from_lo_hi(bg.bg_inode_table_lo, bg.bg_inode_table_hi),
+                                     context->geometry.inode_table_blocks)) {
+            report(checker, "the bitmaps or inode table of block group %u lie outside the file system", bg_num);
+            are_valid = false;
+        }
+    }
+    return are_valid;
+}
+
+bool check_ext4(const ext4_group_desc *descs, uint32_t checks) {
+    ext4_checker checker;
+    checker.descs = descs;
+    checker.checks = checks;
+    checker.error_count = 0;
+    if (!check_group_locations(&checker)) {
+        // Nothing else can be found without them
+        return end_check(&checker);
+    }
+    checker.cluster_count = (block_count() - context->sb.s_first_data_block) >> context->geometry.cluster_ratio_log2;
+    checker.used_clusters = static_cast<uint8_t *>(context_calloc((checker.cluster_count + 7) / 8, 1));
+    checker.max_inode_no = find_max_inode_no(&checker);
+    checker.link_counts = static_cast<uint32_t *>(context_calloc(checker.max_inode_no + 1, sizeof(uint32_t)));
+    checker.used_dirs = static_cast<uint32_t *>(context_calloc(block_group_count(), sizeof(uint32_t)));
+
+    uint64_t free_clusters = 0, free_inodes = 0;
+    check_inodes(&checker, false);
+    check_block_groups(&checker, free_clusters, free_inodes);
+    if (checks & CHECK_LINKS) {
+        check_inodes(&checker, true);
+    }
+    if (checks & CHECK_SUPERBLOCKS) {
+        check_superblocks(&checker, free_clusters, free_inodes);
+    }
+
+    context_free(checker.used_clusters);
+    context_free(checker.link_counts);
+    context_free(checker.used_dirs);
+    return end_check(&checker);
+}
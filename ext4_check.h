@@ -0,0 +1,25 @@
+#ifndef OFS_CONVERT_EXT4_CHECK_H
+#define OFS_CONVERT_EXT4_CHECK_H
+
+#include <stdint.h>
+
+struct ext4_group_desc;
+
+// What check_ext4() checks. Which parts of the metadata are complete depends
+// on how far the conversion has come.
+// Extent trees, i_blocks, directory blocks, and the block and inode bitmaps
+// and counters of the group descriptors
+constexpr uint32_t CHECK_TREE = 1;
+// Link counts, once all directories including lost+found exist
+constexpr uint32_t CHECK_LINKS = 2;
+// Superblock counters and the superblock and GDT copies, once they are written
+constexpr uint32_t CHECK_SUPERBLOCKS = 4;
+constexpr uint32_t CHECK_ALL = CHECK_TREE | CHECK_LINKS | CHECK_SUPERBLOCKS;
+
+// Cross-checks the ext4 metadata, similar to fsck.ext4 -n. descs are the
+// group descriptors to check against, which are only on disk once the
+// conversion is finalized. Prints the problems found and returns false if
+// there are any.
+bool check_ext4(const ext4_group_desc *descs, uint32_t checks);
+
+#endif //OFS_CONVERT_EXT4_CHECK_H
@@ -8,6 +8,9 @@
 
 #include <string.h>
 #include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -16,50 +19,109 @@ uint32_t next_multiple_of_four(uint32_t n) {
     return ceildiv(n, 4u) * 4;
 }
 
-// Adapted from https://www.cprogramming.com/tutorial/utf8.c
-int ucs2toutf8(uint8_t *dest, uint8_t *dest_end, uint16_t *src, int src_size) {
-    uint16_t ch;
+bool is_high_surrogate(uint16_t ch) {
+    return ch >= 0xD800 && ch < 0xDC00;
+}
+
+bool is_low_surrogate(uint16_t ch) {
+    return ch >= 0xDC00 && ch < 0xE000;
+}
+
+#ifdef __SSE2__
+// Returns whether all 8 code units are ASCII and none of them ends the string
+bool is_ascii_block(__m128i units) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(static_cast<short>(0xFF80))), zero);
+    __m128i nul = _mm_cmpeq_epi16(units, zero);
+    return _mm_movemask_epi8(_mm_andnot_si128(nul, ascii)) == 0xFFFF;
+}
+#endif
+
+// Converts the 0-terminated (or src_size long) UTF-16 string src to UTF-8.
+// Surrogate pairs become 4-byte sequences, unpaired surrogates are encoded
+// like any other code unit. Writes no more than dest_end - dest bytes and
+// never cuts a character in half. Returns the number of bytes written.
+int utf16toutf8(uint8_t *dest, uint8_t *dest_end, const uint16_t *src, int src_size) {
     uint8_t *pos = dest;
-    for (int i = 0; i < src_size && src[i]; i++) {
-        ch = src[i];
-        if (ch < 0x80) {
-            if (pos >= dest_end)
-                return pos - dest;
-            *pos++ = (char)ch;
-        } else if (ch < 0x800) {
-            if (pos >= dest_end-1)
-                return pos - dest;
-            *pos++ = (ch>>6) | 0xC0;
-            *pos++ = (ch & 0x3F) | 0x80;
-        } else {
-            if (pos >= dest_end-2)
-                return pos - dest;
-            *pos++ = (ch>>12) | 0xE0;
-            *pos++ = ((ch>>6) & 0x3F) | 0x80;
-            *pos++ = (ch & 0x3F) | 0x80;
+    int i = 0;
+    while (i < src_size) {
+#ifdef __SSE2__
+        // Names are mostly ASCII, which is narrowed 8 code units at a time
+        if (i + 8 <= src_size && dest_end - pos >= 8) {
+            __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+            if (is_ascii_block(units)) {
+                _mm_storel_epi64(reinterpret_cast<__m128i *>(pos), _mm_packus_epi16(units, units));
+                pos += 8;
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        uint32_t ch = src[i];
+        if (!ch) {
+            break;
         }
+        int units = 1;
+        if (is_high_surrogate(ch) && i + 1 < src_size && is_low_surrogate(src[i + 1])) {
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (src[i + 1] - 0xDC00);
+            units = 2;
+        }
+
+        int length = ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+        if (dest_end - pos < length) {
+            break;
+        }
+        switch (length) {
+            case 1:
+                *pos++ = static_cast<uint8_t>(ch);
+                break;
+            case 2:
+                *pos++ = static_cast<uint8_t>(0xC0 | ch >> 6);
+                *pos++ = static_cast<uint8_t>(0x80 | (ch & 0x3F));
+                break;
+            case 3:
+                *pos++ = static_cast<uint8_t>(0xE0 | ch >> 12);
+                *pos++ = static_cast<uint8_t>(0x80 | (ch >> 6 & 0x3F));
+                *pos++ = static_cast<uint8_t>(0x80 | (ch & 0x3F));
+                break;
+            default:
+                *pos++ = static_cast<uint8_t>(0xF0 | ch >> 18);
+                *pos++ = static_cast<uint8_t>(0x80 | (ch >> 12 & 0x3F));
+                *pos++ = static_cast<uint8_t>(0x80 | (ch >> 6 & 0x3F));
+                *pos++ = static_cast<uint8_t>(0x80 | (ch & 0x3F));
+                break;
+        }
+        i += units;
     }
     return pos - dest;
 }
 
+// Dentries are copied with their padding, which follows the name array for
+// names of 253 to 255 bytes
+static_assert(sizeof(ext4_dentry) >= (8 + EXT4_NAME_LEN + 3) / 4 * 4, "The longest dentry has to fit its padding");
+
 struct ext4_dentry *build_dentry(uint32_t inode_number, StreamArchiver *read_stream) {
-    ext4_dentry *ext_dentry = (ext4_dentry *) malloc(sizeof *ext_dentry);
+    ext4_dentry *ext_dentry = (ext4_dentry *) context_malloc(sizeof *ext_dentry);
     ext_dentry->inode = inode_number;
-    ext_dentry->name_len = 0;
 
-    uint8_t *ext_name = ext_dentry->name;
-    uint8_t *ext_name_limit = ext_name + EXT4_NAME_LEN - 1;
+    // The whole name is collected first, surrogate pairs may span LFN entries
+    uint16_t name[MAX_LFN_ENTRIES * LFN_ENTRY_LENGTH];
+    int name_units = 0;
     uint16_t *segment = (uint16_t *) iterateStreamArchiver(read_stream, false,
                                                            LFN_ENTRY_LENGTH * sizeof *segment);
     while (segment != NULL) {
-        int bytes_written = ucs2toutf8(ext_name + ext_dentry->name_len, ext_name_limit,
-                                       segment, LFN_ENTRY_LENGTH);
-        ext_dentry->name_len += bytes_written;
+        if (name_units < MAX_LFN_ENTRIES * LFN_ENTRY_LENGTH) {
+            memcpy(name + name_units, segment, LFN_ENTRY_LENGTH * sizeof *segment);
+            name_units += LFN_ENTRY_LENGTH;
+        }
         segment = (uint16_t *) iterateStreamArchiver(read_stream, false,
                                                      LFN_ENTRY_LENGTH * sizeof *segment);
     }
-    ext_dentry->name[ext_dentry->name_len] = '\0';
+
+    ext_dentry->name_len = utf16toutf8(ext_dentry->name, ext_dentry->name + EXT4_NAME_LEN, name, name_units);
     ext_dentry->rec_len = next_multiple_of_four(ext_dentry->name_len + 8);
+    uint8_t *record = reinterpret_cast<uint8_t *>(ext_dentry);
+    memset(record + 8 + ext_dentry->name_len, 0, ext_dentry->rec_len - 8 - ext_dentry->name_len);
     return ext_dentry;
 }
 
@@ -14,6 +14,8 @@ struct ext4_dentry {
     uint8_t  name[EXT4_NAME_LEN];    /* File name */
 };
 
+// Converts a FAT long name to the UTF-8 of an ext4 name, see ext4_dentry.cpp
+int utf16toutf8(uint8_t *dest, uint8_t *dest_end, const uint16_t *src, int src_size);
 ext4_dentry *build_dentry(uint32_t inode_number, StreamArchiver *read_stream);
 ext4_dentry build_dot_dir_dentry(uint32_t dir_inode_number);
 ext4_dentry build_dot_dot_dir_dentry(uint32_t parent_inode_number);
@@ -4,10 +4,12 @@
 #include "ext4_extent.h"
 #include "ext4_inode.h"
 #include "fat.h"
+#include "perf_counters.h"
 #include "stream-archiver.h"
 #include "util.h"
 #include "visualizer.h"
 
+#include <stdio.h>
 #include <string.h>
 
 ext4_extent_header init_extent_header() {
@@ -19,10 +21,18 @@ ext4_extent_header init_extent_header() {
     return header;
 }
 
+uint16_t max_fat_extent_length() {
+    return EXT4_MAX_INIT_EXTENT_LEN / blocks_per_cluster();
+}
+
+uint16_t max_fat_unwritten_extent_length() {
+    return EXT4_MAX_UNINIT_EXTENT_LEN / blocks_per_cluster();
+}
+
 ext4_extent to_ext4_extent(fat_extent *fext) {
     ext4_extent eext;
-    eext.ee_block = fext->logical_start;
-    eext.ee_len = fext->length;
+    eext.ee_block = fext->logical_start * blocks_per_cluster();
+    eext.ee_len = fext->length * blocks_per_cluster();
     set_lo_hi(eext.ee_start_lo, eext.ee_start_hi, fat_cl_to_e4blk(fext->physical_start));
     return eext;
 }
@@ -31,19 +41,24 @@ uint16_t max_entries() {
     return (block_size() - sizeof(ext4_extent_header)) / sizeof(ext4_extent);
 }
 
+// Index blocks are allocated close to the data they point to
+uint32_t idx_block_goal(const ext4_extent *ext) {
+    return e4blk_to_fat_cl(from_lo_hi(ext->ee_start_lo, ext->ee_start_hi));
+}
+
+// Creates new nodes from the given depth down to a leaf, which contains only ext_to_append
 void append_to_new_idx_path(uint16_t depth, ext4_extent *ext_to_append, ext4_extent_idx *idx, uint32_t inode_no) {
-    for (int i = depth; i > depth; i--) {
-        fat_extent idx_ext = allocate_extent(1);
+    for (int i = depth; i >= 0; i--) {
+        fat_extent idx_ext = allocate_extent(1, idx_block_goal(ext_to_append));
         register_extent(&idx_ext, inode_no, false);
 
-        uint32_t block_no = fat_cl_to_e4blk(idx_ext.physical_start);
-        *idx = {
-            .ei_block = ext_to_append->ee_block,
-            .ei_leaf_lo = block_no,
-            .ei_leaf_hi = 0
-        };
+        uint64_t block_no = fat_cl_to_e4blk(idx_ext.physical_start);
+        idx->ei_block = ext_to_append->ee_block;
+        set_lo_hi(idx->ei_leaf_lo, idx->ei_leaf_hi, block_no);
+        idx->ei_unused = 0;
 
-        ext4_extent_header *header = (ext4_extent_header *) block_start(idx->ei_leaf_lo);
+        ext4_extent_header *header = (ext4_extent_header *) block_start(block_no);
+        *header = init_extent_header();
         header->eh_entries = 1;
         header->eh_max = max_entries();
         header->eh_depth = i;
@@ -80,7 +95,8 @@ bool append_to_extent_tree(ext4_extent *ext, ext4_extent_header *root_header, ui
 
     // all existing level 0 blocks are full, create a new one
     if (entry_count < root_header->eh_max) {
-        ext4_extent_idx *new_idx = (ext4_extent_idx *) (root_header + entry_count);
+        ext4_extent_idx *new_idx = (ext4_extent_idx *) (root_header + entry_count + 1);
+        root_header->eh_entries++;
         append_to_new_idx_path(root_header->eh_depth - 1, ext, new_idx, inode_no);
         return true;
     } else {
@@ -89,8 +105,8 @@ bool append_to_extent_tree(ext4_extent *ext, ext4_extent_header *root_header, ui
     }
 }
 
-void make_tree_deeper(ext4_extent_header *root_header, uint32_t inode_no) {
-    fat_extent idx_ext = allocate_extent(1);
+void make_tree_deeper(ext4_extent_header *root_header, uint32_t inode_no, uint32_t goal) {
+    fat_extent idx_ext = allocate_extent(1, goal);
     register_extent(&idx_ext, inode_no, false);
 
     uint64_t block_no = fat_cl_to_e4blk(idx_ext.physical_start);
@@ -103,57 +119,164 @@ void make_tree_deeper(ext4_extent_header *root_header, uint32_t inode_no) {
     root_header->eh_depth++;
     root_header->eh_entries = 1;
     ext4_extent_idx *idx = (ext4_extent_idx *) (root_header + 1);
-    idx->ei_block = 0;
+    // Files with holes don't necessarily start at logical block 0
+    idx->ei_block = reinterpret_cast<ext4_extent *>(child_header + 1)->ee_block;
     set_lo_hi(idx->ei_leaf_lo, idx->ei_leaf_hi, block_no);
 }
 
+// Returns the extent with the highest logical blocks, or NULL if there is none yet
+ext4_extent *last_leaf_extent(ext4_extent_header *header) {
+    while (header->eh_depth) {
+        ext4_extent_idx *last_idx = (ext4_extent_idx *) (header + header->eh_entries);
+        header = (ext4_extent_header *) block_start(from_lo_hi(last_idx->ei_leaf_lo, last_idx->ei_leaf_hi));
+    }
+    return header->eh_entries ? (ext4_extent *) (header + header->eh_entries) : NULL;
+}
+
+// Extends last by ext if ext continues it both logically and physically and
+// the result is still short enough. Both have to be initialized or both
+// unwritten.
+bool coalesce_extent(ext4_extent *last, const ext4_extent *ext) {
+    bool is_unwritten = last->ee_len > EXT4_MAX_INIT_EXTENT_LEN;
+    if (is_unwritten != (ext->ee_len > EXT4_MAX_INIT_EXTENT_LEN)) {
+        return false;
+    }
+    uint32_t last_length = is_unwritten ? last->ee_len - EXT4_MAX_INIT_EXTENT_LEN : last->ee_len;
+    uint32_t length = is_unwritten ? ext->ee_len - EXT4_MAX_INIT_EXTENT_LEN : ext->ee_len;
+    uint32_t max_length = is_unwritten ? EXT4_MAX_UNINIT_EXTENT_LEN : EXT4_MAX_INIT_EXTENT_LEN;
+    if (last->ee_block + last_length != ext->ee_block || last_length + length > max_length
+        || from_lo_hi(last->ee_start_lo, last->ee_start_hi) + last_length
+           != from_lo_hi(ext->ee_start_lo, ext->ee_start_hi)) {
+        return false;
+    }
+    last->ee_len += length;
+    return true;
+}
+
 void add_extent(ext4_extent *eext, uint32_t inode_no, ext4_inode *inode) {
+    perf_begin(PERF_ADD_EXTENT);
     ext4_extent_header *header = &(inode->ext_header);
+    // Directory clusters and resettled fragments often continue the previous extent
+    ext4_extent *last = last_leaf_extent(header);
+    bool is_coalesced = last && coalesce_extent(last, eext);
+    visualizer_add_extent(is_coalesced);
+    if (is_coalesced) {
+        perf_end(PERF_ADD_EXTENT);
+        return;
+    }
     bool success = append_to_extent_tree(eext, header, inode_no);
 
     // tree is full, add another level
     if (!success) {
-        make_tree_deeper(header, inode_no);
+        make_tree_deeper(header, inode_no, idx_block_goal(eext));
         // attempt adding extent again, should succeed this time
         ext4_extent_header *new_root_header = &(inode->ext_header);
         append_to_extent_tree(eext, new_root_header, inode_no);
     }
+    perf_end(PERF_ADD_EXTENT);
 }
 
 void register_extent(fat_extent *fext, uint32_t inode_no, bool add_to_extent_tree) {
     ext4_inode *inode = &get_existing_inode(inode_no);
     ext4_extent eext = to_ext4_extent(fext);
 
+    uint64_t extent_start_block = from_lo_hi(eext.ee_start_lo, eext.ee_start_hi);
+    uint64_t extent_end_block = extent_start_block + eext.ee_len;
+
     if (add_to_extent_tree) {
+        // ext4 doesn't allow initialized blocks past the end of a file, but
+        // with bigalloc the file's last cluster may extend further. The
+        // cluster is still allocated as a whole.
+        if (inode->i_mode & S_IFREG) {
+            uint64_t file_size = get_size(inode_no);
+            // Clusters past the last one would be allocated without belonging
+            // to the file. check_fat_consistency() rules this out up front.
+            if (fext->logical_start + fext->length > ceildiv<uint64_t>(file_size, meta_info.cluster_size)) {
+                fprintf(stderr, "The cluster chain of inode %u is longer than the file\n", inode_no);
+                fail_conversion();
+            }
+            uint32_t file_blocks = ceildiv<uint64_t>(file_size, block_size());
+            eext.ee_len = min(eext.ee_len, file_blocks - eext.ee_block);
+        }
+        if (fext->flags & FAT_EXTENT_UNWRITTEN) {
+            // The length's most significant bit marks the extent as unwritten
+            eext.ee_len += EXT4_MAX_INIT_EXTENT_LEN;
+        }
         add_extent(&eext, inode_no, inode);
     } else {
-        visualizer_add_block_range({BlockRange::IdxNode, from_lo_hi(eext.ee_start_lo, eext.ee_start_hi), eext.ee_len});
+        visualizer_add_block_range({BlockRange::IdxNode, extent_start_block, eext.ee_len});
     }
 
-    uint32_t block_count = static_cast<uint32_t>(eext.ee_len) * block_size() / 512;  // number of 512-byte blocks allocated
+    uint32_t block_count = static_cast<uint32_t>(fext->length) * (meta_info.cluster_size / 512);  // number of 512-byte blocks allocated
     incr_lo_hi(inode->i_blocks_lo, inode->l_i_blocks_high, block_count);
 
-    uint64_t extent_start_block = from_lo_hi(eext.ee_start_lo, eext.ee_start_hi);
-    add_extent_to_block_bitmap(extent_start_block, extent_start_block + eext.ee_len);
+    add_extent_to_block_bitmap(extent_start_block, extent_end_block);
 }
 
 void set_extents(uint32_t inode_number, fat_dentry *dentry, StreamArchiver *read_stream) {
     set_size(inode_number, dentry->file_size);
     fat_extent *current_extent = getNext<fat_extent>(read_stream);
     while (current_extent != NULL) {
-        register_extent(current_extent, inode_number);
+        if (current_extent->flags & FAT_EXTENT_HOLE) {
+            for (uint32_t i = 0; i < current_extent->length; i++) {
+                set_free(current_extent->physical_start + i);
+            }
+        } else {
+            register_extent(current_extent, inode_number);
+        }
         current_extent = getNext<fat_extent>(read_stream);
     }
 }
 
-ext4_extent last_extent(uint32_t inode_number) {
-    ext4_inode *inode = &get_existing_inode(inode_number);
-    ext4_extent_header *header = &(inode->ext_header);
+bool is_valid_extent_node(const ext4_extent_header *header) {
+    return header->eh_magic == EH_MAGIC && header->eh_entries <= header->eh_max;
+}
 
-    while(header->eh_depth) {
-        ext4_extent_idx *last_idx = (ext4_extent_idx *) (header + header->eh_entries);
-        header = (ext4_extent_header *) block_start(from_lo_hi(last_idx->ei_leaf_lo, last_idx->ei_leaf_hi));
+// Returns the physical block of a logical block, or 0 if it isn't mapped.
+// The tree may be damaged, so its child blocks are only followed within the
+// file system and down to a leaf.
+uint64_t map_logical_block(const ext4_inode *inode, uint32_t logical_block) {
+    const ext4_extent_header *header = &inode->ext_header;
+    if (header->eh_depth > EXT4_MAX_EXTENT_DEPTH) {
+        return 0;
+    }
+    while (is_valid_extent_node(header) && header->eh_depth) {
+        auto *idx = reinterpret_cast<const ext4_extent_idx *>(header + 1);
+        int i = header->eh_entries - 1;
+        while (i > 0 && idx[i].ei_block > logical_block) {
+            i--;
+        }
+        if (i < 0) {
+            return 0;
+        }
+        uint64_t child_block = from_lo_hi(idx[i].ei_leaf_lo, idx[i].ei_leaf_hi);
+        if (child_block < context->sb.s_first_data_block || child_block >= block_count()) {
+            return 0;
+        }
+        uint16_t depth = header->eh_depth;
+        header = reinterpret_cast<const ext4_extent_header *>(block_start(child_block));
+        if (header->eh_depth != depth - 1) {
+            return 0;
+        }
+    }
+    if (!is_valid_extent_node(header)) {
+        return 0;
+    }
+
+    auto *extents = reinterpret_cast<const ext4_extent *>(header + 1);
+    for (int i = 0; i < header->eh_entries; i++) {
+        uint32_t length = extents[i].ee_len > EXT4_MAX_INIT_EXTENT_LEN
+                          ? extents[i].ee_len - EXT4_MAX_INIT_EXTENT_LEN : extents[i].ee_len;
+        if (logical_block >= extents[i].ee_block && logical_block - extents[i].ee_block < length) {
+            uint64_t block_no = from_lo_hi(extents[i].ee_start_lo, extents[i].ee_start_hi) + logical_block
+                                - extents[i].ee_block;
+            return block_no < block_count() ? block_no : 0;
+        }
     }
+    return 0;
+}
 
-    return *(ext4_extent *) (header + header->eh_entries);
+ext4_extent last_extent(uint32_t inode_number) {
+    ext4_inode *inode = &get_existing_inode(inode_number);
+    return *last_leaf_extent(&inode->ext_header);
 }
@@ -5,11 +5,15 @@
 constexpr uint16_t EH_MAGIC = 0xF30A;
 
 constexpr uint16_t EXT4_MAX_INIT_EXTENT_LEN = 32768;
+constexpr uint16_t EXT4_MAX_UNINIT_EXTENT_LEN = 32767;
+// Deepest extent tree the kernel accepts
+constexpr uint16_t EXT4_MAX_EXTENT_DEPTH = 5;
 
 struct fat_extent;
 struct fat_dentry;
 struct StreamArchiver;
 struct ext4_super_block;
+struct ext4_inode;
 
 struct ext4_extent_header {
     uint16_t eh_magic = EH_MAGIC;
@@ -39,8 +43,15 @@ struct ext4_extent_tail {
 };
 
 ext4_extent_header init_extent_header();
+// Length in FAT clusters of the longest extent that ext4 can represent
+uint16_t max_fat_extent_length();
+// Same for extents with FAT_EXTENT_UNWRITTEN
+uint16_t max_fat_unwritten_extent_length();
 void register_extent(fat_extent *ext, uint32_t inode_number, bool add_to_extent_tree = true);
 void set_extents(uint32_t inode_number, fat_dentry *dentry, StreamArchiver *read_stream);
 ext4_extent last_extent(uint32_t inode_number);
+bool is_valid_extent_node(const ext4_extent_header *header);
+// Returns the physical block of a logical block, or 0 if it isn't mapped
+uint64_t map_logical_block(const ext4_inode *inode, uint32_t logical_block);
 
 #endif //OFS_EXT4_EXTENT_H
@@ -14,7 +14,11 @@
 #include <sys/types.h>
 #include <time.h>
 
-uint32_t first_free_inode_no = EXT4_FIRST_NON_RSV_INODE + 1;  // account for lost+found
+__thread uint32_t first_free_inode_no = EXT4_FIRST_NON_RSV_INODE + 1;  // account for lost+found
+
+void reset_inode_numbers() {
+    first_free_inode_no = EXT4_FIRST_NON_RSV_INODE + 1;
+}
 
 uint32_t save_inode(ext4_inode *inode) {
     add_inode(*inode, first_free_inode_no);
@@ -74,6 +78,21 @@ void build_lost_found_inode() {
     add_reserved_inode(inode, EXT4_LOST_FOUND_INODE);
 }
 
+void build_journal_inode() {
+    ext4_inode inode = {};
+    inode.i_mode = static_cast<uint16_t>(0600) | S_IFREG;
+    inode.i_uid = ROOT_UID;
+    inode.i_gid = ROOT_GID;
+    inode.i_atime = (uint32_t) time(NULL);
+    inode.i_ctime = (uint32_t) time(NULL);
+    inode.i_mtime = (uint32_t) time(NULL);
+    inode.i_links_count = 1;
+    inode.i_flags = 0x80000;  // uses extents
+    inode.ext_header = init_extent_header();
+
+    add_reserved_inode(inode, EXT4_JOURNAL_INODE);
+}
+
 void set_size(uint32_t inode_no, uint64_t size) {
     ext4_inode& inode = get_existing_inode(inode_no);
     set_lo_hi(inode.i_size_lo, inode.i_size_high, size);
@@ -45,9 +45,12 @@ struct ext4_inode {
     uint32_t    i_projid;    /* Project ID */
 };
 
+// Starts numbering inodes from the first one after lost+found again
+void reset_inode_numbers();
 uint32_t build_inode(fat_dentry *dentry);
 void build_root_inode();
 void build_lost_found_inode();
+void build_journal_inode();
 void set_size(uint32_t inode_number, uint64_t size);
 uint64_t get_size(uint32_t inode_number);
 void incr_links_count(uint32_t inode_no);
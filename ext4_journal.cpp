@@ -0,0 +1,194 @@
+#include "ext4.h"
+#include "ext4_bg.h"
+#include "ext4_extent.h"
+#include "ext4_inode.h"
+#include "ext4_journal.h"
+#include "extent-allocator.h"
+#include "fat.h"
+#include "partition.h"
+#include "util.h"
+#include "visualizer.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Until the journal is built, its size is only stored in the superblock's
+// backup of the journal inode (s_jnl_blocks[15] and [16] hold i_size_high and
+// i_size). This way, it survives in a checkpoint.
+uint64_t journal_size() {
+    return from_lo_hi(context->sb.s_jnl_blocks[16], context->sb.s_jnl_blocks[15]);
+}
+
+void set_journal_size(uint64_t size) {
+    set_lo_hi(context->sb.s_jnl_blocks[16], context->sb.s_jnl_blocks[15], size);
+}
+
+// Same sizes as used by mke2fs
+uint32_t default_journal_blocks() {
+    uint64_t blocks = block_count();
+    if (blocks < 32768) return 1024;
+    if (blocks < 256 * 1024) return 4096;
+    if (blocks < 512 * 1024) return 8192;
+    if (blocks < 4096 * 1024) return 16384;
+    if (blocks < 8192 * 1024) return 32768;
+    if (blocks < 16384 * 1024) return 65536;
+    if (blocks < 32768 * 1024) return 131072;
+    return 262144;
+}
+
+bool init_journal(int64_t size_mb) {
+    if (size_mb == 0) {
+        return true;
+    }
+
+    uint64_t journal_blocks = size_mb == JOURNAL_SIZE_DEFAULT
+                              ? default_journal_blocks()
+                              : static_cast<uint64_t>(size_mb) * 1024 * 1024 / block_size();
+    if (journal_blocks < JBD2_MIN_JOURNAL_BLOCKS || journal_blocks > JBD2_MAX_JOURNAL_BLOCKS) {
+        fprintf(stderr, "The journal has to be between %u and %u blocks of %u bytes\n",
+                JBD2_MIN_JOURNAL_BLOCKS, JBD2_MAX_JOURNAL_BLOCKS, block_size());
+        return false;
+    }
+
+    // The journal is allocated in whole clusters
+    uint64_t journal_clusters = ceildiv<uint64_t>(journal_blocks, blocks_per_cluster());
+    set_journal_size(journal_clusters * meta_info.cluster_size);
+    context->sb.s_feature_compat |= EXT4_FEATURE_COMPAT_HAS_JOURNAL;
+    context->sb.s_journal_inum = EXT4_JOURNAL_INODE;
+    context->sb.s_jnl_backup_type = EXT4_JNL_BACKUP_BLOCKS;
+    return true;
+}
+
+void check_journal_space() {
+    if (!(context->sb.s_feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL)) {
+        return;
+    }
+
+    uint32_t run_count;
+    fat_extent *runs = find_free_runs(run_count);
+    uint64_t free_clusters = 0;
+    for (uint32_t i = 0; i < run_count; i++) {
+        free_clusters += runs[i].length;
+    }
+    context_free(runs);
+
+    if (journal_size() / meta_info.cluster_size > free_clusters / 2) {
+        fprintf(stderr, "Not enough free space for a journal, converting without one\n");
+        context->sb.s_feature_compat &= ~EXT4_FEATURE_COMPAT_HAS_JOURNAL;
+        context->sb.s_journal_inum = 0;
+        context->sb.s_jnl_backup_type = 0;
+        set_journal_size(0);
+    }
+}
+
+int run_length_compare(const void *a, const void *b) {
+    return static_cast<const fat_extent *>(b)->length - static_cast<const fat_extent *>(a)->length;
+}
+
+int run_position_compare(const void *a, const void *b) {
+    uint32_t start_a = static_cast<const fat_extent *>(a)->physical_start;
+    uint32_t start_b = static_cast<const fat_extent *>(b)->physical_start;
+    return (start_a > start_b) - (start_a < start_b);
+}
+
+// Picks the clusters for the journal and moves them to the beginning of runs,
+// sorted by position. Preferably, this is a single run centered as close to
+// the middle of the file system as possible, which keeps seeks to the
+// journal short. If no run is long enough, the longest runs are used.
+// Returns the number of runs used, 0 if all runs together are too short.
+uint32_t choose_journal_runs(fat_extent *runs, uint32_t run_count, uint32_t cluster_count) {
+    uint32_t middle = data_cluster_count() / 2;
+    uint32_t best_distance = UINT32_MAX;
+    for (uint32_t i = 0; i < run_count; i++) {
+        if (runs[i].length < cluster_count) {
+            continue;
+        }
+        uint32_t start = middle > cluster_count / 2 ? middle - cluster_count / 2 : 0;
+        if (start < runs[i].physical_start) {
+            start = runs[i].physical_start;
+        } else if (start > runs[i].physical_start + runs[i].length - cluster_count) {
+            start = runs[i].physical_start + runs[i].length - cluster_count;
+        }
+        uint32_t center = start + cluster_count / 2;
+        uint32_t distance = center > middle ? center - middle : middle - center;
+        if (distance < best_distance) {
+            best_distance = distance;
+            runs[0] = {0, static_cast<uint16_t>(cluster_count), start, 0};
+        }
+    }
+    if (best_distance != UINT32_MAX) {
+        return 1;
+    }
+
+    qsort(runs, run_count, sizeof *runs, run_length_compare);
+    uint32_t used_runs = 0;
+    for (uint32_t remaining = cluster_count; remaining; used_runs++) {
+        if (used_runs == run_count) {
+            fprintf(stderr, "File system is too small. All your data is trashed now, sorry!\n");
+            return 0;
+        }
+        runs[used_runs].length = static_cast<uint16_t>(min(runs[used_runs].length, remaining));
+        remaining -= runs[used_runs].length;
+    }
+    qsort(runs, used_runs, sizeof *runs, run_position_compare);
+    return used_runs;
+}
+
+void write_journal_superblock(uint64_t block_no, uint32_t journal_blocks) {
+    journal_superblock jsb;
+    memset(&jsb, 0, sizeof jsb);
+    jsb.h_magic = htonl(JBD2_MAGIC_NUMBER);
+    jsb.h_blocktype = htonl(JBD2_SUPERBLOCK_V2);
+    jsb.s_blocksize = htonl(block_size());
+    jsb.s_maxlen = htonl(journal_blocks);
+    jsb.s_first = htonl(1);
+    jsb.s_sequence = htonl(1);
+    jsb.s_nr_users = htonl(1);  // The file system itself
+    memcpy(jsb.s_uuid, context->sb.s_uuid, sizeof jsb.s_uuid);
+    memcpy(block_start(block_no), &jsb, sizeof jsb);
+}
+
+bool build_journal() {
+    if (!(context->sb.s_feature_compat & EXT4_FEATURE_COMPAT_HAS_JOURNAL)) {
+        return true;
+    }
+
+    uint64_t size = journal_size();
+    auto cluster_count = static_cast<uint32_t>(size / meta_info.cluster_size);
+    uint32_t run_count;
+    fat_extent *runs = find_free_runs(run_count);
+    run_count = choose_journal_runs(runs, run_count, cluster_count);
+    if (!run_count) {
+        context_free(runs);
+        return false;
+    }
+
+    build_journal_inode();
+    set_size(EXT4_JOURNAL_INODE, size);
+
+    uint32_t logical_start = 0;
+    for (uint32_t i = 0; i < run_count; i++) {
+        allocate_run(runs[i]);
+        // A stale log must not be replayed
+        zeroMapped(cluster_start(runs[i].physical_start), runs[i].length * static_cast<uint64_t>(meta_info.cluster_size));
+        visualizer_add_block_range({BlockRange::Journal, fat_cl_to_e4blk(runs[i].physical_start),
+                                    runs[i].length * blocks_per_cluster()});
+
+        for (uint32_t offset = 0; offset < runs[i].length; ) {
+            uint16_t length = static_cast<uint16_t>(min(runs[i].length - offset, max_fat_extent_length()));
+            fat_extent extent = {logical_start, length, runs[i].physical_start + offset, 0};
+            register_extent(&extent, EXT4_JOURNAL_INODE);
+            logical_start += length;
+            offset += length;
+        }
+    }
+    write_journal_superblock(fat_cl_to_e4blk(runs[0].physical_start),
+                             static_cast<uint32_t>(size / block_size()));
+    context_free(runs);
+
+    ext4_inode& inode = get_existing_inode(EXT4_JOURNAL_INODE);
+    memcpy(context->sb.s_jnl_blocks, &inode.ext_header, sizeof inode.ext_header + sizeof inode.extents);
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef OFS_CONVERT_EXT4_JOURNAL_H
+#define OFS_CONVERT_EXT4_JOURNAL_H
+
+#include <stdint.h>
+
+constexpr uint32_t JBD2_MAGIC_NUMBER = 0xC03B3998;
+constexpr uint32_t JBD2_SUPERBLOCK_V2 = 4;
+// Limits enforced by mke2fs
+constexpr uint32_t JBD2_MIN_JOURNAL_BLOCKS = 1024;
+constexpr uint32_t JBD2_MAX_JOURNAL_BLOCKS = 10240000;
+// Selects the journal size mke2fs would use
+constexpr int64_t JOURNAL_SIZE_DEFAULT = -1;
+
+// All fields are big endian
+struct journal_superblock {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+    uint32_t s_blocksize;        /* journal device blocksize */
+    uint32_t s_maxlen;           /* total blocks in journal file */
+    uint32_t s_first;            /* first block of log information */
+    uint32_t s_sequence;         /* first commit ID expected in log */
+    uint32_t s_start;            /* blocknr of start of log, 0 if clean */
+    uint32_t s_errno;
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t s_uuid[16];          /* 128-bit uuid for journal */
+    uint32_t s_nr_users;         /* Nr of filesystems sharing log */
+    uint32_t s_dynsuper;         /* Blocknr of dynamic superblock copy */
+    uint32_t s_max_transaction;  /* Limit of journal blocks per trans */
+    uint32_t s_max_trans_data;   /* Limit of data blocks per trans */
+    uint8_t s_checksum_type;
+    uint8_t s_padding2[3];
+    uint32_t s_padding[42];
+    uint32_t s_checksum;
+    uint8_t s_users[16 * 48];    /* ids of all fs'es sharing the log */
+};
+
+// Records the journal size in the superblock, 0 disables the journal. Returns
+// false if the size is out of range.
+bool init_journal(int64_t size_mb);
+// Drops the journal if it would take up more than half of the remaining free space
+void check_journal_space();
+// Returns false if the free clusters cannot hold the journal
+bool build_journal();
+
+#endif //OFS_CONVERT_EXT4_JOURNAL_H
@@ -0,0 +1,146 @@
+#include "ext4_bg.h"
+#include "ext4_layout.h"
+#include "fat.h"
+#include "util.h"
+
+#include <stdio.h>
+
+// Group sizes are tried in steps of 1/LAYOUT_STEPS of the default size, down
+// to LAYOUT_MIN_STEPS of them. Smaller groups only add metadata.
+constexpr uint32_t LAYOUT_STEPS = 32;
+constexpr uint32_t LAYOUT_MIN_STEPS = 8;
+// Same as the minimum size of the last block group in mke2fs
+constexpr uint32_t LAYOUT_MIN_LAST_GROUP_DATA_BLOCKS = 50;
+
+struct layout {
+    uint32_t clusters_per_group;
+    uint32_t inodes_per_group;
+    uint32_t backup_bgs[2];
+    uint64_t used_clusters;  // Covered by the block group metadata
+};
+
+
+// Counts the used FAT clusters among the ext4 blocks [begin, end). The FAT's
+// own metadata in front of the data clusters needs no resettling.
+uint64_t count_used_clusters(uint64_t begin, uint64_t end) {
+    uint32_t end_cluster = e4blk_to_fat_cl(end);
+    if (!end_cluster) {
+        return 0;
+    }
+    end_cluster = min(end_cluster, data_cluster_count());
+    uint32_t cluster = e4blk_to_fat_cl(begin);
+    uint64_t used = 0;
+    for (cluster = cluster ? cluster : FAT_START_INDEX; cluster < end_cluster; cluster++) {
+        used += !is_free_cluster(*fat_entry(cluster));
+    }
+    return used;
+}
+
+
+void apply_layout(const layout& layout) {
+    context->sb.s_clusters_per_group = layout.clusters_per_group;
+    context->sb.s_blocks_per_group = layout.clusters_per_group * blocks_per_cluster();
+    context->sb.s_inodes_per_group = layout.inodes_per_group;
+    context->sb.s_backup_bgs[0] = layout.backup_bgs[0];
+    context->sb.s_backup_bgs[1] = layout.backup_bgs[1];
+    update_geometry();
+    context->sb.s_inodes_count = context->sb.s_inodes_per_group * block_group_count();
+}
+
+
+// Applies the candidate's group size and fills in the rest of it. Unless
+// keep_backups is set, the backups go to the groups where they cover the
+// fewest used clusters. Returns false if the group size doesn't work.
+bool evaluate_layout(layout& candidate, uint32_t min_inodes, bool keep_backups) {
+    if (!keep_backups) {
+        // Only the group count is needed to pick the inodes per group
+        candidate.inodes_per_group = 1;
+    }
+    apply_layout(candidate);
+    uint32_t bg_count = block_group_count();
+    if (!keep_backups) {
+        candidate.inodes_per_group = inodes_per_group_for(min_inodes);
+        if (static_cast<uint64_t>(candidate.inodes_per_group) * bg_count < min_inodes) {
+            return false;
+        }
+    }
+    apply_layout(candidate);
+
+    uint32_t overhead_blocks = block_group_overhead_clusters(false) * blocks_per_cluster();
+    uint32_t sb_copy_overhead_blocks = block_group_overhead_clusters(true) * blocks_per_cluster();
+    if (!keep_backups && (sb_copy_overhead_blocks > context->sb.s_blocks_per_group
+                          || block_group_block_count(bg_count - 1)
+                             < sb_copy_overhead_blocks + LAYOUT_MIN_LAST_GROUP_DATA_BLOCKS)) {
+        return false;
+    }
+
+    // The superblock copy extends the metadata at the start of a group
+    uint64_t used = 0;
+    uint64_t best_extra[2] = {UINT64_MAX, UINT64_MAX};
+    uint32_t best_bgs[2] = {0, 0};
+    uint64_t default_extra = 0;
+    for (uint32_t i = 0; i < bg_count; i++) {
+        uint64_t start = block_group_start(i);
+        used += count_used_clusters(start, start + overhead_blocks);
+        uint64_t extra = count_used_clusters(start + overhead_blocks, start + sb_copy_overhead_blocks);
+        if (i == 0 || (keep_backups && block_group_has_sb_copy(i))) {
+            used += extra;
+        } else if (!keep_backups) {
+            if (i == 1 || i == bg_count - 1) {
+                default_extra += extra;
+            }
+            if (extra < best_extra[0]) {
+                best_extra[1] = best_extra[0];
+                best_bgs[1] = best_bgs[0];
+                best_extra[0] = extra;
+                best_bgs[0] = i;
+            } else if (extra < best_extra[1]) {
+                best_extra[1] = extra;
+                best_bgs[1] = i;
+            }
+        }
+    }
+
+    if (!keep_backups && bg_count > 1) {
+        // Backups far apart survive more, so the groups of mke2fs win ties
+        uint32_t backup_count = bg_count > 2 ? 2 : 1;
+        uint64_t best_sum = best_extra[0] + (backup_count == 2 ? best_extra[1] : 0);
+        if (best_sum < default_extra) {
+            candidate.backup_bgs[0] = min(best_bgs[0], best_bgs[backup_count - 1]);
+            candidate.backup_bgs[1] = backup_count == 2 ? best_bgs[0] + best_bgs[1] - candidate.backup_bgs[0] : 0;
+            used += best_sum;
+        } else {
+            candidate.backup_bgs[0] = 1;
+            candidate.backup_bgs[1] = backup_count == 2 ? bg_count - 1 : 0;
+            used += default_extra;
+        }
+    }
+    candidate.used_clusters = used;
+    return true;
+}
+
+
+void optimize_layout() {
+    layout default_layout = {context->sb.s_clusters_per_group, context->sb.s_inodes_per_group,
+                             {context->sb.s_backup_bgs[0], context->sb.s_backup_bgs[1]}, 0};
+    uint32_t min_inodes = context->sb.s_inodes_count;
+    evaluate_layout(default_layout, min_inodes, true);
+
+    layout best = default_layout;
+    // Block bitmaps are written in whole bytes
+    uint32_t step = default_layout.clusters_per_group / LAYOUT_STEPS / 8 * 8;
+    for (uint32_t i = 1; i <= LAYOUT_STEPS - LAYOUT_MIN_STEPS && step; i++) {
+        layout candidate = {default_layout.clusters_per_group - i * step, 0, {0, 0}, 0};
+        if (evaluate_layout(candidate, min_inodes, false) && candidate.used_clusters < best.used_clusters) {
+            best = candidate;
+        }
+    }
+    apply_layout(best);
+
+    uint64_t cluster_kib = static_cast<uint64_t>(blocks_per_cluster()) * block_size() / 1024;
+    printf("Layout: %u blocks per group, superblock backups in groups %u and %u\n",
+           context->sb.s_blocks_per_group, context->sb.s_backup_bgs[0], context->sb.s_backup_bgs[1]);
+    printf("Predicted to resettle %llu KiB instead of %llu KiB with the default layout\n",
+           static_cast<unsigned long long>(best.used_clusters * cluster_kib),
+           static_cast<unsigned long long>(default_layout.used_clusters * cluster_kib));
+}
@@ -0,0 +1,11 @@
+#ifndef OFS_CONVERT_EXT4_LAYOUT_H
+#define OFS_CONVERT_EXT4_LAYOUT_H
+
+// Chooses the size of the block groups and the groups with the superblock
+// backups so that the block group metadata covers as few used FAT clusters as
+// possible, since each of them has to be resettled. The inode count does not
+// drop below that of the default layout. Has to be called after
+// init_ext4_sb(), which sets up the default layout, and changes sb.
+void optimize_layout();
+
+#endif //OFS_CONVERT_EXT4_LAYOUT_H
@@ -1,12 +1,13 @@
 #include "extent-allocator.h"
 #include <stdlib.h>
+#include <string.h>
 #include <cstdio>
 
+#include "conversion_context.h"
+#include "perf_counters.h"
+#include "util.h"
 #include "visualizer.h"
 
-extent_allocator allocator;
-uint8_t *allocation_bitmap;
-
 int extent_sort_compare(const void* eA, const void* eB) {
     return reinterpret_cast<const fat_extent*>(eA)->physical_start
          - reinterpret_cast<const fat_extent*>(eB)->physical_start;
@@ -14,17 +15,28 @@ int extent_sort_compare(const void* eA, const void* eB) {
 
 void set_used(uint32_t cluster_no) {
     uint32_t byte = cluster_no / 8;
-    allocation_bitmap[byte] |= (1 << (cluster_no % 8));
+    context->allocation_bitmap[byte] |= (1 << (cluster_no % 8));
+}
+
+void set_free(uint32_t cluster_no) {
+    uint32_t byte = cluster_no / 8;
+    context->allocation_bitmap[byte] &= ~(1 << (cluster_no % 8));
+    if (cluster_no >= context->allocator.used_from && cluster_no < context->allocator.used_to) {
+        context->allocator.used_to = cluster_no;
+    }
 }
 
 bool is_free(uint32_t cluster_no) {
     uint32_t byte = cluster_no / 8;
-    return !(1 & (allocation_bitmap[byte] >> (cluster_no % 8)));
+    return !(1 & (context->allocation_bitmap[byte] >> (cluster_no % 8)));
+}
+
+uint32_t allocation_bitmap_size() {
+    return ((data_cluster_count() - 1) / 8) + 1;
 }
 
 void create_allocation_bitmap() {
-    uint32_t bitmap_size = ((data_cluster_count() - 1) / 8) + 1;
-    allocation_bitmap = (uint8_t *) calloc(bitmap_size, 1);
+    context->allocation_bitmap = (uint8_t *) context_calloc(allocation_bitmap_size(), 1);
 
     for (uint32_t cluster_no = 0; cluster_no < FAT_START_INDEX; cluster_no++) {
         set_used(cluster_no);
@@ -37,53 +49,197 @@ void create_allocation_bitmap() {
     }
 }
 
+void init_blocked_extents(fat_extent *blocked_extents, uint32_t blocked_extent_count) {
+    context->allocator.blocked_extents = blocked_extents;
+    context->allocator.blocked_extent_count = blocked_extent_count;
+    qsort(context->allocator.blocked_extents, context->allocator.blocked_extent_count, sizeof(fat_extent), extent_sort_compare);
+}
+
 void init_extent_allocator(fat_extent *blocked_extents, uint32_t blocked_extent_count) {
     create_allocation_bitmap();
-    allocator.index_in_fat = 0;
-    allocator.blocked_extents = blocked_extents;
-    allocator.blocked_extent_count = blocked_extent_count;
-    qsort(allocator.blocked_extents, allocator.blocked_extent_count, sizeof(fat_extent), extent_sort_compare);
-    allocator.blocked_extent_current = allocator.blocked_extents;
+    init_blocked_extents(blocked_extents, blocked_extent_count);
+    context->allocator.index_in_fat = 0;
+    context->allocator.blocked_extent_current = context->allocator.blocked_extents;
+    context->allocator.used_from = context->allocator.used_to = 0;
+}
+
+// Used when resuming a conversion, the FAT the bitmap is built from is gone by then
+void restore_extent_allocator(fat_extent *blocked_extents, uint32_t blocked_extent_count, uint8_t *bitmap,
+                              uint32_t index_in_fat, uint32_t blocked_extent_index) {
+    context->allocation_bitmap = bitmap;
+    init_blocked_extents(blocked_extents, blocked_extent_count);
+    context->allocator.index_in_fat = index_in_fat;
+    context->allocator.blocked_extent_current = context->allocator.blocked_extents + blocked_extent_index;
+    context->allocator.used_from = context->allocator.used_to = 0;
+}
+
+void free_extent_allocator() {
+    context_free(context->allocation_bitmap);
+    context_free(context->allocator.blocked_extents);
+    context->allocation_bitmap = NULL;
+    context->allocator = {};
 }
 
 bool fs_is_full() {
-    return allocator.blocked_extent_current - allocator.blocked_extents > allocator.blocked_extent_count;
+    return context->allocator.blocked_extent_current - context->allocator.blocked_extents > context->allocator.blocked_extent_count;
 }
 
 bool can_be_used() {
-    ++(allocator.index_in_fat);
-    if(allocator.index_in_fat < allocator.blocked_extent_current->physical_start)
-        return is_free(allocator.index_in_fat);
+    ++(context->allocator.index_in_fat);
+    if(context->allocator.index_in_fat < context->allocator.blocked_extent_current->physical_start)
+        return is_free(context->allocator.index_in_fat);
 
-    allocator.index_in_fat = allocator.blocked_extent_current->physical_start + allocator.blocked_extent_current->length;
-    ++allocator.blocked_extent_current;
+    context->allocator.index_in_fat = context->allocator.blocked_extent_current->physical_start + context->allocator.blocked_extent_current->length;
+    ++context->allocator.blocked_extent_current;
 
     if (fs_is_full()) {
-        fprintf(stderr, "File system is too small. All your data is trashed now, sorry!");
-        exit(1);
+        fprintf(stderr, "File system is too small. All your data is trashed now, sorry!\n");
+        fail_conversion();
     }
     return false;
 }
 
-fat_extent allocate_extent(uint16_t max_length) {
+bool is_word_used(uint32_t cluster_no) {
+    uint64_t word;
+    memcpy(&word, context->allocation_bitmap + cluster_no / 8, sizeof word);
+    return word == ~0ULL;
+}
+
+uint32_t scan_for_free_cluster(uint32_t cluster_no) {
+    uint32_t i = find_first_blocked_extent(cluster_no);
+    // The blocked extent after the last one marks the end of the file system
+    while(i <= context->allocator.blocked_extent_count) {
+        fat_extent& blocked_extent = context->allocator.blocked_extents[i];
+        while(cluster_no < blocked_extent.physical_start) {
+            // Skip fully used words of the bitmap at once
+            if(cluster_no % 64 == 0 && cluster_no + 64 <= blocked_extent.physical_start && is_word_used(cluster_no)) {
+                cluster_no += 64;
+                continue;
+            }
+            if(is_free(cluster_no))
+                return cluster_no;
+            ++cluster_no;
+        }
+        uint32_t blocked_end = blocked_extent.physical_start + blocked_extent.length;
+        if(blocked_end > cluster_no)
+            cluster_no = blocked_end;
+        ++i;
+    }
+    return 0;
+}
+
+// Returns the first free cluster at or after cluster_no that is not blocked, 0 if there is none.
+// Allocations only ever use up clusters, so the range the last search went
+// through without finding one is skipped, and a goal after the last free
+// cluster fails at once instead of scanning to the end again.
+uint32_t find_free_cluster_from(uint32_t cluster_no) {
+    uint32_t scan_start = cluster_no;
+    if(cluster_no >= context->allocator.used_from && cluster_no < context->allocator.used_to) {
+        scan_start = context->allocator.used_from;
+        cluster_no = context->allocator.used_to;
+    }
+    uint32_t result = cluster_no == UINT32_MAX ? 0 : scan_for_free_cluster(cluster_no);
+    context->allocator.used_from = scan_start;
+    context->allocator.used_to = result ? result : UINT32_MAX;
+    return result;
+}
+
+fat_extent allocate_extent_at_goal(uint16_t max_length, uint32_t goal) {
+    fat_extent result = {0, 0, find_free_cluster_from(goal), 0};
+    if(!result.physical_start)
+        return result;
+
+    uint32_t i = find_first_blocked_extent(result.physical_start);
+    uint32_t blocked_start = context->allocator.blocked_extents[i].physical_start;
+    if(blocked_start <= result.physical_start)  // The extent ends right before result
+        blocked_start = context->allocator.blocked_extents[i + 1].physical_start;
+    do {
+        set_used(result.physical_start + result.length);
+        ++result.length;
+    } while(result.length < max_length && result.physical_start + result.length < blocked_start
+            && is_free(result.physical_start + result.length));
+
+    visualizer_add_allocated_extent(result);
+    return result;
+}
+
+fat_extent allocate_extent(uint16_t max_length, uint32_t goal) {
+    perf_begin(PERF_ALLOCATE_EXTENT);
+    if(goal) {
+        fat_extent result = allocate_extent_at_goal(max_length, goal);
+        if(result.length) {
+            perf_end(PERF_ALLOCATE_EXTENT);
+            return result;
+        }
+    }
+
     while(!can_be_used());
-    fat_extent result = {0, 1, allocator.index_in_fat};
-    set_used(allocator.index_in_fat);
+    fat_extent result = {0, 1, context->allocator.index_in_fat, 0};
+    set_used(context->allocator.index_in_fat);
 
     while(result.length < max_length && can_be_used()) {
-        result.length = allocator.index_in_fat - result.physical_start + 1;
-        set_used(allocator.index_in_fat);
+        result.length = context->allocator.index_in_fat - result.physical_start + 1;
+        set_used(context->allocator.index_in_fat);
     }
 
     visualizer_add_allocated_extent(result);
+    perf_end(PERF_ALLOCATE_EXTENT);
     return result;
 }
 
+void append_run(fat_extent *&runs, uint32_t& run_count, uint32_t& capacity, uint32_t start, uint32_t end) {
+    if (run_count == capacity) {
+        capacity *= 2;
+        runs = static_cast<fat_extent *>(context_realloc(runs, capacity * sizeof(fat_extent)));
+    }
+    runs[run_count++] = {0, static_cast<uint16_t>(end - start), start, 0};
+}
+
+// Runs never span a blocked extent, so they are shorter than a block group
+fat_extent *find_free_runs(uint32_t& run_count) {
+    uint32_t capacity = 16;
+    auto *runs = static_cast<fat_extent *>(context_malloc(capacity * sizeof(fat_extent)));
+    run_count = 0;
+
+    uint32_t cluster_no = FAT_START_INDEX;
+    // The blocked extent after the last one marks the end of the file system
+    for (uint32_t i = 0; i <= context->allocator.blocked_extent_count; i++) {
+        fat_extent& blocked_extent = context->allocator.blocked_extents[i];
+        uint32_t run_start = 0;
+        for (; cluster_no < blocked_extent.physical_start; cluster_no++) {
+            if (is_free(cluster_no)) {
+                if (!run_start) {
+                    run_start = cluster_no;
+                }
+            } else if (run_start) {
+                append_run(runs, run_count, capacity, run_start, cluster_no);
+                run_start = 0;
+            }
+        }
+        if (run_start) {
+            append_run(runs, run_count, capacity, run_start, cluster_no);
+        }
+
+        uint32_t blocked_end = blocked_extent.physical_start + blocked_extent.length;
+        if (blocked_end > cluster_no) {
+            cluster_no = blocked_end;
+        }
+    }
+    return runs;
+}
+
+void allocate_run(const fat_extent& run) {
+    for (uint32_t cluster_no = run.physical_start; cluster_no < run.physical_start + run.length; cluster_no++) {
+        set_used(cluster_no);
+    }
+    visualizer_add_allocated_extent(run);
+}
+
 uint32_t find_first_blocked_extent(uint32_t physical_address) {
-    uint32_t begin = 0, mid, end = allocator.blocked_extent_count;
+    uint32_t begin = 0, mid, end = context->allocator.blocked_extent_count;
     while(begin < end) {
         mid = (begin+end)/2;
-        fat_extent* blocked_extent = &allocator.blocked_extents[mid];
+        fat_extent* blocked_extent = &context->allocator.blocked_extents[mid];
         if(blocked_extent->physical_start + blocked_extent->length < physical_address)
             begin = mid+1;
         else
@@ -93,9 +249,9 @@ uint32_t find_first_blocked_extent(uint32_t physical_address) {
 }
 
 fat_extent* find_next_blocked_extent(uint32_t& i, uint32_t physical_end) {
-    if(i >= allocator.blocked_extent_count)
+    if(i >= context->allocator.blocked_extent_count)
         return NULL;
-    fat_extent* blocked_extent = &allocator.blocked_extents[i++];
+    fat_extent* blocked_extent = &context->allocator.blocked_extents[i++];
     if(physical_end < blocked_extent->physical_start)
         return NULL;
     return blocked_extent;
@@ -9,11 +9,27 @@ struct extent_allocator {
     uint32_t index_in_fat,
              blocked_extent_count;
     fat_extent *blocked_extents, *blocked_extent_current;
+    // All clusters in [used_from, used_to) are known to be used or blocked,
+    // from where the last goal search started to where it found a cluster
+    uint32_t used_from, used_to;
 };
-extern extent_allocator allocator;
 
 void init_extent_allocator(fat_extent *blocked_extents, uint32_t blocked_extent_count);
-fat_extent allocate_extent(uint16_t max_length);
+void restore_extent_allocator(fat_extent *blocked_extents, uint32_t blocked_extent_count, uint8_t *bitmap,
+                              uint32_t index_in_fat, uint32_t blocked_extent_index);
+void free_extent_allocator();
+uint32_t allocation_bitmap_size();
+void set_used(uint32_t cluster_no);
+void set_free(uint32_t cluster_no);
+// Allocates up to max_length consecutive clusters. With a goal, they start at
+// the first free cluster at or after it, so that related data ends up close
+// together. Otherwise, or if nothing after the goal is free, the allocator
+// continues first-fit from where its last such allocation ended.
+fat_extent allocate_extent(uint16_t max_length, uint32_t goal = 0);
+// Returns all runs of free clusters, sorted by position. The caller frees the array.
+fat_extent *find_free_runs(uint32_t& run_count);
+// Marks a run returned by find_free_runs() (or a part of it) as used
+void allocate_run(const fat_extent& run);
 uint32_t find_first_blocked_extent(uint32_t physical_address);
 fat_extent* find_next_blocked_extent(uint32_t& i, uint32_t physical_end);
 
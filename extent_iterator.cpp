@@ -23,3 +23,17 @@ uint32_t next_cluster_no(extent_iterator *iterator) {
     iterator->current_cluster++;
     return cluster_no;
 }
+
+uint32_t next_cluster_run(extent_iterator *iterator, uint32_t& first_cluster_no) {
+    while (iterator->current_extent && iterator->current_cluster >= iterator->current_extent->length) {
+        *iterator = init(iterator->extent_stream);
+    }
+    if (!iterator->current_extent) {
+        return 0;
+    }
+
+    first_cluster_no = iterator->current_extent->physical_start + iterator->current_cluster;
+    uint32_t length = iterator->current_extent->length - iterator->current_cluster;
+    iterator->current_cluster = iterator->current_extent->length;
+    return length;
+}
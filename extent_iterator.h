@@ -13,4 +13,7 @@ struct extent_iterator {
 
 extent_iterator init(StreamArchiver *extent_stream);
 uint32_t next_cluster_no(extent_iterator *iterator);
+// Hands out the rest of the current extent at once, returns its length or 0
+// once all extents are read
+uint32_t next_cluster_run(extent_iterator *iterator, uint32_t& first_cluster_no);
 #endif //OFS_CONVERT_EXTENT_ITERATOR_H
@@ -6,21 +6,29 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#include "ext4.h"
 #include "fat.h"
 #include "partition.h"
+#include "util.h"
 #include "visualizer.h"
 
-struct boot_sector boot_sector;
-struct meta_info meta_info;
+__thread struct boot_sector boot_sector;
+__thread struct meta_info meta_info;
 
+// The data area is cluster aligned (see set_meta_info), so FAT clusters and
+// ext4 clusters coincide
 uint64_t fat_cl_to_e4blk(uint32_t cluster_no) {
-    return (cluster_no - FAT_START_INDEX) + meta_info.sectors_before_data / boot_sector.sectors_per_cluster;
+    uint64_t partition_cluster_no = (cluster_no - FAT_START_INDEX) + meta_info.clusters_before_data;
+    return partition_cluster_no << context->geometry.cluster_ratio_log2;
 }
 
 // returns 0 if block is before the first data cluster
 uint32_t e4blk_to_fat_cl(uint64_t block_no) {
-    int64_t cluster_no = block_no + FAT_START_INDEX - meta_info.sectors_before_data / boot_sector.sectors_per_cluster;
+    int64_t cluster_no = static_cast<int64_t>(block_no >> context->geometry.cluster_ratio_log2) + FAT_START_INDEX - meta_info.clusters_before_data;
     return (cluster_no < FAT_START_INDEX) ? 0 : static_cast<uint32_t >(cluster_no);
 }
 
@@ -29,7 +37,12 @@ uint32_t *fat_entry(uint32_t cluster_no) {
 }
 
 uint8_t *cluster_start(uint32_t cluster_no) {
-    return meta_info.data_start + (cluster_no - FAT_START_INDEX) * static_cast<uint64_t>(meta_info.cluster_size);
+    return meta_info.data_start + (static_cast<uint64_t>(cluster_no - FAT_START_INDEX) << meta_info.cluster_size_log2);
+}
+
+uint32_t cluster_no_of(const void *address) {
+    uint64_t offset = static_cast<const uint8_t *>(address) - meta_info.data_start;
+    return static_cast<uint32_t>(offset >> meta_info.cluster_size_log2) + FAT_START_INDEX;
 }
 
 bool is_free_cluster(uint32_t cluster_entry) {
@@ -128,13 +141,45 @@ void read_boot_sector(uint8_t *fs) {
     boot_sector = *(struct boot_sector*) fs;
 }
 
-void set_meta_info(uint8_t *fs) {
+// Checks for a BPB with a geometry the conversion can work with. It is also
+// left in retired boot sectors.
+bool has_valid_geometry(const struct boot_sector *boot) {
+    uint16_t bytes_per_sector = boot->bytes_per_sector;
+    return bytes_per_sector >= 512 && bytes_per_sector <= 4096
+           && (bytes_per_sector & (bytes_per_sector - 1)) == 0
+           && boot->sectors_per_cluster && (boot->sectors_per_cluster & (boot->sectors_per_cluster - 1)) == 0
+           && boot->fat_count > 0;
+}
+
+// Checks a sector for a FAT32 boot sector with a geometry the conversion can
+// work with, to tell FAT32 partitions from others of the same type
+bool is_fat32_boot_sector(const uint8_t *sector) {
+    const struct boot_sector *boot = (const struct boot_sector *) sector;
+    return memcmp(&boot->fs_type, "FAT32   ", sizeof boot->fs_type) == 0 && has_valid_geometry(boot);
+}
+
+// Once the partition is ext4, its first sector must neither pass for a FAT
+// boot sector nor for an MBR. The BPB stays, a resumed conversion reads it.
+void retire_fat_boot_sector(uint8_t *fs) {
+    struct boot_sector *boot = (struct boot_sector *) fs;
+    memset(&boot->fs_type, 0, sizeof boot->fs_type);
+    memset(fs + BOOT_SIGNATURE_OFFSET, 0, 2);
+}
+
+bool set_meta_info(uint8_t *fs) {
+    // Everything below divides by it
+    if (!has_valid_geometry(&boot_sector)) {
+        fprintf(stderr, "The boot sector has no valid FAT geometry\n");
+        return false;
+    }
     meta_info.fs_start = fs;
     meta_info.fat_start = (uint32_t *) (fs + boot_sector.sectors_before_fat * boot_sector.bytes_per_sector);
     meta_info.fat_entries = boot_sector.sectors_per_fat / boot_sector.sectors_per_cluster;
     meta_info.cluster_size = boot_sector.sectors_per_cluster * boot_sector.bytes_per_sector;
+    meta_info.cluster_size_log2 = log2(meta_info.cluster_size);
     meta_info.dentries_per_cluster = meta_info.cluster_size / sizeof(struct fat_dentry);
     meta_info.sectors_before_data = boot_sector.sectors_before_fat + boot_sector.sectors_per_fat * boot_sector.fat_count;
+    meta_info.clusters_before_data = meta_info.sectors_before_data / boot_sector.sectors_per_cluster;
     meta_info.data_start = fs + meta_info.sectors_before_data * boot_sector.bytes_per_sector;
 
     visualizer_add_block_range({
@@ -144,9 +189,10 @@ void set_meta_info(uint8_t *fs) {
     });
 
     if (meta_info.sectors_before_data % boot_sector.sectors_per_cluster != 0) {
-        fprintf(stderr, "FAT clusters are not aligned. Cannot convert in-place");
-        exit(1);
+        fprintf(stderr, "FAT clusters are not aligned. Cannot convert in-place\n");
+        return false;
     }
+    return true;
 }
 
 uint32_t sector_count() {
@@ -173,3 +219,140 @@ void read_volume_label(uint8_t* out) {
         memcpy(out, boot_sector.volume_label, i + 1);
     }
 }
+
+#ifdef __SSE2__
+// Gathers the first bytes of 16 dentries into one vector
+__m128i first_dentry_bytes(const fat_dentry *dentries) {
+    __m128i pairs[8], quads[4], octets[2];
+    for (int i = 0; i < 8; i++) {
+        pairs[i] = _mm_unpacklo_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(dentries + 2 * i)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i *>(dentries + 2 * i + 1)));
+    }
+    for (int i = 0; i < 4; i++) {
+        quads[i] = _mm_unpacklo_epi16(pairs[2 * i], pairs[2 * i + 1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        octets[i] = _mm_unpacklo_epi32(quads[2 * i], quads[2 * i + 1]);
+    }
+    return _mm_unpacklo_epi64(octets[0], octets[1]);
+}
+#endif
+
+// Returns a bit for each of up to 64 dentries that is an entry the conversion
+// takes over, which leaves out deleted entries, the dot entries and
+// everything from the end of the directory on
+uint64_t classify_dentries(const fat_dentry *dentries, uint32_t count, bool& is_dir_end) {
+    uint64_t skipped = 0, ends = 0;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    const __m128i deleted_marks = _mm_set1_epi8(static_cast<char>(0xE5)), dots = _mm_set1_epi8('.'),
+                  end_marks = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i first_bytes = first_dentry_bytes(dentries + i);
+        __m128i is_skipped = _mm_or_si128(_mm_cmpeq_epi8(first_bytes, deleted_marks), _mm_cmpeq_epi8(first_bytes, dots));
+        skipped |= static_cast<uint64_t>(_mm_movemask_epi8(is_skipped)) << i;
+        ends |= static_cast<uint64_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(first_bytes, end_marks))) << i;
+    }
+#endif
+    for (; i < count; i++) {
+        uint8_t first_byte = dentries[i].short_name[0];
+        skipped |= static_cast<uint64_t>(first_byte == 0xE5 || first_byte == '.') << i;
+        ends |= static_cast<uint64_t>(first_byte == 0) << i;
+    }
+
+    uint64_t entries = count == 64 ? ~0ull : (1ull << count) - 1;
+    is_dir_end = ends != 0;
+    if (is_dir_end) {
+        entries = (ends & -ends) - 1;  // Those before the first end mark
+    }
+    return entries & ~skipped;
+}
+
+void start_dentry_run(dentry_scanner& scanner, uint32_t cluster_no, uint32_t cluster_count) {
+    scanner.batch = reinterpret_cast<fat_dentry *>(cluster_start(cluster_no));
+    scanner.run_end = scanner.batch + static_cast<uint64_t>(cluster_count) * meta_info.dentries_per_cluster;
+    uint32_t count = scanner.run_end - scanner.batch < 64 ? static_cast<uint32_t>(scanner.run_end - scanner.batch) : 64;
+    scanner.entries = classify_dentries(scanner.batch, count, scanner.is_dir_end);
+}
+
+// Returns the next entry of the run, see classify_dentries(). Returns NULL
+// at the end of the run, and is_dir_end tells whether the directory ends too.
+fat_dentry *next_run_dentry(dentry_scanner& scanner) {
+    while (!scanner.entries) {
+        if (scanner.is_dir_end || scanner.run_end - scanner.batch <= 64) {
+            return NULL;
+        }
+        scanner.batch += 64;
+        uint32_t count = scanner.run_end - scanner.batch < 64 ? static_cast<uint32_t>(scanner.run_end - scanner.batch) : 64;
+        scanner.entries = classify_dentries(scanner.batch, count, scanner.is_dir_end);
+    }
+    fat_dentry *dentry = scanner.batch + __builtin_ctzll(scanner.entries);
+    scanner.entries &= scanner.entries - 1;
+    return dentry;
+}
+
+fat_dir_reader open_fat_dir(uint32_t cluster_no) {
+    fat_dir_reader dir;
+    dir.cluster_no = cluster_no;
+    // An empty run, so that the first call reads the first one
+    dir.scanner.batch = dir.scanner.run_end = NULL;
+    dir.scanner.entries = 0;
+    dir.scanner.is_dir_end = false;
+    return dir;
+}
+
+// Returns the entries of the directory that the conversion takes over, see
+// classify_dentries(). The clusters are followed through the FAT, a run of
+// consecutive ones at a time.
+fat_dentry *next_fat_dentry(fat_dir_reader& dir) {
+    fat_dentry *dentry;
+    while (!(dentry = next_run_dentry(dir.scanner))) {
+        if (dir.scanner.is_dir_end || !dir.cluster_no) {
+            return NULL;
+        }
+        uint32_t run_start = dir.cluster_no, run_length = 1;
+        uint32_t next_cluster_no = *fat_entry(run_start) & CLUSTER_ENTRY_MASK;
+        while (next_cluster_no == run_start + run_length) {
+            run_length++;
+            next_cluster_no = *fat_entry(next_cluster_no) & CLUSTER_ENTRY_MASK;
+        }
+        dir.cluster_no = next_cluster_no < FAT_END_OF_CHAIN ? next_cluster_no : 0;
+        start_dentry_run(dir.scanner, run_start, run_length);
+    }
+    return dentry;
+}
+
+// Counts the files and directories below the root, each of which becomes an
+// inode. Only the directories are read, not the file contents or names.
+uint32_t count_fat_tree() {
+    uint32_t count = 0;
+    uint32_t stack_size = 1, stack_capacity = 64;
+    auto *stack = static_cast<fat_dir_reader *>(context_malloc(stack_capacity * sizeof(fat_dir_reader)));
+    stack[0] = open_fat_dir(boot_sector.root_cluster_no);
+
+    while (stack_size) {
+        fat_dir_reader& dir = stack[stack_size - 1];
+        fat_dentry *dentry = next_fat_dentry(dir);
+        // Like traverse(), take the entry after the long name entries
+        if (dentry && is_lfn(dentry)) {
+            for (int i = lfn_entry_sequence_no(dentry); i > 0 && dentry; i--) {
+                dentry = next_fat_dentry(dir);
+            }
+        }
+        if (!dentry) {
+            stack_size--;
+            continue;
+        }
+
+        count++;
+        if (is_dir(dentry)) {
+            if (stack_size == stack_capacity) {
+                stack_capacity *= 2;
+                stack = static_cast<fat_dir_reader *>(context_realloc(stack, stack_capacity * sizeof(fat_dir_reader)));
+            }
+            stack[stack_size++] = open_fat_dir(file_cluster_no(dentry));
+        }
+    }
+    context_free(stack);
+    return count;
+}
@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 
-void set_meta_info(uint8_t *fs);
+bool set_meta_info(uint8_t *fs);
 void read_boot_sector(uint8_t *fs);
+bool is_fat32_boot_sector(const uint8_t *sector);
+void retire_fat_boot_sector(uint8_t *fs);
 void recursive_traverse(uint32_t cluster_no, uint16_t *long_name);
 
 uint64_t fat_cl_to_e4blk(uint32_t cluster_no);
@@ -22,6 +24,7 @@ uint8_t lfn_entry_sequence_no(struct fat_dentry *dentry);
 uint32_t file_cluster_no(struct fat_dentry *dentry);
 uint32_t *fat_entry(uint32_t cluster_no);
 uint8_t *cluster_start(uint32_t cluster_no);
+uint32_t cluster_no_of(const void *address);
 uint32_t fat_time_to_unix(uint16_t date, uint16_t time);
 bool is_free_cluster(uint32_t cluster_entry);
 void lfn_cpy(uint16_t *dest, uint8_t *src);
@@ -29,6 +32,11 @@ void read_short_name(struct fat_dentry *dentry, uint16_t *name);
 uint32_t sector_count();
 uint32_t data_cluster_count();
 void read_volume_label(uint8_t* out);
+void start_dentry_run(struct dentry_scanner& scanner, uint32_t cluster_no, uint32_t cluster_count);
+struct fat_dentry *next_run_dentry(struct dentry_scanner& scanner);
+struct fat_dir_reader open_fat_dir(uint32_t cluster_no);
+struct fat_dentry *next_fat_dentry(struct fat_dir_reader& dir);
+uint32_t count_fat_tree();
 
 
 // Index in the FAT of the first data cluster
@@ -36,10 +44,16 @@ constexpr uint32_t FAT_START_INDEX = 2;
 constexpr uint32_t CLUSTER_ENTRY_MASK = 0x0FFFFFFF;
 constexpr uint32_t FREE_CLUSTER = 0;
 constexpr uint32_t FAT_END_OF_CHAIN = 0x0FFFFFF8;
+// Entries from here up to FAT_BAD_CLUSTER are no cluster numbers
+constexpr uint32_t FAT_FIRST_RESERVED = 0x0FFFFFF0;
+constexpr uint32_t FAT_BAD_CLUSTER = 0x0FFFFFF7;
+constexpr uint32_t BOOT_SIGNATURE_OFFSET = 510;
 constexpr uint8_t LFN_ENTRY_LENGTH = 13;
+// LFN sequence numbers have 5 bits
+constexpr uint8_t MAX_LFN_ENTRIES = 0x1F;
 
-extern struct boot_sector boot_sector;
-extern struct meta_info meta_info;
+extern __thread struct boot_sector boot_sector;
+extern __thread struct meta_info meta_info;
 
 struct __attribute__((packed)) boot_sector {
     uint8_t jump_instruction[3];
@@ -76,15 +90,24 @@ struct fat_extent {
     uint32_t logical_start;  // First file cluster number that this extent covers
     uint16_t length;  // Number of clusters covered by extent
     uint32_t physical_start;  // Physical cluster number to which this extent points
+    uint16_t flags;  // FAT_EXTENT_* flags
 };
 
+// The extent only contains zeros and becomes an unwritten ext4 extent
+constexpr uint16_t FAT_EXTENT_UNWRITTEN = 0x0001;
+// The extent only contains zeros and becomes a hole, its clusters are freed
+// once the FAT is no longer needed
+constexpr uint16_t FAT_EXTENT_HOLE = 0x0002;
+
 struct meta_info {
     uint8_t* fs_start;
     uint32_t* fat_start;
     uint16_t fat_entries;
     uint32_t cluster_size;
+    uint32_t cluster_size_log2;
     uint32_t dentries_per_cluster;
     uint32_t sectors_before_data;
+    uint32_t clusters_before_data;
     uint8_t* data_start;
 };
 
@@ -104,4 +127,20 @@ struct fat_dentry {
     uint32_t file_size;
 };
 
+// Reads the dentries of a run of consecutive directory clusters, 64 at a time.
+// Each batch is classified at once, see next_run_dentry().
+struct dentry_scanner {
+    fat_dentry *batch;  // First dentry of the current batch
+    fat_dentry *run_end;
+    uint64_t entries;  // The entries of the batch that are still to be returned
+    bool is_dir_end;  // The directory ends within the current batch
+};
+
+// Reads the entries of a FAT directory directly through the FAT, see
+// next_fat_dentry()
+struct fat_dir_reader {
+    uint32_t cluster_no;  // First cluster after the current run, 0 at the end of the chain
+    dentry_scanner scanner;
+};
+
 #endif //OFS_CONVERT_FAT_H
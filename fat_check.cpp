@@ -0,0 +1,300 @@
+#include "conversion_context.h"
+#include "fat.h"
+#include "fat_check.h"
+#include "util.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Further problems are only counted
+constexpr uint32_t FAT_CHECK_MAX_REPORTS = 20;
+constexpr uint32_t FAT_CHECK_MAX_THREADS = 16;
+// Smaller FATs are not worth another thread
+constexpr uint32_t FAT_CHECK_MIN_RANGE = 1 << 18;
+// Chains the threads take from the shared list at a time
+constexpr uint32_t FAT_CHECK_CHAIN_BATCH = 1024;
+
+// The chain of a file or directory, and what it has to look like
+struct fat_chain {
+    uint32_t first_cluster_no;  // 0 for an empty file
+    uint32_t expected_length;  // In clusters, not checked for directories
+    bool is_dir;
+};
+
+// All threads only read the FAT, which is not thread-local like meta_info
+struct fat_checker {
+    const uint32_t *fat;
+    uint32_t cluster_end;  // Index after the last data cluster
+    uint32_t cluster_size_log2;
+    uint64_t *has_predecessor;  // A bit per cluster that some other cluster points to
+    uint8_t *is_chain_start;  // A bit per cluster that starts the chain of a file or directory
+    fat_chain *chains;
+    uint32_t chain_count, chain_capacity;
+    // Shared by all threads
+    uint32_t next_chain;
+    uint32_t error_count;
+    uint64_t used_clusters, chained_clusters;
+};
+
+struct fat_range {
+    fat_checker *checker;
+    uint32_t begin, end;
+};
+
+void report_fat_error(fat_checker *checker, const char *format, ...) {
+    if (__sync_fetch_and_add(&checker->error_count, 1) >= FAT_CHECK_MAX_REPORTS) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "FAT check failed: ");
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+uint32_t next_in_chain(const fat_checker *checker, uint32_t cluster_no) {
+    return checker->fat[cluster_no] & CLUSTER_ENTRY_MASK;
+}
+
+bool is_bad_cluster(const fat_checker *checker, uint32_t cluster_no) {
+    return next_in_chain(checker, cluster_no) == FAT_BAD_CLUSTER;
+}
+
+// Bad clusters are neither free nor in use
+bool is_cluster_in_use(const fat_checker *checker, uint32_t cluster_no) {
+    return cluster_no >= FAT_START_INDEX && cluster_no < checker->cluster_end
+           && !is_free_cluster(checker->fat[cluster_no]) && !is_bad_cluster(checker, cluster_no);
+}
+
+const char *cluster_state(const fat_checker *checker, uint32_t cluster_no) {
+    if (cluster_no < FAT_START_INDEX || cluster_no >= checker->cluster_end) {
+        return "invalid";
+    }
+    return is_bad_cluster(checker, cluster_no) ? "bad" : "free";
+}
+
+// Counts how many clusters point to each one, at most once without an error
+void *check_fat_range(void *arg) {
+    fat_range *range = static_cast<fat_range *>(arg);
+    fat_checker *checker = range->checker;
+    uint64_t used_clusters = 0;
+    for (uint32_t cluster_no = range->begin; cluster_no < range->end; cluster_no++) {
+        uint32_t next_cluster_no = next_in_chain(checker, cluster_no);
+        if (next_cluster_no == FREE_CLUSTER || next_cluster_no == FAT_BAD_CLUSTER) {
+            continue;
+        }
+        used_clusters++;
+        if (next_cluster_no >= FAT_END_OF_CHAIN) {
+            continue;
+        }
+        if (next_cluster_no >= FAT_FIRST_RESERVED) {
+            report_fat_error(checker, "Cluster %u holds the reserved value 0x%08X", cluster_no, next_cluster_no);
+            continue;
+        }
+        if (!is_cluster_in_use(checker, next_cluster_no)) {
+            report_fat_error(checker, "Cluster %u continues in cluster %u, which is %s", cluster_no, next_cluster_no,
+                             cluster_state(checker, next_cluster_no));
+            continue;
+        }
+        uint64_t bit = 1ULL << (next_cluster_no % 64);
+        if (__sync_fetch_and_or(&checker->has_predecessor[next_cluster_no / 64], bit) & bit) {
+            report_fat_error(checker, "Cluster %u is cross-linked, more than one cluster continues in it",
+                             next_cluster_no);
+        }
+    }
+    __sync_fetch_and_add(&checker->used_clusters, used_clusters);
+    return NULL;
+}
+
+bool has_predecessor(const fat_checker *checker, uint32_t cluster_no) {
+    return checker->has_predecessor[cluster_no / 64] & (1ULL << (cluster_no % 64));
+}
+
+// Claims the chain of a file or directory, which has to start where no
+// other chain leads and not be claimed yet. Without cross-links, such a chain
+// cannot loop.
+bool claim_chain(fat_checker *checker, fat_dentry *dentry) {
+    uint32_t cluster_no = file_cluster_no(dentry);
+    if (!cluster_no && !is_dir(dentry)) {
+        return true;
+    }
+    if (!is_cluster_in_use(checker, cluster_no)) {
+        report_fat_error(checker, "The %s at cluster %u starts in a cluster that is %s",
+                         is_dir(dentry) ? "directory" : "file", cluster_no, cluster_state(checker, cluster_no));
+        return false;
+    }
+    uint8_t bit = static_cast<uint8_t>(1 << (cluster_no % 8));
+    if (has_predecessor(checker, cluster_no)) {
+        report_fat_error(checker, "The %s at cluster %u starts where another chain continues, "
+                                  "or its chain loops back to its start",
+                         is_dir(dentry) ? "directory" : "file", cluster_no);
+        return false;
+    }
+    if (checker->is_chain_start[cluster_no / 8] & bit) {
+        report_fat_error(checker, "The %s at cluster %u shares its clusters with another file or directory",
+                         is_dir(dentry) ? "directory" : "file", cluster_no);
+        return false;
+    }
+    checker->is_chain_start[cluster_no / 8] |= bit;
+    return true;
+}
+
+void add_chain(fat_checker *checker, fat_dentry *dentry) {
+    if (checker->chain_count == checker->chain_capacity) {
+        checker->chain_capacity *= 2;
+        checker->chains = static_cast<fat_chain *>(context_realloc(checker->chains,
+                                                                   checker->chain_capacity * sizeof(fat_chain)));
+    }
+    uint32_t cluster_size = 1 << checker->cluster_size_log2;
+    auto expected_length = static_cast<uint32_t>((static_cast<uint64_t>(dentry->file_size) + cluster_size - 1)
+                                                 >> checker->cluster_size_log2);
+    checker->chains[checker->chain_count++] = {file_cluster_no(dentry), expected_length, is_dir(dentry)};
+}
+
+// Collects the chains of all files and directories, like count_fat_tree().
+// A directory is only read once its chain is claimed, so that reading it
+// cannot loop.
+void collect_fat_chains(fat_checker *checker) {
+    uint32_t stack_size = 1, stack_capacity = 64;
+    auto *stack = static_cast<fat_dir_reader *>(context_malloc(stack_capacity * sizeof(fat_dir_reader)));
+    stack[0] = open_fat_dir(boot_sector.root_cluster_no);
+    fat_dentry root = {};
+    root.attrs = 0x10;
+    root.first_cluster_low = static_cast<uint16_t>(boot_sector.root_cluster_no);
+    root.first_cluster_high = static_cast<uint16_t>(boot_sector.root_cluster_no >> 16);
+    if (!claim_chain(checker, &root)) {
+        stack_size = 0;
+    } else {
+        add_chain(checker, &root);
+    }
+
+    while (stack_size) {
+        fat_dir_reader& dir = stack[stack_size - 1];
+        fat_dentry *dentry = next_fat_dentry(dir);
+        if (dentry && is_lfn(dentry)) {
+            for (int i = lfn_entry_sequence_no(dentry); i > 0 && dentry; i--) {
+                dentry = next_fat_dentry(dir);
+            }
+        }
+        if (!dentry) {
+            stack_size--;
+            continue;
+        }
+        if (!claim_chain(checker, dentry)) {
+            continue;
+        }
+        add_chain(checker, dentry);
+        if (is_dir(dentry)) {
+            if (stack_size == stack_capacity) {
+                stack_capacity *= 2;
+                stack = static_cast<fat_dir_reader *>(context_realloc(stack, stack_capacity * sizeof(fat_dir_reader)));
+            }
+            stack[stack_size++] = open_fat_dir(file_cluster_no(dentry));
+        }
+    }
+    context_free(stack);
+}
+
+// Follows the collected chains, a batch at a time, whatever the range
+void *check_fat_chains(void *arg) {
+    fat_checker *checker = static_cast<fat_range *>(arg)->checker;
+    uint64_t chained_clusters = 0;
+    for (uint32_t begin = __sync_fetch_and_add(&checker->next_chain, FAT_CHECK_CHAIN_BATCH);
+         begin < checker->chain_count;
+         begin = __sync_fetch_and_add(&checker->next_chain, FAT_CHECK_CHAIN_BATCH)) {
+        uint32_t end = min(begin + FAT_CHECK_CHAIN_BATCH, checker->chain_count);
+        for (uint32_t i = begin; i < end; i++) {
+            const fat_chain& chain = checker->chains[i];
+            uint32_t length = 0;
+            // All links lead to clusters in use by now, the bound is only a safeguard
+            for (uint32_t cluster_no = chain.first_cluster_no; cluster_no && cluster_no < checker->cluster_end;
+                 cluster_no = next_in_chain(checker, cluster_no)) {
+                length++;
+            }
+            if (!chain.is_dir && length != chain.expected_length) {
+                report_fat_error(checker, "The file at cluster %u has %u clusters, its size needs %u",
+                                 chain.first_cluster_no, length, chain.expected_length);
+            }
+            chained_clusters += length;
+        }
+    }
+    __sync_fetch_and_add(&checker->chained_clusters, chained_clusters);
+    return NULL;
+}
+
+uint32_t fat_check_thread_count(uint32_t cluster_count) {
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t count = cpu_count > 0 ? static_cast<uint32_t>(cpu_count) : 1;
+    return min(min(count, FAT_CHECK_MAX_THREADS), cluster_count / FAT_CHECK_MIN_RANGE + 1);
+}
+
+// Runs a worker per range, the calling thread being one of them
+void run_fat_check_threads(void *(*worker)(void *), fat_range *ranges, uint32_t count) {
+    auto *threads = static_cast<pthread_t *>(malloc(count * sizeof(pthread_t)));
+    uint32_t started = 0;
+    for (; started + 1 < count; started++) {
+        if (pthread_create(&threads[started], NULL, worker, &ranges[started])) {
+            break;
+        }
+    }
+    // Whatever did not get a thread of its own runs here
+    for (uint32_t i = started; i < count; i++) {
+        worker(&ranges[i]);
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+bool check_fat_consistency() {
+    fat_checker checker;
+    memset(&checker, 0, sizeof checker);
+    checker.fat = meta_info.fat_start;
+    checker.cluster_end = data_cluster_count();
+    checker.cluster_size_log2 = meta_info.cluster_size_log2;
+    checker.has_predecessor = static_cast<uint64_t *>(context_calloc(checker.cluster_end / 64 + 1, sizeof(uint64_t)));
+
+    uint32_t cluster_count = checker.cluster_end - FAT_START_INDEX;
+    uint32_t thread_count = fat_check_thread_count(cluster_count);
+    auto *ranges = static_cast<fat_range *>(context_malloc(thread_count * sizeof(fat_range)));
+    for (uint32_t i = 0; i < thread_count; i++) {
+        ranges[i] = {&checker, FAT_START_INDEX + static_cast<uint32_t>(static_cast<uint64_t>(cluster_count) * i / thread_count),
+                     FAT_START_INDEX + static_cast<uint32_t>(static_cast<uint64_t>(cluster_count) * (i + 1) / thread_count)};
+    }
+    run_fat_check_threads(check_fat_range, ranges, thread_count);
+
+    // Following chains is only safe without cross-links
+    if (!checker.error_count) {
+        checker.is_chain_start = static_cast<uint8_t *>(context_calloc(checker.cluster_end / 8 + 1, 1));
+        checker.chain_capacity = 1024;
+        checker.chains = static_cast<fat_chain *>(context_malloc(checker.chain_capacity * sizeof(fat_chain)));
+        collect_fat_chains(&checker);
+        if (!checker.error_count) {
+            run_fat_check_threads(check_fat_chains, ranges, thread_count);
+        }
+        // Chains that no file or directory starts, including loops on their own
+        if (!checker.error_count && checker.chained_clusters != checker.used_clusters) {
+            report_fat_error(&checker, "%llu clusters are in use, but belong to no file or directory",
+                             static_cast<unsigned long long>(checker.used_clusters - checker.chained_clusters));
+        }
+        context_free(checker.chains);
+        context_free(checker.is_chain_start);
+    }
+    context_free(checker.has_predecessor);
+    context_free(ranges);
+
+    if (checker.error_count) {
+        if (checker.error_count > FAT_CHECK_MAX_REPORTS) {
+            fprintf(stderr, "%u more problems\n", checker.error_count - FAT_CHECK_MAX_REPORTS);
+        }
+        fprintf(stderr, "The FAT file system is inconsistent, repair it with fsck.vfat before converting\n");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,16 @@
+#ifndef OFS_CONVERT_FAT_CHECK_H
+#define OFS_CONVERT_FAT_CHECK_H
+
+// Checks that the FAT file system is consistent enough to be converted, like
+// fsck.vfat would, but only for what the conversion relies on:
+//  - every cluster in a chain points to a cluster in use or ends the chain,
+//  - no cluster is pointed to twice, so chains neither merge nor loop,
+//  - every file and directory has a chain of its own that no other chain
+//    leads into, and files have as many clusters as their size needs,
+//  - every cluster in use belongs to a file or directory.
+// The FAT is scanned by several threads, each taking a range of it, and the
+// chains of the files are followed in parallel as well. Prints what is wrong
+// and returns false if the conversion must not start.
+bool check_fat_consistency();
+
+#endif //OFS_CONVERT_FAT_CHECK_H
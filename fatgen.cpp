@@ -0,0 +1,939 @@
+// Writes synthetic FAT32 images directly, without mkfs.fat or mounting. The
+// names, sizes, contents and timestamps are all derived from the seed, so the
+// same arguments always produce the same image. With a partition table, it
+// writes a whole disk of several such partitions, each with its own seed.
+#include "conversion_context.h"
+#include "ext4.h"
+#include "ext4_bg.h"
+#include "ext4_dentry.h"
+#include "fat.h"
+#include "partition.h"
+#include "partition_table.h"
+#include "util.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+constexpr uint16_t RESERVED_SECTORS = 32;
+constexpr uint8_t FAT_COUNT = 2;
+constexpr uint32_t FAT_CHAIN_END = 0x0FFFFFFF;
+constexpr uint8_t ATTR_DIRECTORY = 0x10;
+constexpr uint8_t ATTR_ARCHIVE = 0x20;
+constexpr uint8_t ATTR_LFN = 0x0F;
+// Caps the directory tree, whose first clusters are kept in memory
+constexpr uint64_t MAX_DIR_COUNT = 1 << 24;
+// Partitions start at whole MiB, like partitioning tools place them
+constexpr uint64_t PARTITION_ALIGNMENT = 1 << 20;
+constexpr uint32_t MBR_SECTOR_SIZE = 512;
+constexpr uint32_t MBR_PRIMARY_COUNT = 4;
+constexpr uint8_t MBR_TYPE_EXTENDED = 0x05;
+constexpr uint8_t MBR_TYPE_EXTENDED_LBA = 0x0F;
+constexpr uint32_t GPT_ENTRY_COUNT = 128;
+
+enum DiskTable {
+    TABLE_NONE,
+    TABLE_MBR,
+    TABLE_GPT,
+};
+
+// Damage to the FAT of the finished image, which ofs-convert has to refuse
+enum Corruption {
+    CORRUPT_NONE,
+    CORRUPT_CROSS_LINK,  // The first cluster of a file continues in the second cluster of another
+    CORRUPT_LOOP,  // The last cluster of a file continues in its first
+    CORRUPT_FREE_LINK,  // The last cluster of a file continues in a free cluster
+    CORRUPT_BAD_LINK,  // The same, but the cluster is marked as bad
+    CORRUPT_SIZE,  // A file has a cluster more than its size needs
+    CORRUPT_LOST,  // Two otherwise free clusters continue in each other
+};
+
+static const char *const corruption_names[] = {
+    "none", "cross-link", "loop", "free-link", "bad-link", "size", "lost"
+};
+
+struct generator_options {
+    uint64_t image_size;
+    uint32_t sector_size, cluster_size;
+    uint64_t file_count;
+    uint32_t fan_out, depth;  // Of the directory tree below the root
+    uint32_t min_name_length, max_name_length;
+    uint64_t min_file_size, max_file_size;
+    // Files are allocated in fragments of this many clusters, taking turns
+    // with interleave files. 0 allocates each file contiguously.
+    uint32_t fragment_clusters, interleave;
+    // Share of the clusters under the future ext4 block group metadata that
+    // may hold data, in percent
+    uint32_t metadata_overlap;
+    uint32_t block_size;  // ext4 block size the metadata is computed for
+    bool zero_content;  // Leaves the file data as holes
+    // Deleted entries in front of each file, like those that deleting files
+    // leaves behind
+    uint32_t deleted_entries;
+    uint64_t seed;
+    Corruption corruption;
+};
+
+struct cluster_allocator {
+    uint32_t next, end;
+    // Clusters of the ext4 block group metadata, sorted
+    fat_extent *metadata;
+    uint32_t metadata_index, metadata_count;
+    uint32_t used_count;
+};
+
+// Per file state while its fragments are allocated
+struct file_allocation {
+    uint64_t file_no;
+    uint32_t first_cluster, last_cluster, remaining_clusters;
+};
+
+__thread generator_options options;
+__thread cluster_allocator clusters;
+__thread uint32_t *dir_first_clusters;
+__thread uint64_t dir_count;
+// The first and last cluster of the first files of at least two clusters,
+// which a corruption damages
+__thread uint32_t corruption_targets[2][2];
+__thread uint32_t corruption_target_count;
+
+uint64_t mix(uint64_t value) {
+    // splitmix64 finalizer
+    value += 0x9E3779B97F4A7C15ULL;
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+// Random value for property of entity, the same for every run
+uint64_t derive(uint64_t entity, uint64_t property) {
+    return mix(mix(options.seed ^ mix(entity)) + property);
+}
+
+enum EntityProperty : uint64_t {
+    DIR_NAME_LENGTH = 1,
+    FILE_NAME_LENGTH,
+    NAME_CHARS,
+    FILE_SIZE,
+    TIMESTAMP,
+    CONTENT,
+    GUID_LOW,
+    GUID_HIGH,
+};
+
+// Directories and files are numbered separately
+uint64_t file_entity(uint64_t file_no) {
+    return file_no << 1 | 1;
+}
+
+uint64_t dir_entity(uint64_t dir_no) {
+    return dir_no << 1;
+}
+
+uint64_t pick(uint64_t random, uint64_t min_value, uint64_t max_value) {
+    return min_value + random % (max_value - min_value + 1);
+}
+
+uint64_t file_size(uint64_t file_no) {
+    // Log-uniform, so that small files are as common as in real trees
+    uint64_t random = derive(file_entity(file_no), FILE_SIZE);
+    uint32_t min_bits = options.min_file_size ? 64 - __builtin_clzll(options.min_file_size) : 0,
+             max_bits = options.max_file_size ? 64 - __builtin_clzll(options.max_file_size) : 0;
+    uint32_t bits = static_cast<uint32_t>(pick(random, min_bits, max_bits));
+    uint64_t lower = bits ? 1ULL << (bits - 1) : 0, upper = bits ? (1ULL << (bits - 1) << 1) - 1 : 0;
+    lower = lower < options.min_file_size ? options.min_file_size : lower;
+    upper = upper > options.max_file_size ? options.max_file_size : upper;
+    return pick(random >> 8, lower, upper);
+}
+
+// Writes the long name of an entity, unique in its directory through the
+// index there, and returns its length
+uint32_t entity_name(uint64_t entity, EntityProperty length_property, uint32_t index, uint16_t *name) {
+    static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_ ";
+    char suffix[16];
+    uint32_t suffix_length = static_cast<uint32_t>(snprintf(suffix, sizeof suffix, "_%u", index));
+    uint32_t length = static_cast<uint32_t>(pick(derive(entity, length_property), options.min_name_length,
+                                                 options.max_name_length));
+    if (length < suffix_length + 1) {
+        length = suffix_length + 1;
+    }
+
+    uint64_t random = derive(entity, NAME_CHARS);
+    uint32_t prefix_length = length - suffix_length;
+    for (uint32_t i = 0; i < prefix_length; i++) {
+        if (i % 8 == 0 && i) {
+            random = mix(random);
+        }
+        // No leading spaces, which FAT drivers strip
+        name[i] = chars[(random >> (i % 8 * 8)) % (i ? sizeof chars - 1 : sizeof chars - 2)];
+    }
+    for (uint32_t i = 0; i < suffix_length; i++) {
+        name[prefix_length + i] = suffix[i];
+    }
+    return length;
+}
+
+uint32_t lfn_entry_count(uint32_t name_length) {
+    return ceildiv(name_length, static_cast<uint32_t>(LFN_ENTRY_LENGTH));
+}
+
+uint32_t dir_name_entry_count(uint64_t dir_no) {
+    uint16_t name[EXT4_NAME_LEN];
+    return 1 + lfn_entry_count(entity_name(dir_entity(dir_no), DIR_NAME_LENGTH, 0, name));
+}
+
+uint32_t file_name_entry_count(uint64_t file_no, uint32_t index) {
+    uint16_t name[EXT4_NAME_LEN];
+    return 1 + lfn_entry_count(entity_name(file_entity(file_no), FILE_NAME_LENGTH, index, name));
+}
+
+// The tree is a complete fan_out-ary tree, numbered breadth first, so that
+// the children of dir_no are fan_out * dir_no + 1 and following
+uint64_t first_child(uint64_t dir_no) {
+    return options.fan_out * dir_no + 1;
+}
+
+uint64_t child_count(uint64_t dir_no) {
+    return first_child(dir_no) < dir_count ? options.fan_out : 0;
+}
+
+// Files are dealt to the directories in turn
+uint64_t dir_file_count(uint64_t dir_no) {
+    return dir_no < options.file_count ? (options.file_count - dir_no + dir_count - 1) / dir_count : 0;
+}
+
+bool is_metadata_cluster(uint32_t cluster_no) {
+    while (clusters.metadata_index < clusters.metadata_count) {
+        const fat_extent& extent = clusters.metadata[clusters.metadata_index];
+        if (cluster_no < extent.physical_start + extent.length) {
+            return cluster_no >= extent.physical_start;
+        }
+        clusters.metadata_index++;
+    }
+    return false;
+}
+
+// Allocates up to count clusters in a row, at least one. Returns the first.
+uint32_t allocate_clusters(uint32_t count, uint32_t *allocated) {
+    while (clusters.next < clusters.end && is_metadata_cluster(clusters.next)
+           && derive(clusters.next, 0) % 100 >= options.metadata_overlap) {
+        clusters.next++;
+    }
+    if (clusters.next >= clusters.end) {
+        fprintf(stderr, "The image is too small for the files\n");
+        exit(1);
+    }
+
+    uint32_t first = clusters.next;
+    *allocated = 0;
+    while (*allocated < count && clusters.next < clusters.end
+           && (!is_metadata_cluster(clusters.next) || derive(clusters.next, 0) % 100 < options.metadata_overlap)) {
+        clusters.next++;
+        (*allocated)++;
+    }
+    clusters.used_count += *allocated;
+    return first;
+}
+
+// Appends the clusters to the chain ending in last_cluster, if there is one
+void append_clusters(uint32_t& last_cluster, uint32_t first, uint32_t count) {
+    if (last_cluster) {
+        *fat_entry(last_cluster) = first;
+    }
+    for (uint32_t cluster_no = first; cluster_no < first + count - 1; cluster_no++) {
+        *fat_entry(cluster_no) = cluster_no + 1;
+    }
+    last_cluster = first + count - 1;
+    *fat_entry(last_cluster) = FAT_CHAIN_END;
+}
+
+// Allocates a whole chain, in fragments if fragmentation is requested
+uint32_t allocate_chain(uint32_t cluster_count) {
+    uint32_t first_cluster = 0, last_cluster = 0;
+    while (cluster_count) {
+        uint32_t allocated;
+        uint32_t first = allocate_clusters(cluster_count, &allocated);
+        append_clusters(last_cluster, first, allocated);
+        first_cluster = first_cluster ? first_cluster : first;
+        cluster_count -= allocated;
+    }
+    return first_cluster;
+}
+
+struct dir_writer {
+    uint32_t cluster_no;
+    uint32_t position;  // Of the next dentry in the cluster
+};
+
+fat_dentry *next_dentry(dir_writer *writer) {
+    if (writer->position == meta_info.dentries_per_cluster) {
+        writer->cluster_no = *fat_entry(writer->cluster_no) & CLUSTER_ENTRY_MASK;
+        writer->position = 0;
+    }
+    return reinterpret_cast<fat_dentry *>(cluster_start(writer->cluster_no)) + writer->position++;
+}
+
+void set_timestamps(fat_dentry *dentry, uint64_t entity) {
+    uint64_t random = derive(entity, TIMESTAMP);
+    // Between 1990 and 2029, days that exist in every month
+    uint16_t date = static_cast<uint16_t>((10 + random % 40) << 9 | (1 + (random >> 8) % 12) << 5 | (1 + (random >> 16) % 28));
+    uint16_t time_of_day = static_cast<uint16_t>(((random >> 24) % 24) << 11 | ((random >> 32) % 60) << 5 | (random >> 40) % 30);
+    dentry->create_date = dentry->mod_date = dentry->access_date = date;
+    dentry->create_time = dentry->mod_time = time_of_day;
+}
+
+uint8_t short_name_checksum(const uint8_t *short_name) {
+    uint8_t checksum = 0;
+    for (int i = 0; i < 11; i++) {
+        checksum = static_cast<uint8_t>(((checksum & 1) << 7) + (checksum >> 1) + short_name[i]);
+    }
+    return checksum;
+}
+
+// Writes the long name entries and the short entry. The short names are only
+// there to be unique, every entry has a long name.
+void write_entry(dir_writer *writer, uint64_t entity, EntityProperty length_property, uint32_t index,
+                 uint8_t attrs, uint32_t first_cluster, uint32_t size) {
+    uint16_t name[EXT4_NAME_LEN];
+    uint32_t name_length = entity_name(entity, length_property, index, name);
+    uint8_t short_name[11];
+    char short_name_text[12];
+    snprintf(short_name_text, sizeof short_name_text, "%c%07X   ", attrs & ATTR_DIRECTORY ? 'D' : 'F', index);
+    memcpy(short_name, short_name_text, sizeof short_name);
+    uint8_t checksum = short_name_checksum(short_name);
+
+    uint32_t lfn_count = lfn_entry_count(name_length);
+    for (uint32_t sequence_no = lfn_count; sequence_no > 0; sequence_no--) {
+        uint8_t *entry = reinterpret_cast<uint8_t *>(next_dentry(writer));
+        uint16_t chars[LFN_ENTRY_LENGTH];
+        for (uint32_t i = 0; i < LFN_ENTRY_LENGTH; i++) {
+            uint32_t name_index = (sequence_no - 1) * LFN_ENTRY_LENGTH + i;
+            // A shorter name is terminated and then padded
+            chars[i] = name_index < name_length ? name[name_index] : name_index == name_length ? 0 : 0xFFFF;
+        }
+        memset(entry, 0, sizeof(fat_dentry));
+        entry[0] = static_cast<uint8_t>(sequence_no | (sequence_no == lfn_count ? 0x40 : 0));
+        memcpy(entry + 1, chars, 5 * sizeof(uint16_t));
+        entry[11] = ATTR_LFN;
+        entry[13] = checksum;
+        memcpy(entry + 14, chars + 5, 6 * sizeof(uint16_t));
+        memcpy(entry + 28, chars + 11, 2 * sizeof(uint16_t));
+    }
+
+    fat_dentry *dentry = next_dentry(writer);
+    memset(dentry, 0, sizeof *dentry);
+    memcpy(dentry->short_name, short_name, sizeof short_name);
+    dentry->attrs = attrs;
+    dentry->first_cluster_low = static_cast<uint16_t>(first_cluster);
+    dentry->first_cluster_high = static_cast<uint16_t>(first_cluster >> 16);
+    dentry->file_size = size;
+    set_timestamps(dentry, entity);
+}
+
+// Deleting a file only marks its entries as free in their first byte
+void write_deleted_entries(dir_writer *writer, uint32_t index) {
+    for (uint32_t i = 0; i < options.deleted_entries; i++) {
+        fat_dentry *dentry = next_dentry(writer);
+        memset(dentry, 0, sizeof *dentry);
+        char short_name_text[12];
+        snprintf(short_name_text, sizeof short_name_text, "X%07X   ", index);
+        memcpy(dentry->short_name, short_name_text, sizeof dentry->short_name + sizeof dentry->short_extension);
+        dentry->short_name[0] = 0xE5;
+        dentry->attrs = ATTR_ARCHIVE;
+    }
+}
+
+void write_dot_entry(dir_writer *writer, const char *name, uint32_t first_cluster, uint64_t dir_no) {
+    fat_dentry *dentry = next_dentry(writer);
+    memset(dentry, 0, sizeof *dentry);
+    memset(dentry->short_name, ' ', sizeof dentry->short_name + sizeof dentry->short_extension);
+    memcpy(dentry->short_name, name, strlen(name));
+    dentry->attrs = ATTR_DIRECTORY;
+    dentry->first_cluster_low = static_cast<uint16_t>(first_cluster);
+    dentry->first_cluster_high = static_cast<uint16_t>(first_cluster >> 16);
+    set_timestamps(dentry, dir_entity(dir_no));
+}
+
+uint32_t dir_cluster_count(uint64_t dir_no) {
+    uint64_t entry_count = dir_no ? 2 : 0;
+    for (uint64_t i = 0; i < child_count(dir_no); i++) {
+        entry_count += dir_name_entry_count(first_child(dir_no) + i);
+    }
+    for (uint64_t i = 0; i < dir_file_count(dir_no); i++) {
+        entry_count += options.deleted_entries + file_name_entry_count(dir_no + i * dir_count, static_cast<uint32_t>(i));
+    }
+    // Even an empty directory has a cluster
+    return entry_count ? ceildiv<uint64_t>(entry_count, meta_info.dentries_per_cluster) : 1;
+}
+
+void write_content(uint64_t file_no, uint32_t first_cluster, uint64_t size) {
+    uint32_t cluster_no = first_cluster;
+    for (uint64_t offset = 0; offset < size; offset += meta_info.cluster_size) {
+        uint64_t random = derive(file_entity(file_no), CONTENT + offset);
+        uint64_t length = size - offset < meta_info.cluster_size ? size - offset : meta_info.cluster_size;
+        uint8_t *data = cluster_start(cluster_no);
+        for (uint64_t i = 0; i < length; i += sizeof random) {
+            // xorshift64
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            memcpy(data + i, &random, length - i < sizeof random ? length - i : sizeof random);
+        }
+        cluster_no = *fat_entry(cluster_no) & CLUSTER_ENTRY_MASK;
+    }
+}
+
+// Allocates the files of a directory in groups of interleave files, which
+// take turns getting their next fragment
+void write_files(dir_writer *writer, uint64_t dir_no, file_allocation *group) {
+    uint64_t file_count = dir_file_count(dir_no);
+    uint32_t group_size = options.fragment_clusters ? options.interleave : 1;
+    for (uint64_t group_start = 0; group_start < file_count; group_start += group_size) {
+        uint32_t count = file_count - group_start < group_size ? static_cast<uint32_t>(file_count - group_start)
+                                                               : group_size;
+        bool is_allocating = false;
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t file_no = dir_no + (group_start + i) * dir_count;
+            group[i] = {file_no, 0, 0, ceildiv<uint64_t>(file_size(file_no), meta_info.cluster_size)};
+            is_allocating |= group[i].remaining_clusters > 0;
+        }
+
+        while (is_allocating) {
+            is_allocating = false;
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t fragment = options.fragment_clusters && options.fragment_clusters < group[i].remaining_clusters
+                                    ? options.fragment_clusters : group[i].remaining_clusters;
+                while (fragment) {
+                    uint32_t allocated;
+                    uint32_t first = allocate_clusters(fragment, &allocated);
+                    append_clusters(group[i].last_cluster, first, allocated);
+                    group[i].first_cluster = group[i].first_cluster ? group[i].first_cluster : first;
+                    group[i].remaining_clusters -= allocated;
+                    fragment -= allocated;
+                }
+                is_allocating |= group[i].remaining_clusters > 0;
+            }
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (corruption_target_count < 2 && group[i].first_cluster != group[i].last_cluster) {
+                corruption_targets[corruption_target_count][0] = group[i].first_cluster;
+                corruption_targets[corruption_target_count++][1] = group[i].last_cluster;
+            }
+            uint64_t size = file_size(group[i].file_no);
+            write_deleted_entries(writer, static_cast<uint32_t>(group_start + i));
+            write_entry(writer, file_entity(group[i].file_no), FILE_NAME_LENGTH,
+                        static_cast<uint32_t>(group_start + i), ATTR_ARCHIVE, group[i].first_cluster,
+                        static_cast<uint32_t>(size));
+            if (!options.zero_content) {
+                write_content(group[i].file_no, group[i].first_cluster, size);
+            }
+        }
+    }
+}
+
+// Writes the directories breadth first. The clusters of a directory are
+// allocated with its parent, which has to know where they are.
+void write_tree() {
+    auto *group = static_cast<file_allocation *>(malloc(options.interleave * sizeof(file_allocation)));
+    dir_first_clusters[0] = allocate_chain(dir_cluster_count(0));
+    boot_sector.root_cluster_no = dir_first_clusters[0];
+
+    for (uint64_t dir_no = 0; dir_no < dir_count; dir_no++) {
+        for (uint64_t i = 0; i < child_count(dir_no); i++) {
+            uint64_t child = first_child(dir_no) + i;
+            dir_first_clusters[child] = allocate_chain(dir_cluster_count(child));
+        }
+
+        dir_writer writer = {dir_first_clusters[dir_no], 0};
+        if (dir_no) {
+            uint64_t parent = (dir_no - 1) / options.fan_out;
+            write_dot_entry(&writer, ".", dir_first_clusters[dir_no], dir_no);
+            // The root is referred to as cluster 0
+            write_dot_entry(&writer, "..", parent ? dir_first_clusters[parent] : 0, parent);
+        }
+        for (uint64_t i = 0; i < child_count(dir_no); i++) {
+            uint64_t child = first_child(dir_no) + i;
+            write_entry(&writer, dir_entity(child), DIR_NAME_LENGTH, static_cast<uint32_t>(i), ATTR_DIRECTORY,
+                        dir_first_clusters[child], 0);
+        }
+        write_files(&writer, dir_no, group);
+    }
+    free(group);
+}
+
+void init_boot_sector(uint8_t *fs) {
+    uint32_t sectors_per_cluster = options.cluster_size / options.sector_size;
+    auto total_sectors = static_cast<uint32_t>(options.image_size / options.sector_size);
+    // The FAT has to cover the clusters that remain next to it
+    uint32_t sectors_per_fat = 1, reserved_sectors;
+    for (;;) {
+        reserved_sectors = RESERVED_SECTORS;
+        // Like mkfs.fat, align the data area to whole clusters
+        uint32_t fat_sectors = FAT_COUNT * sectors_per_fat;
+        reserved_sectors += (sectors_per_cluster - (reserved_sectors + fat_sectors) % sectors_per_cluster)
+                            % sectors_per_cluster;
+        uint32_t cluster_count = (total_sectors - reserved_sectors - fat_sectors) / sectors_per_cluster;
+        uint32_t needed = ceildiv<uint64_t>((cluster_count + FAT_START_INDEX) * 4ULL, options.sector_size);
+        if (needed <= sectors_per_fat) {
+            break;
+        }
+        sectors_per_fat = needed;
+    }
+
+    memset(&boot_sector, 0, sizeof boot_sector);
+    memcpy(boot_sector.jump_instruction, "\xEB\x58\x90", 3);
+    memcpy(boot_sector.oem_name, "ofsgen  ", 8);
+    boot_sector.bytes_per_sector = static_cast<uint16_t>(options.sector_size);
+    boot_sector.sectors_per_cluster = static_cast<uint8_t>(sectors_per_cluster);
+    boot_sector.sectors_before_fat = static_cast<uint16_t>(reserved_sectors);
+    boot_sector.fat_count = FAT_COUNT;
+    boot_sector.media_descriptor = 0xF8;
+    boot_sector.sectors_per_disk_track = 32;
+    boot_sector.disk_heads = 64;
+    boot_sector.total_sectors2 = total_sectors;
+    boot_sector.sectors_per_fat = sectors_per_fat;
+    boot_sector.fs_info_sector_no = 1;
+    boot_sector.backup_boot_sector_no = 6;
+    boot_sector.physical_drive_no = 0x80;
+    boot_sector.ext_boot_signature = 0x29;
+    boot_sector.volume_id = static_cast<uint32_t>(derive(0, 0));
+    memcpy(boot_sector.volume_label, "NO NAME    ", sizeof boot_sector.volume_label);
+    memcpy(&boot_sector.fs_type, "FAT32   ", sizeof boot_sector.fs_type);
+    if (!set_meta_info(fs)) {
+        exit(1);
+    }
+}
+
+// Computes where the converter will put the block group metadata, when it
+// sizes the inode tables by default
+void init_metadata_clusters() {
+    uint64_t used_inodes = EXT4_FIRST_NON_RSV_INODE + options.file_count + dir_count - 1;
+    if (!init_ext4_sb(options.block_size, used_inodes < UINT32_MAX ? static_cast<uint32_t>(used_inodes) : UINT32_MAX,
+                      INODE_HEADROOM_DEFAULT)) {
+        exit(1);
+    }
+    clusters.metadata_count = block_group_count();
+    clusters.metadata = create_block_group_meta_extents(clusters.metadata_count);
+    if (!clusters.metadata) {
+        exit(1);
+    }
+    clusters.metadata_index = 0;
+    clusters.next = FAT_START_INDEX;
+    clusters.end = data_cluster_count();
+    clusters.used_count = 0;
+}
+
+// Applies the corruption to the first FAT, before it is copied to the others
+bool corrupt_fat() {
+    if (options.corruption == CORRUPT_NONE) {
+        return true;
+    }
+    uint32_t needed_targets = options.corruption == CORRUPT_CROSS_LINK ? 2 : 1;
+    if (corruption_target_count < needed_targets || clusters.next + 2 > clusters.end) {
+        fprintf(stderr, "The image has too few files of two clusters or more, or no free clusters to corrupt\n");
+        return false;
+    }
+    uint32_t first = corruption_targets[0][0], last = corruption_targets[0][1];
+    // Nothing is allocated from here on
+    uint32_t free_cluster = clusters.next;
+    switch (options.corruption) {
+        case CORRUPT_CROSS_LINK:
+            *fat_entry(corruption_targets[1][0]) = *fat_entry(first);
+            break;
+        case CORRUPT_LOOP:
+            *fat_entry(last) = first;
+            break;
+        case CORRUPT_FREE_LINK:
+            *fat_entry(last) = free_cluster;
+            break;
+        case CORRUPT_BAD_LINK:
+            *fat_entry(last) = free_cluster;
+            *fat_entry(free_cluster) = FAT_BAD_CLUSTER;
+            break;
+        case CORRUPT_SIZE:
+            *fat_entry(last) = free_cluster;
+            *fat_entry(free_cluster) = FAT_CHAIN_END;
+            break;
+        case CORRUPT_LOST:
+            *fat_entry(free_cluster) = free_cluster + 1;
+            *fat_entry(free_cluster + 1) = free_cluster;
+            break;
+        case CORRUPT_NONE:
+            break;
+    }
+    return true;
+}
+
+void finish_image(uint8_t *fs) {
+    // Boot sector, FS information sector and their backups
+    for (uint32_t sector = 0; sector <= boot_sector.backup_boot_sector_no; sector += boot_sector.backup_boot_sector_no) {
+        uint8_t *boot = fs + sector * options.sector_size;
+        memcpy(boot, &boot_sector, sizeof boot_sector);
+        boot[510] = 0x55;
+        boot[511] = 0xAA;
+
+        uint8_t *fs_info = boot + options.sector_size;
+        uint32_t fs_info_fields[][2] = {{0, 0x41615252}, {484, 0x61417272}, {488, clusters.end - FAT_START_INDEX - clusters.used_count},
+                                        {492, clusters.next}, {508, 0xAA550000}};
+        for (auto& field : fs_info_fields) {
+            memcpy(fs_info + field[0], &field[1], sizeof field[1]);
+        }
+    }
+
+    *fat_entry(0) = 0x0FFFFF00 | boot_sector.media_descriptor;
+    *fat_entry(1) = FAT_CHAIN_END;
+    uint64_t fat_size = static_cast<uint64_t>(boot_sector.sectors_per_fat) * options.sector_size;
+    for (uint32_t i = 1; i < FAT_COUNT; i++) {
+        memcpy(reinterpret_cast<uint8_t *>(meta_info.fat_start) + i * fat_size, meta_info.fat_start, fat_size);
+    }
+}
+
+// Writes a FAT file system to the whole partition
+bool write_image(Partition *partition, uint32_t hidden_sectors) {
+    init_boot_sector(partition->ptr);
+    boot_sector.hidden_sectors_before_partition = hidden_sectors;
+    if (data_cluster_count() - FAT_START_INDEX < dir_count) {
+        fprintf(stderr, "The image is too small for the files\n");
+        return false;
+    }
+    // Only for the ext4 geometry, which places the block group metadata
+    conversion_context ctx;
+    start_conversion_context(&ctx, 0);
+    init_metadata_clusters();
+
+    dir_first_clusters = static_cast<uint32_t *>(malloc(dir_count * sizeof(uint32_t)));
+    corruption_target_count = 0;
+    write_tree();
+    if (!corrupt_fat()) {
+        free(dir_first_clusters);
+        stop_conversion_context();
+        return false;
+    }
+    finish_image(partition->ptr);
+    printf("Wrote %llu files in %llu directories, using %u of %u clusters\n",
+           static_cast<unsigned long long>(options.file_count), static_cast<unsigned long long>(dir_count),
+           clusters.used_count, clusters.end - FAT_START_INDEX);
+
+    free(dir_first_clusters);
+    stop_conversion_context();
+    return true;
+}
+
+// Each partition follows a gap of the alignment, which holds the extended
+// boot record of a logical partition
+uint64_t partition_offset(uint32_t index) {
+    return PARTITION_ALIGNMENT + index * (options.image_size + PARTITION_ALIGNMENT);
+}
+
+void set_mbr_entry(uint8_t *sector, uint32_t index, uint8_t type, uint64_t first_lba, uint64_t sector_count) {
+    auto *entry = reinterpret_cast<mbr_entry *>(sector + MBR_ENTRY_OFFSET) + index;
+    // Only addressed by LBA
+    *entry = {0, {0xFE, 0xFF, 0xFF}, type, {0xFE, 0xFF, 0xFF}, static_cast<uint32_t>(first_lba),
+              static_cast<uint32_t>(sector_count)};
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+}
+
+// Puts the partitions beyond the fourth as logical ones into an extended
+// partition, with a chain of extended boot records
+void write_mbr(uint8_t *disk, uint64_t disk_size, uint32_t partition_count) {
+    uint64_t partition_sectors = options.image_size / MBR_SECTOR_SIZE;
+    uint32_t primary_count = partition_count > MBR_PRIMARY_COUNT ? MBR_PRIMARY_COUNT - 1 : partition_count;
+    for (uint32_t i = 0; i < primary_count; i++) {
+        set_mbr_entry(disk, i, MBR_TYPE_FAT32_LBA, partition_offset(i) / MBR_SECTOR_SIZE, partition_sectors);
+    }
+    if (primary_count == partition_count) {
+        return;
+    }
+
+    uint64_t extended_lba = (partition_offset(primary_count) - PARTITION_ALIGNMENT) / MBR_SECTOR_SIZE;
+    set_mbr_entry(disk, primary_count, MBR_TYPE_EXTENDED_LBA, extended_lba,
+                  (disk_size - PARTITION_ALIGNMENT) / MBR_SECTOR_SIZE - extended_lba);
+    for (uint32_t i = primary_count; i < partition_count; i++) {
+        uint64_t ebr_lba = (partition_offset(i) - PARTITION_ALIGNMENT) / MBR_SECTOR_SIZE;
+        uint8_t *ebr = disk + ebr_lba * MBR_SECTOR_SIZE;
+        set_mbr_entry(ebr, 0, MBR_TYPE_FAT32_LBA, PARTITION_ALIGNMENT / MBR_SECTOR_SIZE, partition_sectors);
+        if (i + 1 < partition_count) {
+            uint64_t next_lba = (partition_offset(i + 1) - PARTITION_ALIGNMENT) / MBR_SECTOR_SIZE;
+            set_mbr_entry(ebr, 1, MBR_TYPE_EXTENDED, next_lba - extended_lba,
+                          PARTITION_ALIGNMENT / MBR_SECTOR_SIZE + partition_sectors);
+        }
+    }
+}
+
+void derive_guid(uint64_t entity, uint8_t *guid) {
+    uint64_t halves[2] = {derive(entity, GUID_LOW), derive(entity, GUID_HIGH)};
+    memcpy(guid, halves, sizeof halves);
+    // Random GUIDs of variant 1, version 4
+    guid[7] = static_cast<uint8_t>((guid[7] & 0x0F) | 0x40);
+    guid[8] = static_cast<uint8_t>((guid[8] & 0x3F) | 0x80);
+}
+
+// Writes the primary GPT behind a protective MBR and the backup GPT at the end
+void write_gpt(uint8_t *disk, uint64_t disk_size, uint32_t partition_count) {
+    uint32_t sector_size = options.sector_size;
+    uint64_t last_lba = disk_size / sector_size - 1;
+    uint64_t entries_sectors = GPT_ENTRY_COUNT * GPT_ENTRY_SIZE / sector_size;
+    set_mbr_entry(disk, 0, MBR_TYPE_GPT_PROTECTIVE, 1, last_lba < UINT32_MAX ? last_lba : UINT32_MAX);
+
+    uint8_t *entries = disk + 2 * sector_size;
+    for (uint32_t i = 0; i < partition_count; i++) {
+        auto *entry = reinterpret_cast<gpt_entry *>(entries) + i;
+        memcpy(entry->type_guid, GPT_TYPE_BASIC_DATA, sizeof entry->type_guid);
+        derive_guid(i + 1, entry->unique_guid);
+        entry->first_lba = partition_offset(i) / sector_size;
+        entry->last_lba = entry->first_lba + options.image_size / sector_size - 1;
+    }
+    gpt_header header;
+    memset(&header, 0, sizeof header);
+    header.signature = GPT_SIGNATURE;
+    header.revision = 0x00010000;
+    header.header_size = GPT_HEADER_SIZE;
+    header.my_lba = 1;
+    header.alternate_lba = last_lba;
+    header.first_usable_lba = 2 + entries_sectors;
+    header.last_usable_lba = last_lba - entries_sectors - 1;
+    derive_guid(0, header.disk_guid);
+    header.entries_lba = 2;
+    header.entry_count = GPT_ENTRY_COUNT;
+    header.entry_size = GPT_ENTRY_SIZE;
+    update_gpt_checksums(&header, entries);
+    memcpy(disk + sector_size, &header, sizeof header);
+
+    uint8_t *backup_entries = disk + (last_lba - entries_sectors) * sector_size;
+    memcpy(backup_entries, entries, entries_sectors * sector_size);
+    header.my_lba = last_lba;
+    header.alternate_lba = 1;
+    header.entries_lba = last_lba - entries_sectors;
+    update_gpt_checksums(&header, backup_entries);
+    memcpy(disk + last_lba * sector_size, &header, sizeof header);
+}
+
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s -s|--size SIZE [-S|--sector-size BYTES] [-c|--cluster-size BYTES] [-n|--files COUNT] "
+                    "[-f|--fan-out COUNT] [-d|--depth DEPTH] [-l|--name-length MIN[-MAX]] [-z|--file-size MIN[-MAX]] "
+                    "[-F|--fragment CLUSTERS] [-i|--interleave FILES] [-m|--metadata-overlap PERCENT] "
+                    "[-b|--block-size BLOCK_SIZE] [-0|--zeros] [-x|--deleted COUNT] [-r|--seed SEED] "
+                    "[-t|--table mbr|gpt] [-p|--partitions COUNT] "
+                    "[-k|--corrupt cross-link|loop|free-link|bad-link|size|lost] IMAGE\n"
+                    "Sizes may have a K, M or G suffix. With a partition table, the size is that of each partition.\n"
+                    "--corrupt damages the FAT of the finished image, for testing that it is refused.\n",
+            program);
+}
+
+// Parses a number with an optional binary unit suffix
+bool parse_size(const char *text, uint64_t *value, const char **end) {
+    char *suffix;
+    *value = strtoull(text, &suffix, 10);
+    if (suffix == text) {
+        return false;
+    }
+    const char *units = "KMG";
+    const char *unit = *suffix ? strchr(units, *suffix) : NULL;
+    if (unit) {
+        *value <<= 10 * (unit - units + 1);
+        suffix++;
+    }
+    *end = suffix;
+    return true;
+}
+
+// Parses MIN or MIN-MAX
+bool parse_range(const char *text, uint64_t *min_value, uint64_t *max_value) {
+    const char *end;
+    if (!parse_size(text, min_value, &end)) {
+        return false;
+    }
+    *max_value = *min_value;
+    if (*end == '-' && !parse_size(end + 1, max_value, &end)) {
+        return false;
+    }
+    return !*end && *min_value <= *max_value;
+}
+
+bool parse_number(const char *text, uint64_t *value) {
+    const char *end;
+    return parse_size(text, value, &end) && !*end;
+}
+
+int main(int argc, char **argv) {
+    static const option long_options[] = {
+        {"size", required_argument, NULL, 's'},
+        {"sector-size", required_argument, NULL, 'S'},
+        {"cluster-size", required_argument, NULL, 'c'},
+        {"files", required_argument, NULL, 'n'},
+        {"fan-out", required_argument, NULL, 'f'},
+        {"depth", required_argument, NULL, 'd'},
+        {"name-length", required_argument, NULL, 'l'},
+        {"file-size", required_argument, NULL, 'z'},
+        {"fragment", required_argument, NULL, 'F'},
+        {"interleave", required_argument, NULL, 'i'},
+        {"metadata-overlap", required_argument, NULL, 'm'},
+        {"block-size", required_argument, NULL, 'b'},
+        {"zeros", no_argument, NULL, '0'},
+        {"deleted", required_argument, NULL, 'x'},
+        {"seed", required_argument, NULL, 'r'},
+        {"table", required_argument, NULL, 't'},
+        {"partitions", required_argument, NULL, 'p'},
+        {"corrupt", required_argument, NULL, 'k'},
+        {NULL, 0, NULL, 0}
+    };
+
+    options = {0, 512, 4096, 1000, 4, 2, 8, 40, 0, 64 * 1024, 0, 4, 100, 0, false, 0, 1, CORRUPT_NONE};
+    DiskTable table = TABLE_NONE;
+    uint32_t partition_count = 1;
+    uint64_t value, max_value;
+    bool is_valid = true;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:S:c:n:f:d:l:z:F:i:m:b:0x:r:t:p:k:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                is_valid &= parse_number(optarg, &options.image_size);
+                break;
+            case 'S':
+                is_valid &= parse_number(optarg, &value);
+                options.sector_size = static_cast<uint32_t>(value);
+                break;
+            case 'c':
+                is_valid &= parse_number(optarg, &value);
+                options.cluster_size = static_cast<uint32_t>(value);
+                break;
+            case 'n':
+                is_valid &= parse_number(optarg, &options.file_count);
+                break;
+            case 'f':
+                is_valid &= parse_number(optarg, &value);
+                options.fan_out = static_cast<uint32_t>(value);
+                break;
+            case 'd':
+                is_valid &= parse_number(optarg, &value);
+                options.depth = static_cast<uint32_t>(value);
+                break;
+            case 'l':
+                is_valid &= parse_range(optarg, &value, &max_value) && max_value <= EXT4_NAME_LEN;
+                options.min_name_length = static_cast<uint32_t>(value);
+                options.max_name_length = static_cast<uint32_t>(max_value);
+                break;
+            case 'z':
+                is_valid &= parse_range(optarg, &options.min_file_size, &options.max_file_size)
+                            && options.max_file_size <= UINT32_MAX;
+                break;
+            case 'F':
+                is_valid &= parse_number(optarg, &value);
+                options.fragment_clusters = static_cast<uint32_t>(value);
+                break;
+            case 'i':
+                is_valid &= parse_number(optarg, &value) && value > 0;
+                options.interleave = static_cast<uint32_t>(value);
+                break;
+            case 'm':
+                is_valid &= parse_number(optarg, &value) && value <= 100;
+                options.metadata_overlap = static_cast<uint32_t>(value);
+                break;
+            case 'b':
+                is_valid &= parse_number(optarg, &value);
+                options.block_size = static_cast<uint32_t>(value);
+                break;
+            case '0':
+                options.zero_content = true;
+                break;
+            case 'x':
+                is_valid &= parse_number(optarg, &value) && value <= UINT16_MAX;
+                options.deleted_entries = static_cast<uint32_t>(value);
+                break;
+            case 'r':
+                is_valid &= parse_number(optarg, &options.seed);
+                break;
+            case 't':
+                if (!strcmp(optarg, "mbr")) {
+                    table = TABLE_MBR;
+                } else if (!strcmp(optarg, "gpt")) {
+                    table = TABLE_GPT;
+                } else {
+                    is_valid = false;
+                }
+                break;
+            case 'p':
+                is_valid &= parse_number(optarg, &value) && value > 0 && value <= GPT_ENTRY_COUNT;
+                partition_count = static_cast<uint32_t>(value);
+                break;
+            case 'k':
+                options.corruption = CORRUPT_NONE;
+                for (uint32_t i = CORRUPT_CROSS_LINK; i <= CORRUPT_LOST; i++) {
+                    if (!strcmp(optarg, corruption_names[i])) {
+                        options.corruption = static_cast<Corruption>(i);
+                    }
+                }
+                is_valid &= options.corruption != CORRUPT_NONE;
+                break;
+            default:
+                is_valid = false;
+        }
+    }
+    // The converter needs clusters of at least 1k
+    uint32_t sectors_per_cluster = options.sector_size ? options.cluster_size / options.sector_size : 0;
+    if (!is_valid || optind != argc - 1 || options.sector_size < 512 || (options.sector_size & (options.sector_size - 1))
+        || options.cluster_size < 1024 || options.cluster_size % options.sector_size || sectors_per_cluster > 128
+        || (sectors_per_cluster & (sectors_per_cluster - 1)) || !options.image_size
+        || options.image_size / options.sector_size > UINT32_MAX || (partition_count > 1 && table == TABLE_NONE)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (table != TABLE_NONE) {
+        options.image_size = (options.image_size + PARTITION_ALIGNMENT - 1) & ~(PARTITION_ALIGNMENT - 1);
+    }
+
+    dir_count = 1;
+    for (uint64_t level = 0, level_size = 1; level < options.depth && options.fan_out; level++) {
+        level_size *= options.fan_out;
+        dir_count += level_size;
+        if (dir_count > MAX_DIR_COUNT) {
+            fprintf(stderr, "The directory tree has more than %llu directories\n",
+                    static_cast<unsigned long long>(MAX_DIR_COUNT));
+            return 1;
+        }
+    }
+
+    if (table == TABLE_NONE) {
+        Partition partition = {.path = argv[optind]};
+        if (!createPartition(&partition, options.image_size)) {
+            fprintf(stderr, "Failed to create image\n");
+            return 1;
+        }
+        bool is_written = write_image(&partition, 0);
+        closePartition(&partition);
+        return is_written ? 0 : 1;
+    }
+
+    // The space after the last partition holds the backup GPT
+    uint64_t disk_size = partition_offset(partition_count);
+    Partition disk = {.path = argv[optind]};
+    if (!createPartition(&disk, disk_size)) {
+        fprintf(stderr, "Failed to create image\n");
+        return 1;
+    }
+    if (table == TABLE_MBR) {
+        write_mbr(disk.ptr, disk_size, partition_count);
+    } else {
+        write_gpt(disk.ptr, disk_size, partition_count);
+    }
+    closePartition(&disk);
+
+    uint64_t seed = options.seed;
+    for (uint32_t i = 0; i < partition_count; i++) {
+        options.seed = seed + i;
+        Partition partition = {.path = argv[optind], .offset = partition_offset(i), .size = options.image_size};
+        if (!openPartition(&partition)) {
+            fprintf(stderr, "Failed to open partition %u\n", i + 1);
+            return 1;
+        }
+        bool is_written = write_image(&partition, static_cast<uint32_t>(partition.offset / options.sector_size));
+        closePartition(&partition);
+        if (!is_written) {
+            return 1;
+        }
+    }
+    return 0;
+}
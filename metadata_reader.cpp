@@ -1,44 +1,69 @@
+#include "ext4.h"
 #include "ext4_extent.h"
 #include "fat.h"
 #include "visualizer.h"
 #include "stream-archiver.h"
 #include "extent-allocator.h"
 #include "extent_iterator.h"
+#include "metadata_reader.h"
+#include "partition.h"
+#include "perf_counters.h"
+#include "util.h"
 
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-extern uint64_t pageSize;
+struct zero_detection_state {
+    SparseMode mode;
+    Partition* partition;
+    // Cached result of findDataRange(), [hole_begin, data_begin) is a hole
+    uint64_t hole_begin, data_begin, data_end;
+};
+__thread zero_detection_state zero_detection;
+
+void set_sparse_mode(SparseMode mode, Partition* partition) {
+    zero_detection = {mode, partition, 0, 0, 0};
+}
 
+bool is_zero_cluster(uint32_t cluster_no) {
+    uint8_t* cluster = cluster_start(cluster_no);
+    uint64_t begin = cluster - meta_info.fs_start,
+             end = begin + meta_info.cluster_size;
+    if(begin < zero_detection.hole_begin || end > zero_detection.data_end) {
+        zero_detection.hole_begin = begin;
+        findDataRange(zero_detection.partition, begin, &zero_detection.data_begin, &zero_detection.data_end);
+    }
+    // Holes in a sparse image don't need to be read at all
+    if(end <= zero_detection.data_begin)
+        return true;
+    return is_zeroed(cluster, meta_info.cluster_size);
+}
+
+// Directories are read an extent at a time, whose clusters are consecutive
 struct cluster_read_state {
     extent_iterator iterator;
-    uint32_t cluster_dentry;
-    fat_dentry *current_cluster;
+    dentry_scanner scanner;
 };
 
 cluster_read_state init_read_state(extent_iterator iterator) {
     cluster_read_state state;
-    uint32_t cluster_no = next_cluster_no(&iterator);
-    state.current_cluster = cluster_no ? reinterpret_cast<fat_dentry *>(cluster_start(cluster_no)) : NULL;
-    state.cluster_dentry = 0;
     state.iterator = iterator;
+    state.scanner = {NULL, NULL, 0, false};
     return state;
 }
 
+// Returns NULL at the end of the directory
 fat_dentry* next_dentry(cluster_read_state* state) {
-    fat_dentry* ret;
-    do {
-        if (state->cluster_dentry >= meta_info.dentries_per_cluster)
-            *state = init_read_state(state->iterator);
-
-        if (!state->current_cluster)
+    fat_dentry* dentry;
+    while(!(dentry = next_run_dentry(state->scanner))) {
+        uint32_t cluster_no, cluster_count;
+        if(state->scanner.is_dir_end || !(cluster_count = next_cluster_run(&state->iterator, cluster_no)))
             return NULL;
-
-        ret = state->current_cluster + state->cluster_dentry;
-        state->cluster_dentry++;
-    } while (is_invalid(ret) || is_dot_dir(ret));
-    return ret;
+        start_dentry_run(state->scanner, cluster_no, cluster_count);
+    }
+    return dentry;
 }
 
 void reserve_name(uint16_t* pointers[], int count, StreamArchiver* write_stream) {
@@ -66,17 +91,65 @@ uint32_t* reserve_children_count(StreamArchiver* write_stream) {
 }
 
 void resettle_extent(uint32_t cluster_no, bool is_dir_flag, StreamArchiver* write_stream, fat_extent& input_extent) {
+    // The data is moved as little as possible, and a fragment continues where the previous one ended
+    perf_begin(PERF_RESETTLE_EXTENT);
+    uint32_t goal = input_extent.physical_start;
     for(uint16_t i = 0; i < input_extent.length; ) {
-        fat_extent fragment = allocate_extent(input_extent.length - i);
+        fat_extent fragment = allocate_extent(input_extent.length - i, goal);
+        goal = fragment.physical_start + fragment.length;
         fragment.logical_start = input_extent.logical_start + i;
+        fragment.flags = input_extent.flags;
         *reserve_extent(write_stream) = fragment;
-        memcpy(cluster_start(fragment.physical_start), cluster_start(input_extent.physical_start + i), fragment.length * meta_info.cluster_size);
+        // The content of unwritten extents is never read
+        if (!(fragment.flags & FAT_EXTENT_UNWRITTEN)) {
+            copyMapped(cluster_start(fragment.physical_start), cluster_start(input_extent.physical_start + i),
+                       static_cast<uint64_t>(fragment.length) * meta_info.cluster_size);
+        }
         if (!is_dir_flag) {
-            visualizer_add_block_range({BlockRange::ResettledPayload, fat_cl_to_e4blk(fragment.physical_start), fragment.length, cluster_no});
+            visualizer_add_block_range({BlockRange::ResettledPayload, fat_cl_to_e4blk(fragment.physical_start), fragment.length * blocks_per_cluster(), cluster_no});
         }
 
         i += fragment.length;
     }
+    perf_end(PERF_RESETTLE_EXTENT);
+}
+
+void add_fragment(uint32_t cluster_no, bool is_dir_flag, bool is_blocked, StreamArchiver* write_stream, fat_extent& fragment) {
+    if(is_blocked)
+        resettle_extent(cluster_no, is_dir_flag, write_stream, fragment);
+    else
+        *reserve_extent(write_stream) = fragment;
+}
+
+void add_sparse_run(uint32_t cluster_no, bool is_blocked, StreamArchiver* write_stream, fat_extent& run, bool is_zero) {
+    if(!is_zero) {
+        add_fragment(cluster_no, false, is_blocked, write_stream, run);
+    } else if(zero_detection.mode == SPARSE_UNWRITTEN) {
+        run.flags = FAT_EXTENT_UNWRITTEN;
+        add_fragment(cluster_no, false, is_blocked, write_stream, run);
+    } else if(!is_blocked) {
+        // The run becomes a hole. Until the checkpoint, its clusters still
+        // belong to the FAT file, so they are only freed in the tree build.
+        run.flags = FAT_EXTENT_HOLE;
+        *reserve_extent(write_stream) = run;
+    }
+}
+
+// Splits a file's fragment into runs of clusters that do and don't contain only zeros
+void add_sparse_fragment(uint32_t cluster_no, bool is_blocked, StreamArchiver* write_stream, const fat_extent& fragment) {
+    uint16_t max_zero_run_length = max_fat_unwritten_extent_length();
+    fat_extent run = {fragment.logical_start, 0, fragment.physical_start, 0};
+    bool run_is_zero = false;
+    for(uint16_t i = 0; i <= fragment.length; ++i) {
+        bool is_end = i == fragment.length,
+             is_zero = !is_end && is_zero_cluster(fragment.physical_start + i);
+        if(run.length && (is_end || is_zero != run_is_zero || (is_zero && run.length == max_zero_run_length))) {
+            add_sparse_run(cluster_no, is_blocked, write_stream, run, run_is_zero);
+            run = {fragment.logical_start + i, 0, fragment.physical_start + i, 0};
+        }
+        run_is_zero = is_zero;
+        ++run.length;
+    }
 }
 
 void find_blocked_extent_fragments(uint32_t cluster_no, bool is_dir_flag, StreamArchiver* write_stream, const fat_extent& input_extent) {
@@ -96,31 +169,32 @@ void find_blocked_extent_fragments(uint32_t cluster_no, bool is_dir_flag, Stream
             fragment_physical_end = blocked_extent->physical_start;
 
         fat_extent fragment;
+        fragment.flags = 0;
         fragment.physical_start = fragment_physical_start;
         fragment.length = fragment_physical_end - fragment.physical_start;
         fragment.logical_start = input_extent.logical_start + (fragment.physical_start - input_extent.physical_start);
         fragment_physical_start = fragment_physical_end;
         if (!is_dir_flag) {
-            visualizer_add_block_range({BlockRange::OriginalPayload, fat_cl_to_e4blk(fragment.physical_start), fragment.length, cluster_no});
+            visualizer_add_block_range({BlockRange::OriginalPayload, fat_cl_to_e4blk(fragment.physical_start), fragment.length * blocks_per_cluster(), cluster_no});
         }
 
-        if(is_blocked)
-            resettle_extent(cluster_no, is_dir_flag, write_stream, fragment);
+        if(!is_dir_flag && zero_detection.mode != SPARSE_NONE)
+            add_sparse_fragment(cluster_no, is_blocked, write_stream, fragment);
         else
-            *reserve_extent(write_stream) = fragment;
+            add_fragment(cluster_no, is_dir_flag, is_blocked, write_stream, fragment);
     }
 }
 
 void aggregate_extents(uint32_t cluster_no, bool is_dir_flag, StreamArchiver* write_stream) {
     if(!is_dir_flag)
         visualizer_add_tag(cluster_no);
-    fat_extent current_extent {0, 1, cluster_no};
+    fat_extent current_extent {0, 1, cluster_no, 0};
     uint32_t next_cluster_no = *fat_entry(cluster_no);
 
     while(cluster_no) {  // if cluster_no == 0, it's a zero-length file
         bool is_end = next_cluster_no >= FAT_END_OF_CHAIN,
              is_consecutive = next_cluster_no == current_extent.physical_start + current_extent.length,
-             has_max_length = current_extent.length == EXT4_MAX_INIT_EXTENT_LEN;
+             has_max_length = current_extent.length == max_fat_extent_length();
         if(is_end || !is_consecutive || has_max_length) {
             find_blocked_extent_fragments(cluster_no, is_dir_flag, write_stream, current_extent);
             current_extent.logical_start += current_extent.length;
@@ -135,52 +209,93 @@ void aggregate_extents(uint32_t cluster_no, bool is_dir_flag, StreamArchiver* wr
     cutStreamArchiver(write_stream);
 }
 
-fat_dentry* read_lfn(fat_dentry* first_entry, StreamArchiver* extent_stream, uint16_t* name[], int lfn_entry_count, struct cluster_read_state* state) {
-    uint8_t* entry = reinterpret_cast<uint8_t*>(first_entry);
-    for (int i = lfn_entry_count - 1; i >= 0; i--) {
-        lfn_cpy(name[i], entry);
-        entry = reinterpret_cast<uint8_t*>(next_dentry(state));
+// Returns the dentry that the long name belongs to, or NULL if the directory
+// ends before it
+fat_dentry* read_lfn(fat_dentry* first_entry, uint16_t name[], int lfn_entry_count, struct cluster_read_state* state) {
+    fat_dentry* entry = first_entry;
+    for (int i = lfn_entry_count - 1; i >= 0 && entry; i--) {
+        lfn_cpy(name + i * LFN_ENTRY_LENGTH, reinterpret_cast<uint8_t*>(entry));
+        entry = next_dentry(state);
     }
-    return reinterpret_cast<fat_dentry*>(entry);
+    return entry;
+}
+
+// A directory whose entries are being read. The directories from the root to
+// the current one form an explicit stack, so that the memory needed is
+// proportional to the tree's depth and no call stack can overflow.
+struct traverse_frame {
+    StreamArchiver extent_stream;  // The directory's extents, read by state's iterator
+    cluster_read_state state;
+    uint32_t* children_count;
+};
+
+struct traverse_stack {
+    traverse_frame* frames;
+    uint32_t size, capacity;
+};
+
+traverse_frame* push_frame(traverse_stack* stack, const StreamArchiver* dir_extent_stream, StreamArchiver* write_stream) {
+    if(stack->size == stack->capacity) {
+        stack->capacity = stack->capacity ? 2 * stack->capacity : 64;
+        stack->frames = static_cast<traverse_frame*>(context_realloc(stack->frames, stack->capacity * sizeof(traverse_frame)));
+        // The iterators point into the frames, which may have moved
+        for(uint32_t i = 0; i < stack->size; ++i)
+            stack->frames[i].state.iterator.extent_stream = &stack->frames[i].extent_stream;
+    }
+    traverse_frame* frame = &stack->frames[stack->size++];
+    frame->extent_stream = *dir_extent_stream;
+    frame->children_count = reserve_children_count(write_stream);
+    *frame->children_count = 0;
+    frame->state = init_read_state(init(&frame->extent_stream));
+    return frame;
 }
 
 void traverse(StreamArchiver* dir_extent_stream, StreamArchiver* write_stream) {
-    uint32_t* children_count = reserve_children_count(write_stream);
-    *children_count = 0;
-    cluster_read_state state = init_read_state(init(dir_extent_stream));
-    fat_dentry* current_dentry = next_dentry(&state);
+    traverse_stack stack = {NULL, 0, 0};
+    push_frame(&stack, dir_extent_stream, write_stream);
 
-    while (!is_dir_table_end(current_dentry)) {
-        fat_dentry* dentry = reserve_dentry(write_stream);
+    while(stack.size) {
+        traverse_frame* frame = &stack.frames[stack.size - 1];
+        fat_dentry* current_dentry = next_dentry(&frame->state);
+        // The long name is read before anything is written, the directory
+        // may end before its dentry
+        bool has_long_name = current_dentry && is_lfn(current_dentry);
+        uint16_t long_name[MAX_LFN_ENTRIES * LFN_ENTRY_LENGTH];
+        int name_entry_count = 1;
+        if (has_long_name) {
+            name_entry_count = lfn_entry_sequence_no(current_dentry);
+            current_dentry = read_lfn(current_dentry, long_name, name_entry_count, &frame->state);
+        }
+        if(!current_dentry) {
+            --stack.size;
+            continue;
+        }
 
-        bool has_long_name = is_lfn(current_dentry);
+        fat_dentry* dentry = reserve_dentry(write_stream);
+        uint16_t* name[MAX_LFN_ENTRIES];
+        reserve_name(name, name_entry_count, write_stream);
         if (has_long_name) {
-            int lfn_entry_count = lfn_entry_sequence_no(current_dentry);
-            uint16_t* name[lfn_entry_count];
-            reserve_name(name, lfn_entry_count, write_stream);
-            current_dentry = read_lfn(current_dentry, dir_extent_stream, name, lfn_entry_count, &state);
+            for (int i = 0; i < name_entry_count; i++)
+                memcpy(name[i], long_name + i * LFN_ENTRY_LENGTH, LFN_ENTRY_LENGTH * sizeof(uint16_t));
         } else {
-            uint16_t* name[1];
-            reserve_name(name, 1, write_stream);
             read_short_name(current_dentry, name[0]);
         }
 
         // current_dentry is the actual dentry now
         memcpy(dentry, current_dentry, sizeof *current_dentry);
+        (*frame->children_count)++;
 
         uint32_t cluster_no = file_cluster_no(current_dentry);
         StreamArchiver read_extent_stream = *write_stream;
         bool is_dir_flag = is_dir(current_dentry);
         aggregate_extents(cluster_no, is_dir_flag, write_stream);
         if (is_dir_flag) {
-            traverse(&read_extent_stream, write_stream);
+            push_frame(&stack, &read_extent_stream, write_stream);
         } else {
             *reserve_children_count(write_stream) = -1;
         }
-
-        (*children_count)++;
-        current_dentry = next_dentry(&state);
     }
+    context_free(stack.frames);
 }
 
 void init_stream_archiver(StreamArchiver* stream, uint32_t clusterSize) {
@@ -1,7 +1,22 @@
+#ifndef OFS_CONVERT_METADATA_READER_H
+#define OFS_CONVERT_METADATA_READER_H
+
 #include <stdint.h>
 
+struct Partition;
 struct StreamArchiver;
 
+// How clusters of regular files that contain only zeros are converted
+enum SparseMode {
+    SPARSE_NONE,  // Like any other cluster
+    SPARSE_HOLES,  // Not at all, they become holes and are freed
+    SPARSE_UNWRITTEN  // As unwritten extents, which keeps them allocated
+};
+
+void set_sparse_mode(SparseMode mode, Partition* partition);
+
 void init_stream_archiver(StreamArchiver* stream, uint32_t clusterSize);
 void aggregate_extents(uint32_t cluster_no, bool is_dir_flag, StreamArchiver* write_stream);
 void traverse(StreamArchiver* dir_extent_stream, StreamArchiver* write_stream);
+
+#endif //OFS_CONVERT_METADATA_READER_H
@@ -1,48 +1,179 @@
-#include "ext4.h"
-#include "ext4_bg.h"
-#include "extent-allocator.h"
+#include "conversion.h"
+#include "ext4_journal.h"
 #include "metadata_reader.h"
-#include "partition.h"
-#include "visualizer.h"
-#include "stream-archiver.h"
-#include "tree_builder.h"
+#include "partition_table.h"
 
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
-int main(int argc, const char** argv) {
-    if (argc < 2) {
-        printf("Wrong usage\n");
-        exit(1);
-    }
-    Partition partition = {.path = argv[1]};
-    if (!openPartition(&partition)) {
-        fprintf(stderr, "Failed to open partition");
-        return 1;
-    }
-
-    read_boot_sector(partition.ptr);
-    set_meta_info(partition.ptr);
-
-    init_ext4_sb();
-    int bg_count = block_group_count();
-    init_extent_allocator(create_block_group_meta_extents(bg_count), bg_count);
-
-    StreamArchiver write_stream;
-    init_stream_archiver(&write_stream, meta_info.cluster_size);
-    StreamArchiver extent_stream = write_stream;
-    StreamArchiver read_stream = write_stream;
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-b|--block-size BLOCK_SIZE] [-j|--journal-size SIZE_MB] [-s|--sparse holes|unwritten] [-d|--discard] [-v|--verify] [-c|--check] [-C|--check-phases] [-w|--dirty-limit SIZE_MB] [-L|--optimize-layout] [-i|--inode-headroom PERCENT] [-P|--perf] [-u|--undo UNDO_FILE] [-m|--memory-limit SIZE_MB] [-J|--jobs JOBS] PARTITION|DISK...\n", program);
+    fprintf(stderr, "--check also checks partitions that were converted before.\n");
+    fprintf(stderr, "--memory-limit bounds the heap memory of each partition's conversion.\n");
+}
 
-    aggregate_extents(boot_sector.root_cluster_no, true, &write_stream);
-    traverse(&extent_stream, &write_stream);
+int main(int argc, char** argv) {
+    static const option long_options[] = {
+        {"block-size", required_argument, NULL, 'b'},
+        {"journal-size", required_argument, NULL, 'j'},
+        {"sparse", required_argument, NULL, 's'},
+        {"discard", no_argument, NULL, 'd'},
+        {"verify", no_argument, NULL, 'v'},
+        {"check", no_argument, NULL, 'c'},
+        {"check-phases", no_argument, NULL, 'C'},
+        {"dirty-limit", required_argument, NULL, 'w'},
+        {"optimize-layout", no_argument, NULL, 'L'},
+        {"inode-headroom", required_argument, NULL, 'i'},
+        {"perf", no_argument, NULL, 'P'},
+        {"undo", required_argument, NULL, 'u'},
+        {"memory-limit", required_argument, NULL, 'm'},
+        {"jobs", required_argument, NULL, 'J'},
+        {NULL, 0, NULL, 0}
+    };
 
+    conversion_options options = default_conversion_options();
+    uint32_t jobs = 0;  // One thread for each CPU
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:j:s:dvcCw:Li:Pu:m:J:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                options.requested_block_size = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+                if (!options.requested_block_size) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'j': {
+                char *end;
+                options.journal_size_mb = strtoll(optarg, &end, 10);
+                if (*end || options.journal_size_mb < 0) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 's':
+                if (!strcmp(optarg, "holes")) {
+                    options.sparse_mode = SPARSE_HOLES;
+                } else if (!strcmp(optarg, "unwritten")) {
+                    options.sparse_mode = SPARSE_UNWRITTEN;
+                } else {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                options.discard = true;
+                break;
+            case 'v':
+                options.verify = true;
+                break;
+            case 'c':
+                options.check_mode = CHECK_RESULT;
+                break;
+            case 'C':
+                options.check_mode = CHECK_EACH_PHASE;
+                break;
+            case 'w': {
+                // 0 leaves the writeback to the kernel
+                char *end;
+                options.dirty_limit_mb = static_cast<uint32_t>(strtoul(optarg, &end, 10));
+                if (*end) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'L':
+                options.optimize_layout = true;
+                break;
+            case 'i': {
+                char *end;
+                long percent = strtol(optarg, &end, 10);
+                if (*end || percent < 0 || percent > INT32_MAX / 100) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                options.inode_headroom_percent = static_cast<int32_t>(percent);
+                break;
+            }
+            case 'P':
+                options.perf = true;
+                break;
+            case 'u':
+                options.undo_path = optarg;
+                break;
+            case 'm': {
+                // 0 lifts the limit
+                char *end;
+                options.memory_limit_mb = static_cast<uint32_t>(strtoul(optarg, &end, 10));
+                if (*end) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            }
+            case 'J':
+                jobs = static_cast<uint32_t>(strtoul(optarg, NULL, 10));
+                if (!jobs) {
+                    print_usage(argv[0]);
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+    uint32_t path_count = static_cast<uint32_t>(argc - optind);
+    if (!path_count) {
+        print_usage(argv[0]);
+        exit(1);
+    }
 
-    init_ext4_group_descs();
-    build_ext4_root();
-    build_ext4_metadata_tree(EXT4_ROOT_INODE, EXT4_ROOT_INODE, &read_stream);
-    build_lost_found();
-    finalize_block_groups_on_disk();
+    // Disks with a partition table stand for their FAT32 partitions
+    auto *locations = static_cast<partition_location *>(malloc(path_count * MAX_DISK_PARTITIONS
+                                                               * sizeof(partition_location)));
+    uint32_t partition_count = 0;
+    for (uint32_t i = 0; i < path_count; i++) {
+        if (!find_fat_partitions(argv[optind + i], locations, partition_count)) {
+            exit(1);
+        }
+    }
+    if (!partition_count) {
+        fprintf(stderr, "Found no FAT32 partition to convert\n");
+        exit(1);
+    }
+    // A single undo file can only take a single partition
+    if (options.undo_path && partition_count > 1) {
+        fprintf(stderr, "An undo file only takes a single partition, not %u\n", partition_count);
+        exit(1);
+    }
 
-    closePartition(&partition);
-    visualizer_render_to_file("partition.svg", partition.fileStat.st_size / meta_info.cluster_size);
+    bool is_successful;
+    auto *stats = static_cast<conversion_stats *>(malloc(partition_count * sizeof(conversion_stats)));
+    if (!jobs) {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpu_count > 0 ? static_cast<uint32_t>(cpu_count) : 1;
+    }
+    if (partition_count > 1) {
+        // Never more threads than partitions, whether of images or of disks
+        is_successful = convert_partitions(locations, partition_count, jobs, options, stats);
+    } else {
+        is_successful = convert_partition(locations[0], options, stats);
+    }
+    // Only once all are done, a partition that is still FAT keeps its type
+    uint32_t ext4_count = 0;
+    for (uint32_t i = 0; i < partition_count; i++) {
+        if (stats[i].is_ext4) {
+            locations[ext4_count++] = locations[i];
+        }
+    }
+    is_successful = mark_ext4_partitions(locations, ext4_count) && is_successful;
+    free(stats);
+    free(locations);
+    return is_successful ? 0 : 1;
 }
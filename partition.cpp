@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -9,6 +10,20 @@
 
 #include "partition.h"
 
+// Writes are noted and started in batches of at most this size, so that a
+// single large write cannot overshoot the dirty limit by much
+constexpr uint64_t WRITEBACK_BATCH_SIZE = 4 << 20;
+
+struct Writeback {
+    Partition* partition;
+    uint64_t dirtyLimit, dirtyBytes;
+    // Noted since the last flush, and under writeback since then
+    uint64_t dirtyBegin, dirtyEnd, flushBegin, flushEnd;
+};
+__thread Writeback writeback;
+// Synced before any write to the partition is, -1 for none
+__thread int writeDependency = -1;
+
 #ifdef __APPLE__
 #define MMAP_FUNC mmap
 #include <sys/disk.h>
@@ -18,6 +33,17 @@
 #include <linux/fs.h>
 #endif
 
+uint64_t pageMask() {
+    return sysconf(_SC_PAGESIZE) - 1;
+}
+
+// Start and length of the pages that contain a range of the mapping
+void pageRange(Partition* partition, uint64_t offset, uint64_t length, uint8_t** begin, uint64_t* pagesLength) {
+    uint8_t* address = partition->ptr + offset;
+    *begin = reinterpret_cast<uint8_t*>(reinterpret_cast<uintptr_t>(address) & ~pageMask());
+    *pagesLength = address + length - *begin;
+}
+
 bool openPartition(Partition* partition) {
     if(strcmp(partition->path, "/dev/zero") == 0) {
         partition->mmapFlags |= MAP_PRIVATE|MAP_ANON;
@@ -55,17 +81,212 @@ bool openPartition(Partition* partition) {
         }
     }
 
-    partition->ptr = reinterpret_cast<uint8_t*>(MMAP_FUNC(0, partition->fileStat.st_size, PROT_READ|PROT_WRITE, partition->mmapFlags, partition->file, 0));
-    if(partition->ptr == MAP_FAILED) {
+    uint64_t deviceSize = partition->fileStat.st_size;
+    if(!partition->size && partition->offset <= deviceSize)
+        partition->size = deviceSize - partition->offset;
+    if(partition->offset > deviceSize || partition->size > deviceSize - partition->offset) {
+        fprintf(stderr, "%s is too small for the partition\n", partition->path);
+        return false;
+    }
+
+    // Partitions only need to be aligned to sectors, the mapping to pages
+    uint64_t lead = partition->offset & pageMask();
+    uint8_t* map = reinterpret_cast<uint8_t*>(MMAP_FUNC(0, partition->size + lead, PROT_READ|PROT_WRITE, partition->mmapFlags, partition->file, partition->offset - lead));
+    if(map == MAP_FAILED) {
         perror("mmap");
         return false;
     }
+    partition->ptr = map + lead;
+
+    return true;
+}
 
+// Opens a partition that is written from scratch. A regular file is emptied
+// and sized, a device has to be large enough already.
+bool createPartition(Partition* partition, uint64_t size) {
+    if(strcmp(partition->path, "/dev/zero") != 0) {
+        int file = open(partition->path, O_RDWR|O_CREAT, 0666);
+        struct stat fileStat;
+        if(file < 0 || fstat(file, &fileStat)) {
+            perror("open");
+            return false;
+        }
+        if(S_ISREG(fileStat.st_mode) && (ftruncate(file, 0) || ftruncate(file, size))) {
+            perror("ftruncate");
+            close(file);
+            return false;
+        }
+        close(file);
+    }
+    partition->size = size;
+    return openPartition(partition);
+}
+
+bool isPartitionFile(Partition* partition, const char* path) {
+    struct stat fileStat;
+    if(partition->file < 0 || stat(path, &fileStat))
+        return false;
+    if(S_ISBLK(fileStat.st_mode) && S_ISBLK(partition->fileStat.st_mode))
+        return fileStat.st_rdev == partition->fileStat.st_rdev;
+    return fileStat.st_dev == partition->fileStat.st_dev && fileStat.st_ino == partition->fileStat.st_ino;
+}
+
+void setWriteDependency(int file) {
+    writeDependency = file;
+}
+
+bool syncWriteDependency() {
+    if(writeDependency >= 0 && fsync(writeDependency)) {
+        perror("fsync");
+        return false;
+    }
+    return true;
+}
+
+// Blocks until everything written to the given range is on disk
+bool syncPartitionRange(Partition* partition, uint64_t offset, uint64_t length) {
+    if(partition->file < 0)
+        return true;
+    if(!syncWriteDependency())
+        return false;
+    uint8_t* begin;
+    uint64_t pagesLength;
+    pageRange(partition, offset, length, &begin, &pagesLength);
+    if(msync(begin, pagesLength, MS_SYNC)) {
+        perror("msync");
+        return false;
+    }
     return true;
 }
 
+bool syncPartition(Partition* partition) {
+    return syncPartitionRange(partition, 0, partition->size);
+}
+
+// Tells the storage that the range is unused: block devices get a discard,
+// image files a hole. The range has to be on disk already, the pages mapped
+// from it are dropped.
+bool discardPartitionRange(Partition* partition, uint64_t offset, uint64_t length) {
+    if(partition->file < 0)
+        return true;
+    if(!syncWriteDependency())
+        return false;
+    #ifdef __APPLE__
+    errno = ENOTSUP;
+    return false;
+    #else
+    if(S_ISBLK(partition->fileStat.st_mode)) {
+        uint64_t range[2] = {partition->offset + offset, length};
+        return !ioctl(partition->file, BLKDISCARD, &range);
+    }
+    return !fallocate(partition->file, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, partition->offset + offset, length);
+    #endif
+}
+
+// Finds the first range at or after offset that is not a hole in a sparse
+// image file. Everything that cannot have holes is a single data range.
+void findDataRange(Partition* partition, uint64_t offset, uint64_t* dataBegin, uint64_t* dataEnd) {
+    *dataBegin = offset;
+    *dataEnd = partition->size;
+    #ifdef SEEK_DATA
+    if(partition->file < 0 || !S_ISREG(partition->fileStat.st_mode))
+        return;
+    off_t begin = lseek(partition->file, partition->offset + offset, SEEK_DATA);
+    if(begin < 0 || static_cast<uint64_t>(begin) - partition->offset >= partition->size) {
+        if(begin >= 0 || errno == ENXIO)  // only a hole remains
+            *dataBegin = partition->size;
+        return;
+    }
+    off_t end = lseek(partition->file, begin, SEEK_HOLE);
+    *dataBegin = begin - partition->offset;
+    if(end >= 0 && static_cast<uint64_t>(end) - partition->offset < partition->size)
+        *dataEnd = end - partition->offset;
+    #endif
+}
+
+// Starts the writeback of a range, or waits until it is done
+void writebackRange(Partition* partition, uint64_t offset, uint64_t length, bool wait) {
+    if(!syncWriteDependency())
+        return;
+    #ifdef SYNC_FILE_RANGE_WRITE
+    // msync(MS_ASYNC) does nothing on Linux
+    unsigned int flags = wait ? SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER
+                              : SYNC_FILE_RANGE_WRITE;
+    if(sync_file_range(partition->file, partition->offset + offset, length, flags))
+        perror("sync_file_range");
+    #else
+    uint8_t* begin;
+    uint64_t pagesLength;
+    pageRange(partition, offset, length, &begin, &pagesLength);
+    if(msync(begin, pagesLength, wait ? MS_SYNC : MS_ASYNC))
+        perror("msync");
+    #endif
+}
+
+void startBoundedWriteback(Partition* partition, uint64_t dirtyLimit) {
+    writeback = {partition->file < 0 ? NULL : partition, dirtyLimit, 0, 0, 0, 0, 0};
+}
+
+void flushNotedWrites() {
+    // Waiting for the previous batch throttles the conversion to the disk
+    if(writeback.flushEnd > writeback.flushBegin)
+        writebackRange(writeback.partition, writeback.flushBegin, writeback.flushEnd - writeback.flushBegin, true);
+    writebackRange(writeback.partition, writeback.dirtyBegin, writeback.dirtyEnd - writeback.dirtyBegin, false);
+    writeback.flushBegin = writeback.dirtyBegin;
+    writeback.flushEnd = writeback.dirtyEnd;
+    writeback.dirtyBytes = 0;
+}
+
+void noteWrite(uint64_t offset, uint64_t length) {
+    if(!writeback.partition || !writeback.dirtyLimit || !length)
+        return;
+    if(writeback.dirtyBytes) {
+        writeback.dirtyBegin = offset < writeback.dirtyBegin ? offset : writeback.dirtyBegin;
+        writeback.dirtyEnd = offset + length > writeback.dirtyEnd ? offset + length : writeback.dirtyEnd;
+    } else {
+        writeback.dirtyBegin = offset;
+        writeback.dirtyEnd = offset + length;
+    }
+    writeback.dirtyBytes += length;
+    if(writeback.dirtyBytes >= writeback.dirtyLimit)
+        flushNotedWrites();
+}
+
+void noteMappedWrite(const void* address, uint64_t length) {
+    if(writeback.partition)
+        noteWrite(static_cast<const uint8_t*>(address) - writeback.partition->ptr, length);
+}
+
+void copyMapped(void* dest, const void* src, uint64_t length) {
+    for(uint64_t offset = 0; offset < length; offset += WRITEBACK_BATCH_SIZE) {
+        uint64_t batch = length - offset < WRITEBACK_BATCH_SIZE ? length - offset : WRITEBACK_BATCH_SIZE;
+        memcpy(static_cast<uint8_t*>(dest) + offset, static_cast<const uint8_t*>(src) + offset, batch);
+        noteMappedWrite(static_cast<uint8_t*>(dest) + offset, batch);
+    }
+}
+
+void zeroMapped(void* dest, uint64_t length) {
+    for(uint64_t offset = 0; offset < length; offset += WRITEBACK_BATCH_SIZE) {
+        uint64_t batch = length - offset < WRITEBACK_BATCH_SIZE ? length - offset : WRITEBACK_BATCH_SIZE;
+        memset(static_cast<uint8_t*>(dest) + offset, 0, batch);
+        noteMappedWrite(static_cast<uint8_t*>(dest) + offset, batch);
+    }
+}
+
+void flushMappedWrites() {
+    if(!writeback.partition || !writeback.dirtyLimit)
+        return;
+    // Unnoted writes can be anywhere
+    writeback.dirtyBegin = 0;
+    writeback.dirtyEnd = writeback.partition->size;
+    flushNotedWrites();
+}
+
 void closePartition(Partition* partition) {
-    if (munmap(partition->ptr, partition->fileStat.st_size)) {
+    if(writeback.partition == partition)
+        writeback.partition = NULL;
+    uint64_t lead = partition->offset & pageMask();
+    if (munmap(partition->ptr - lead, partition->size + lead)) {
         perror("munmap");
     }
 
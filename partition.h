@@ -6,6 +6,9 @@
 
 struct Partition {
     const char* path;
+    // Byte range of the partition in the file or device. A size of 0 extends
+    // it to the end, openPartition() fills in the actual size.
+    uint64_t offset, size;
     int mmapFlags, file;
     struct stat fileStat;
     uint8_t* ptr;
@@ -13,5 +16,31 @@ struct Partition {
 
 void closePartition(Partition* partition);
 bool openPartition(Partition* partition);
+bool createPartition(Partition* partition, uint64_t size);
+// Whether path names the file or device of the partition. Block devices are
+// compared by their device number, as the same one can have several nodes.
+bool isPartitionFile(Partition* partition, const char* path);
+bool syncPartition(Partition* partition);
+bool syncPartitionRange(Partition* partition, uint64_t offset, uint64_t length);
+bool discardPartitionRange(Partition* partition, uint64_t offset, uint64_t length);
+void findDataRange(Partition* partition, uint64_t offset, uint64_t* dataBegin, uint64_t* dataEnd);
+// Has every sync, writeback and discard of the calling thread's partition
+// fsync() file first, so that file is on disk before the writes that depend on
+// it, like the undo file. -1 ends this.
+void setWriteDependency(int file);
+
+// Bounded writeback of the calling thread's partition. Instead of leaving the
+// writes through the mapping dirty until they are synced, their writeback is
+// started every dirtyLimit bytes, after waiting for the previous batch. This
+// keeps the dirty memory at about twice the limit. A limit of 0 leaves the
+// writeback to the kernel. Ends when the partition is closed.
+void startBoundedWriteback(Partition* partition, uint64_t dirtyLimit);
+void noteMappedWrite(const void* address, uint64_t length);
+// memcpy() and zeroing into the mapping, in batches of bounded writeback
+void copyMapped(void* dest, const void* src, uint64_t length);
+void zeroMapped(void* dest, uint64_t length);
+// Starts the writeback of everything written so far, noted or not, for
+// example at the end of a phase
+void flushMappedWrites();
 
 #endif //OFS_CONVERT_PARTITION_H
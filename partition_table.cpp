@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifndef __APPLE__
+#include <linux/fs.h>
+#endif
+
+#include "checkpoint.h"
+#include "fat.h"
+#include "partition_table.h"
+
+const uint8_t GPT_TYPE_BASIC_DATA[16] = {0xA2, 0xA0, 0xD0, 0xEB, 0xE5, 0xB9, 0x33, 0x44,
+                                         0x87, 0xC0, 0x68, 0xB6, 0xB7, 0x26, 0x99, 0xC7};
+const uint8_t GPT_TYPE_LINUX_DATA[16] = {0xAF, 0x3D, 0xC6, 0x0F, 0x83, 0x84, 0x72, 0x47,
+                                         0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4};
+
+constexpr uint32_t MIN_SECTOR_SIZE = 512;
+constexpr uint32_t MAX_SECTOR_SIZE = 4096;
+constexpr uint16_t MBR_SIGNATURE = 0xAA55;
+constexpr uint32_t MBR_SIGNATURE_OFFSET = 510;
+constexpr uint32_t FIRST_LOGICAL_NUMBER = 5;
+// Tables with more entries are taken as damaged
+constexpr uint64_t MAX_GPT_ENTRIES_SIZE = 1 << 20;
+
+// A partition of an MBR, primary or logical
+struct mbr_partition {
+    uint64_t entry_offset;  // Of its entry in the MBR or in an extended boot record
+    uint64_t first_lba, sector_count;
+    uint8_t type;
+    uint32_t number;
+};
+
+
+uint32_t crc32(uint32_t crc, const void *data, uint64_t length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    crc = ~crc;
+    for (uint64_t i = 0; i < length; i++) {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? crc >> 1 ^ 0xEDB88320 : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+
+void update_gpt_checksums(gpt_header *header, const uint8_t *entries) {
+    header->entries_crc = crc32(0, entries, static_cast<uint64_t>(header->entry_count) * header->entry_size);
+    header->header_crc = 0;
+    header->header_crc = crc32(0, header, header->header_size);
+}
+
+
+bool read_fully(int file, void *data, uint64_t length, uint64_t offset) {
+    ssize_t result = pread(file, data, length, offset);
+    return result >= 0 && static_cast<uint64_t>(result) == length;
+}
+
+
+bool write_fully(int file, const void *data, uint64_t length, uint64_t offset) {
+    ssize_t result = pwrite(file, data, length, offset);
+    return result >= 0 && static_cast<uint64_t>(result) == length;
+}
+
+
+bool is_extended_type(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+
+// Also the hidden variants
+bool is_fat32_type(uint8_t type) {
+    return (type & ~0x10) == MBR_TYPE_FAT32 || (type & ~0x10) == MBR_TYPE_FAT32_LBA;
+}
+
+
+// Reads the header of a GPT and its entries into a buffer the caller has to
+// free. Returns false if either is damaged.
+bool read_gpt(int file, uint32_t sector_size, uint64_t lba, gpt_header *header, uint8_t **entries) {
+    uint8_t sector[MAX_SECTOR_SIZE];
+    if (!read_fully(file, sector, sector_size, lba * sector_size)) {
+        return false;
+    }
+    memcpy(header, sector, sizeof *header);
+    if (header->signature != GPT_SIGNATURE || header->header_size < GPT_HEADER_SIZE
+        || header->header_size > sector_size || header->my_lba != lba) {
+        return false;
+    }
+    uint32_t header_crc = header->header_crc;
+    reinterpret_cast<gpt_header *>(sector)->header_crc = 0;
+    uint64_t entries_size = static_cast<uint64_t>(header->entry_count) * header->entry_size;
+    if (crc32(0, sector, header->header_size) != header_crc || header->entry_size < GPT_ENTRY_SIZE
+        || header->entry_size % 8 || entries_size > MAX_GPT_ENTRIES_SIZE) {
+        return false;
+    }
+    *entries = static_cast<uint8_t *>(malloc(entries_size));
+    if (!read_fully(file, *entries, entries_size, header->entries_lba * sector_size)
+        || crc32(0, *entries, entries_size) != header->entries_crc) {
+        free(*entries);
+        return false;
+    }
+    return true;
+}
+
+
+// The logical sector size, which GPT and MBR addresses count in. Image files
+// have none, their GPT header tells it by where it is.
+uint32_t find_sector_size(int file) {
+    #ifdef BLKSSZGET
+    int size;
+    if (!ioctl(file, BLKSSZGET, &size)) {
+        return static_cast<uint32_t>(size);
+    }
+    #endif
+    for (uint32_t size = MIN_SECTOR_SIZE; size <= MAX_SECTOR_SIZE; size *= 2) {
+        uint64_t signature;
+        if (read_fully(file, &signature, sizeof signature, size) && signature == GPT_SIGNATURE) {
+            return size;
+        }
+    }
+    return MIN_SECTOR_SIZE;
+}
+
+
+// Collects the primary partitions of an MBR and the logical ones in its chain
+// of extended boot records. Returns false if the chain is damaged.
+bool read_mbr(int file, uint32_t sector_size, const uint8_t *mbr, mbr_partition *partitions, uint32_t& count) {
+    count = 0;
+    const auto *entries = reinterpret_cast<const mbr_entry *>(mbr + MBR_ENTRY_OFFSET);
+    uint64_t extended_lba = 0;
+    for (uint32_t i = 0; i < MBR_ENTRY_COUNT; i++) {
+        if (!entries[i].type) {
+            continue;
+        }
+        if (is_extended_type(entries[i].type)) {
+            extended_lba = entries[i].first_lba;
+            continue;
+        }
+        partitions[count++] = {MBR_ENTRY_OFFSET + i * sizeof(mbr_entry), entries[i].first_lba,
+                               entries[i].sector_count, entries[i].type, i + 1};
+    }
+
+    // Each EBR holds one logical partition, relative to itself, and the link
+    // to the next EBR, relative to the extended partition. A chain that links
+    // back to one of its EBRs never ends, so it may not have more EBRs than
+    // there can be partitions, also if they are empty.
+    uint64_t ebr_lba = extended_lba;
+    for (uint32_t number = FIRST_LOGICAL_NUMBER; ebr_lba; number++) {
+        uint8_t ebr[MIN_SECTOR_SIZE];
+        if (count == MAX_DISK_PARTITIONS || number - FIRST_LOGICAL_NUMBER == MAX_DISK_PARTITIONS
+            || !read_fully(file, ebr, sizeof ebr, ebr_lba * sector_size)
+            || *reinterpret_cast<uint16_t *>(ebr + MBR_SIGNATURE_OFFSET) != MBR_SIGNATURE) {
+            return false;
+        }
+        const auto *links = reinterpret_cast<const mbr_entry *>(ebr + MBR_ENTRY_OFFSET);
+        if (links[0].type) {
+            partitions[count++] = {ebr_lba * sector_size + MBR_ENTRY_OFFSET, ebr_lba + links[0].first_lba,
+                                   links[0].sector_count, links[0].type, number};
+        }
+        ebr_lba = is_extended_type(links[1].type) ? extended_lba + links[1].first_lba : 0;
+    }
+    return true;
+}
+
+
+bool has_gpt(const uint8_t *mbr) {
+    const auto *entries = reinterpret_cast<const mbr_entry *>(mbr + MBR_ENTRY_OFFSET);
+    for (uint32_t i = 0; i < MBR_ENTRY_COUNT; i++) {
+        if (entries[i].type == MBR_TYPE_GPT_PROTECTIVE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void print_location(FILE *stream, const partition_location& location) {
+    if (location.number) {
+        fprintf(stream, "%s partition %u", location.path, location.number);
+    } else {
+        fprintf(stream, "%s", location.path);
+    }
+}
+
+
+// Takes a partition from the table if it holds a FAT32 file system, or one
+// whose conversion was interrupted, that lies within the device
+bool add_fat_partition(int file, const partition_location& location, uint64_t device_size, uint32_t& count) {
+    if (location.offset + location.size > device_size) {
+        print_location(stderr, location);
+        fprintf(stderr, " extends beyond the end of the device\n");
+        return false;
+    }
+    uint8_t sector[MIN_SECTOR_SIZE];
+    if (location.size < sizeof sector || !read_fully(file, sector, sizeof sector, location.offset)
+        || !(is_fat32_boot_sector(sector) || has_checkpoint(sector))) {
+        print_location(stdout, location);
+        printf(" holds no FAT32 file system, skipping it\n");
+        return true;
+    }
+    count++;
+    return true;
+}
+
+
+bool find_fat_partitions(const char *path, partition_location *locations, uint32_t& count) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        perror("Failed to open partition");
+        return false;
+    }
+    uint8_t mbr[MIN_SECTOR_SIZE];
+    off_t device_size = lseek(file, 0, SEEK_END);
+    if (device_size < 0 || !read_fully(file, mbr, sizeof mbr, 0)) {
+        perror("Failed to read partition");
+        close(file);
+        return false;
+    }
+
+    // A FAT boot sector has the same signature as an MBR
+    if (is_fat32_boot_sector(mbr) || *reinterpret_cast<uint16_t *>(mbr + MBR_SIGNATURE_OFFSET) != MBR_SIGNATURE) {
+        locations[count++] = {path, 0, 0, 0};
+        close(file);
+        return true;
+    }
+
+    bool is_intact = true;
+    uint32_t sector_size = find_sector_size(file);
+    if (has_gpt(mbr)) {
+        // The backup only counts if the primary header is damaged
+        gpt_header header;
+        uint8_t *entries;
+        uint64_t last_lba = static_cast<uint64_t>(device_size) / sector_size - 1;
+        if (!read_gpt(file, sector_size, 1, &header, &entries)
+            && !read_gpt(file, sector_size, last_lba, &header, &entries)) {
+            close(file);
+            fprintf(stderr, "GPT of %s is damaged\n", path);
+            return false;
+        }
+        for (uint32_t i = 0; i < header.entry_count && i < MAX_DISK_PARTITIONS && is_intact; i++) {
+            const auto *entry = reinterpret_cast<const gpt_entry *>(entries + i * header.entry_size);
+            // The EFI system partition is left alone, the firmware only reads FAT
+            if (memcmp(entry->type_guid, GPT_TYPE_BASIC_DATA, sizeof entry->type_guid)) {
+                continue;
+            }
+            locations[count] = {path, entry->first_lba * sector_size,
+                                (entry->last_lba - entry->first_lba + 1) * sector_size, i + 1};
+            is_intact = entry->last_lba >= entry->first_lba
+                        && add_fat_partition(file, locations[count], device_size, count);
+        }
+        free(entries);
+    } else {
+        mbr_partition partitions[MAX_DISK_PARTITIONS];
+        uint32_t partition_count;
+        is_intact = read_mbr(file, sector_size, mbr, partitions, partition_count);
+        for (uint32_t i = 0; i < partition_count && is_intact; i++) {
+            if (!is_fat32_type(partitions[i].type)) {
+                continue;
+            }
+            locations[count] = {path, partitions[i].first_lba * sector_size, partitions[i].sector_count * sector_size,
+                                partitions[i].number};
+            is_intact = add_fat_partition(file, locations[count], device_size, count);
+        }
+    }
+    close(file);
+    if (!is_intact) {
+        fprintf(stderr, "Partition table of %s is damaged\n", path);
+    }
+    return is_intact;
+}
+
+
+// Sets the type of a partition in both copies of the GPT
+bool mark_gpt_partition(int file, uint32_t sector_size, uint32_t number) {
+    gpt_header primary;
+    uint8_t *entries;
+    if (!read_gpt(file, sector_size, 1, &primary, &entries)) {
+        return false;
+    }
+    uint64_t backup_lba = primary.alternate_lba;
+    gpt_header *header = &primary;
+    gpt_header backup;
+    bool is_written = true;
+    for (int copy = 0; copy < 2 && is_written; copy++) {
+        if (copy) {
+            free(entries);
+            // A damaged backup is left for the partitioning tools to repair
+            if (!read_gpt(file, sector_size, backup_lba, &backup, &entries)) {
+                return true;
+            }
+            header = &backup;
+        }
+        auto *entry = reinterpret_cast<gpt_entry *>(entries + (number - 1) * header->entry_size);
+        memcpy(entry->type_guid, GPT_TYPE_LINUX_DATA, sizeof entry->type_guid);
+        update_gpt_checksums(header, entries);
+        is_written = write_fully(file, entries, static_cast<uint64_t>(header->entry_count) * header->entry_size,
+                                 header->entries_lba * sector_size)
+                     && write_fully(file, header, sizeof *header, header->my_lba * sector_size);
+    }
+    free(entries);
+    return is_written;
+}
+
+
+bool mark_mbr_partition(int file, uint32_t sector_size, uint32_t number) {
+    uint8_t mbr[MIN_SECTOR_SIZE];
+    mbr_partition partitions[MAX_DISK_PARTITIONS];
+    uint32_t partition_count;
+    if (!read_fully(file, mbr, sizeof mbr, 0) || !read_mbr(file, sector_size, mbr, partitions, partition_count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < partition_count; i++) {
+        if (partitions[i].number == number) {
+            uint8_t type = MBR_TYPE_LINUX;
+            return write_fully(file, &type, sizeof type, partitions[i].entry_offset + offsetof(mbr_entry, type));
+        }
+    }
+    return false;
+}
+
+
+bool mark_ext4_partitions(const partition_location *locations, uint32_t count) {
+    bool is_marked = true;
+    for (uint32_t i = 0; i < count; i++) {
+        if (!locations[i].number) {
+            continue;
+        }
+        int file = open(locations[i].path, O_RDWR);
+        uint8_t mbr[MIN_SECTOR_SIZE];
+        if (file < 0 || !read_fully(file, mbr, sizeof mbr, 0)) {
+            perror("Failed to open the partition table");
+            is_marked = false;
+            if (file >= 0) {
+                close(file);
+            }
+            continue;
+        }
+        uint32_t sector_size = find_sector_size(file);
+        bool is_changed = has_gpt(mbr) ? mark_gpt_partition(file, sector_size, locations[i].number)
+                                       : mark_mbr_partition(file, sector_size, locations[i].number);
+        if (!is_changed || fsync(file)) {
+            fprintf(stderr, "Failed to change the type of ");
+            print_location(stderr, locations[i]);
+            fprintf(stderr, " to Linux\n");
+            is_marked = false;
+        }
+        close(file);
+    }
+    return is_marked;
+}
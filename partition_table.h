@@ -0,0 +1,80 @@
+#ifndef OFS_CONVERT_PARTITION_TABLE_H
+#define OFS_CONVERT_PARTITION_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Most FAT partitions taken from the partition table of a single device
+constexpr uint32_t MAX_DISK_PARTITIONS = 128;
+
+constexpr uint32_t MBR_ENTRY_OFFSET = 446;
+constexpr uint32_t MBR_ENTRY_COUNT = 4;
+constexpr uint8_t MBR_TYPE_FAT32 = 0x0B;
+constexpr uint8_t MBR_TYPE_FAT32_LBA = 0x0C;
+constexpr uint8_t MBR_TYPE_LINUX = 0x83;
+constexpr uint8_t MBR_TYPE_GPT_PROTECTIVE = 0xEE;
+constexpr uint64_t GPT_SIGNATURE = 0x5452415020494645;  // "EFI PART"
+constexpr uint32_t GPT_HEADER_SIZE = 92;
+constexpr uint32_t GPT_ENTRY_SIZE = 128;
+
+// Partition type GUIDs as they are stored, with the first three fields little endian
+extern const uint8_t GPT_TYPE_BASIC_DATA[16];
+extern const uint8_t GPT_TYPE_LINUX_DATA[16];
+
+struct __attribute__((packed)) mbr_entry {
+    uint8_t status;
+    uint8_t chs_first[3];
+    uint8_t type;
+    uint8_t chs_last[3];
+    uint32_t first_lba;
+    uint32_t sector_count;
+};
+
+struct __attribute__((packed)) gpt_header {
+    uint64_t signature;
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc;  // Of header_size bytes with this field 0
+    uint32_t reserved;
+    uint64_t my_lba, alternate_lba;
+    uint64_t first_usable_lba, last_usable_lba;
+    uint8_t disk_guid[16];
+    uint64_t entries_lba;
+    uint32_t entry_count, entry_size;
+    uint32_t entries_crc;
+};
+
+struct __attribute__((packed)) gpt_entry {
+    uint8_t type_guid[16];
+    uint8_t unique_guid[16];
+    uint64_t first_lba, last_lba;  // Inclusive
+    uint64_t attributes;
+    uint16_t name[36];
+};
+
+// Where a FAT partition is: a whole device or image file, or one of the
+// partitions in its partition table
+struct partition_location {
+    const char *path;
+    uint64_t offset, size;  // In bytes, a size of 0 extends to the end of the device
+    uint32_t number;  // As Linux numbers the partitions, 0 for a whole device
+};
+
+// CRC-32 of GPT, zlib and Ethernet
+uint32_t crc32(uint32_t crc, const void *data, uint64_t length);
+// Sets both checksums of a GPT header, whose entries are given
+void update_gpt_checksums(gpt_header *header, const uint8_t *entries);
+
+// Appends the FAT32 partitions on the device at path to locations and counts
+// them in count. These are the FAT32 data partitions of its MBR, including the
+// logical ones, or of its GPT, or the device itself if it holds a FAT file
+// system or no partition table. Locations has to have room for
+// MAX_DISK_PARTITIONS more. Returns false if the device cannot be read or its
+// partition table is damaged.
+bool find_fat_partitions(const char *path, partition_location *locations, uint32_t& count);
+// Changes the type of the partitions in the tables of their devices to Linux
+// file system, in both copies of a GPT. Whole devices are left as they are.
+bool mark_ext4_partitions(const partition_location *locations, uint32_t count);
+void print_location(FILE *stream, const partition_location& location);
+
+#endif //OFS_CONVERT_PARTITION_TABLE_H
@@ -0,0 +1,253 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "perf_counters.h"
+
+enum PerfCounter {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_PAGE_FAULTS,
+    PERF_CONTEXT_SWITCHES,
+    PERF_COUNTER_COUNT
+};
+
+struct perf_counter_type {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+};
+
+static const perf_counter_type counter_types[PERF_COUNTER_COUNT] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"LLC misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8
+                                        | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {"page faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    {"context switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static const char *const scope_names[PERF_SCOPE_COUNT] = {
+    "FAT check", "allocator init", "traverse", "group descriptors", "tree build", "journal", "finalize",
+    "resettle_extent", "add_extent", "allocate_extent"
+};
+
+struct perf_scope_counts {
+    uint64_t calls;
+    uint64_t values[PERF_COUNTER_COUNT];  // Of phases only
+    uint64_t begin_values[PERF_COUNTER_COUNT];
+    uint64_t ticks, begin_ticks;  // Of functions only
+    uint32_t depth;  // Only the outermost of nested calls is counted
+};
+
+struct perf_state {
+    int fds[PERF_COUNTER_COUNT];  // -1 if the counter is unavailable
+    // Position of each open counter in what the group leader reads
+    uint32_t group_index[PERF_COUNTER_COUNT];
+    uint32_t open_count;
+    perf_scope_counts scopes[PERF_SCOPE_COUNT];
+};
+
+__thread bool is_perf_enabled;
+__thread perf_state perf;
+
+
+int open_counter(const perf_counter_type& counter, int group_fd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = counter.type;
+    attr.config = counter.config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_hv = 1;
+    // Only the conversion thread itself, in the kernel too if allowed
+    int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+    }
+    return fd;
+}
+
+
+void start_perf_counters() {
+    memset(&perf, 0, sizeof perf);
+    int leader_fd = -1;
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        perf.fds[i] = open_counter(counter_types[i], leader_fd);
+        if (perf.fds[i] < 0) {
+            fprintf(stderr, "Performance counter for %s is unavailable: %s\n", counter_types[i].name, strerror(errno));
+            continue;
+        }
+        if (leader_fd < 0) {
+            leader_fd = perf.fds[i];
+        }
+        perf.group_index[i] = perf.open_count++;
+    }
+    if (leader_fd < 0) {
+        fprintf(stderr, "Converting without performance counters\n");
+        return;
+    }
+    // The counters run the whole time, each scope takes their difference
+    ioctl(leader_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    is_perf_enabled = true;
+}
+
+
+int leader_fd() {
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (perf.fds[i] >= 0) {
+            return perf.fds[i];
+        }
+    }
+    return -1;
+}
+
+
+// Reads all counters at once, scaled up if the kernel had to multiplex them
+void read_counters(uint64_t *values) {
+    uint64_t data[3 + PERF_COUNTER_COUNT];
+    if (read(leader_fd(), data, sizeof data) < static_cast<ssize_t>((3 + perf.open_count) * sizeof(uint64_t))) {
+        memset(values, 0, PERF_COUNTER_COUNT * sizeof(uint64_t));
+        return;
+    }
+    uint64_t time_enabled = data[1], time_running = data[2];
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        uint64_t value = perf.fds[i] >= 0 ? data[3 + perf.group_index[i]] : 0;
+        if (time_running && time_running < time_enabled) {
+            value = static_cast<uint64_t>(static_cast<double>(value) * time_enabled / time_running);
+        }
+        values[i] = value;
+    }
+}
+
+
+// The time stamp counter, without a syscall. Elsewhere the clock is read
+// through the vDSO in nanoseconds instead.
+#if defined(__x86_64__) || defined(__i386__)
+static const char *const ticks_unit = "TSC ticks";
+#else
+static const char *const ticks_unit = "ns";
+#endif
+
+uint64_t read_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#endif
+}
+
+
+void begin_perf_scope(PerfScope scope) {
+    perf_scope_counts& counts = perf.scopes[scope];
+    if (counts.depth++) {
+        return;
+    }
+    if (scope >= PERF_FIRST_FUNCTION) {
+        counts.begin_ticks = read_ticks();
+    } else {
+        read_counters(counts.begin_values);
+    }
+}
+
+
+void end_perf_scope(PerfScope scope) {
+    perf_scope_counts& counts = perf.scopes[scope];
+    if (--counts.depth) {
+        return;
+    }
+    if (scope >= PERF_FIRST_FUNCTION) {
+        counts.ticks += read_ticks() - counts.begin_ticks;
+        counts.calls++;
+        return;
+    }
+    uint64_t values[PERF_COUNTER_COUNT];
+    read_counters(values);
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        counts.values[i] += values[i] - counts.begin_values[i];
+    }
+    counts.calls++;
+}
+
+
+void print_counter(uint32_t counter, uint64_t value, int width) {
+    if (perf.fds[counter] >= 0) {
+        printf(" %*llu", width, static_cast<unsigned long long>(value));
+    } else {
+        printf(" %*s", width, "-");
+    }
+}
+
+
+void print_ratio(bool is_available, double numerator, double denominator, int width) {
+    if (is_available && denominator > 0) {
+        printf(" %*.2f", width, numerator / denominator);
+    } else {
+        printf(" %*s", width, "-");
+    }
+}
+
+
+void report_perf_counters(uint64_t used_cluster_count) {
+    if (!is_perf_enabled) {
+        return;
+    }
+    printf("%-18s %10s %14s %14s %14s %5s %12s %12s %11s %9s %8s %8s\n", "scope", "calls", ticks_unit, "cycles",
+           "instructions", "IPC", "LLC misses", "dTLB misses", "page faults", "switches", "LLC/cl", "dTLB/cl");
+    for (uint32_t i = 0; i < PERF_SCOPE_COUNT; i++) {
+        const perf_scope_counts& counts = perf.scopes[i];
+        if (!counts.calls) {
+            continue;
+        }
+        printf("%-18s %10llu", scope_names[i], static_cast<unsigned long long>(counts.calls));
+        if (i >= PERF_FIRST_FUNCTION) {
+            // The functions have no hardware counters, the phases no ticks
+            printf(" %14llu %14s %14s %5s %12s %12s %11s %9s %8s %8s\n", static_cast<unsigned long long>(counts.ticks),
+                   "-", "-", "-", "-", "-", "-", "-", "-", "-");
+            continue;
+        }
+        printf(" %14s", "-");
+        print_counter(PERF_CYCLES, counts.values[PERF_CYCLES], 14);
+        print_counter(PERF_INSTRUCTIONS, counts.values[PERF_INSTRUCTIONS], 14);
+        print_ratio(perf.fds[PERF_CYCLES] >= 0 && perf.fds[PERF_INSTRUCTIONS] >= 0,
+                    counts.values[PERF_INSTRUCTIONS], counts.values[PERF_CYCLES], 5);
+        print_counter(PERF_LLC_MISSES, counts.values[PERF_LLC_MISSES], 12);
+        print_counter(PERF_DTLB_MISSES, counts.values[PERF_DTLB_MISSES], 12);
+        print_counter(PERF_PAGE_FAULTS, counts.values[PERF_PAGE_FAULTS], 11);
+        print_counter(PERF_CONTEXT_SWITCHES, counts.values[PERF_CONTEXT_SWITCHES], 9);
+        print_ratio(perf.fds[PERF_LLC_MISSES] >= 0, counts.values[PERF_LLC_MISSES], used_cluster_count, 8);
+        print_ratio(perf.fds[PERF_DTLB_MISSES] >= 0, counts.values[PERF_DTLB_MISSES], used_cluster_count, 8);
+        printf("\n");
+    }
+    printf("Counted over %llu clusters in use. The functions count only %s, the phases only perf counters.\n",
+           static_cast<unsigned long long>(used_cluster_count), ticks_unit);
+}
+
+
+void stop_perf_counters() {
+    if (!is_perf_enabled) {
+        return;
+    }
+    for (uint32_t i = 0; i < PERF_COUNTER_COUNT; i++) {
+        if (perf.fds[i] >= 0) {
+            close(perf.fds[i]);
+            perf.fds[i] = -1;
+        }
+    }
+    is_perf_enabled = false;
+}
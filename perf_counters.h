@@ -0,0 +1,50 @@
+#ifndef OFS_CONVERT_PERF_COUNTERS_H
+#define OFS_CONVERT_PERF_COUNTERS_H
+
+#include <stdint.h>
+
+// What the hardware and software counters are accumulated for. The phases
+// follow each other, the functions are counted within them. Reading the
+// counters takes a syscall, which would cost more than a call of these hot
+// functions, so they only count their calls and time stamp counter ticks.
+enum PerfScope {
+    PERF_FAT_CHECK,
+    PERF_ALLOCATOR_INIT,
+    PERF_TRAVERSE,
+    PERF_GROUP_DESCS,
+    PERF_TREE_BUILD,
+    PERF_JOURNAL,
+    PERF_FINALIZE,
+    PERF_FIRST_FUNCTION,
+    PERF_RESETTLE_EXTENT = PERF_FIRST_FUNCTION,
+    PERF_ADD_EXTENT,
+    PERF_ALLOCATE_EXTENT,
+    PERF_SCOPE_COUNT
+};
+
+extern __thread bool is_perf_enabled;
+
+// Opens the counters of the calling thread with perf_event_open. Counters the
+// kernel or the container doesn't provide are left out, and if there are none
+// at all, the conversion runs without them.
+void start_perf_counters();
+void begin_perf_scope(PerfScope scope);
+void end_perf_scope(PerfScope scope);
+// Prints the counters of each scope, also relative to the clusters in use
+void report_perf_counters(uint64_t used_cluster_count);
+void stop_perf_counters();
+
+// The scopes cost a single branch unless the counters are running
+inline void perf_begin(PerfScope scope) {
+    if (__builtin_expect(is_perf_enabled, 0)) {
+        begin_perf_scope(scope);
+    }
+}
+
+inline void perf_end(PerfScope scope) {
+    if (__builtin_expect(is_perf_enabled, 0)) {
+        end_perf_scope(scope);
+    }
+}
+
+#endif //OFS_CONVERT_PERF_COUNTERS_H
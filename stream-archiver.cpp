@@ -1,14 +1,77 @@
+#include "ext4.h"
 #include "extent-allocator.h"
 #include "stream-archiver.h"
+#include "util.h"
 #include "visualizer.h"
 #include <stdlib.h>
 #include <string.h>
 
-uint64_t pageSize;
+__thread uint64_t pageSize;
 
-Page *allocatePage() {
-    uint32_t cluster_no = allocate_extent(1).physical_start;
-    visualizer_add_block_range({BlockRange::StreamArchiverPage, fat_cl_to_e4blk(cluster_no), 1});
+Page* nextPage(Page* page) {
+    return page->next ? reinterpret_cast<Page*>(meta_info.fs_start + page->next) : NULL;
+}
+
+void linkPage(Page* page, Page* next) {
+    page->next = next ? reinterpret_cast<uint8_t*>(next) - meta_info.fs_start : 0;
+}
+
+// Pages are carved from segments of consecutive clusters that grow from the
+// smallest to the largest size, but take at most a 256th of the partition
+constexpr uint64_t MIN_SEGMENT_SIZE = 1 << 20;
+constexpr uint64_t MAX_SEGMENT_SIZE = 8 << 20;
+
+struct ArchiverSegments {
+    bool isActive;
+    uint32_t firstClusterNo,  // Of the current segment
+             nextClusterNo,   // The first cluster not carved yet
+             endClusterNo;
+    uint64_t nextSize;
+};
+__thread ArchiverSegments segments;
+
+void startArchiverSegments() {
+    segments = {true, 0, 0, 0, MIN_SEGMENT_SIZE};
+}
+
+// Hands the clusters of the current segment that no page was carved from back to the allocator
+void releaseSegment() {
+    uint32_t usedClusters = segments.nextClusterNo - segments.firstClusterNo;
+    if(usedClusters)
+        visualizer_add_block_range({BlockRange::StreamArchiverPage, fat_cl_to_e4blk(segments.firstClusterNo),
+                                    usedClusters * blocks_per_cluster()});
+    for(uint32_t clusterNo = segments.nextClusterNo; clusterNo < segments.endClusterNo; ++clusterNo)
+        set_free(clusterNo);
+    segments.firstClusterNo = segments.endClusterNo = segments.nextClusterNo;
+}
+
+void stopArchiverSegments() {
+    releaseSegment();
+    segments = {};
+}
+
+// The next segment continues where the last one ended, so that the pages of
+// the stream written meanwhile stay in order
+uint32_t carveSegmentCluster() {
+    if(segments.nextClusterNo == segments.endClusterNo) {
+        releaseSegment();
+        uint32_t length = min(static_cast<uint32_t>(segments.nextSize >> meta_info.cluster_size_log2),
+                              min(data_cluster_count() / 256, UINT16_MAX));
+        fat_extent extent = allocate_extent(length ? length : 1, segments.endClusterNo);
+        segments.firstClusterNo = segments.nextClusterNo = extent.physical_start;
+        segments.endClusterNo = extent.physical_start + extent.length;
+        if(segments.nextSize < MAX_SEGMENT_SIZE)
+            segments.nextSize *= 2;
+    }
+    return segments.nextClusterNo++;
+}
+
+// The pages of a stream are kept in order, so that reading it back is sequential
+Page *allocatePage(Page *previous) {
+    if(segments.isActive)
+        return reinterpret_cast<Page*>(cluster_start(carveSegmentCluster()));
+    uint32_t cluster_no = allocate_extent(1, previous ? cluster_no_of(previous) + 1 : 0).physical_start;
+    visualizer_add_block_range({BlockRange::StreamArchiverPage, fat_cl_to_e4blk(cluster_no), blocks_per_cluster()});
     return reinterpret_cast<Page*>(cluster_start(cluster_no));
 }
 
@@ -16,14 +79,23 @@ void cutStreamArchiver(StreamArchiver* stream) {
     if(stream->header && stream->page)
         stream->header->elementCount = stream->elementIndex;
     else {
-        stream->page = allocatePage();
-        stream->page->next = NULL;
+        stream->page = allocatePage(NULL);
+        linkPage(stream->page, NULL);
         stream->offsetInPage = sizeof(Page);
     }
     stream->elementIndex = 0;
     stream->header = reinterpret_cast<StreamArchiver::Header*>(iterateStreamArchiver(stream, true, sizeof(StreamArchiver::Header), 0));
 }
 
+// Positions a stream at the beginning of an existing page chain, as it was
+// right after the cutStreamArchiver() that created the chain
+void attachStreamArchiver(StreamArchiver* stream, Page* firstPage) {
+    stream->page = firstPage;
+    stream->offsetInPage = sizeof(Page);
+    stream->elementIndex = 0;
+    stream->header = reinterpret_cast<StreamArchiver::Header*>(iterateStreamArchiver(stream, false, sizeof(StreamArchiver::Header), 0));
+}
+
 void* iterateStreamArchiver(StreamArchiver* stream, bool insert, uint64_t elementLength, uint64_t elementCount) {
     stream->elementIndex += elementCount;
     if(!insert && elementCount > 0 && stream->elementIndex > stream->header->elementCount) {
@@ -34,12 +106,12 @@ void* iterateStreamArchiver(StreamArchiver* stream, bool insert, uint64_t elemen
     uint64_t offsetInPage = stream->offsetInPage;
     if(stream->offsetInPage + elementLength > pageSize) {
         if(insert) {
-            Page *page = allocatePage();
-            stream->page->next = page;
+            Page *page = allocatePage(stream->page);
+            linkPage(stream->page, page);
             stream->page = page;
-            stream->page->next = NULL;
+            linkPage(stream->page, NULL);
         } else
-            stream->page = stream->page->next;
+            stream->page = nextPage(stream->page);
         offsetInPage = sizeof(Page);
     }
     stream->offsetInPage = offsetInPage + elementLength;
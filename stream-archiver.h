@@ -3,9 +3,12 @@
 
 #include <stdint.h>
 
-extern uint64_t pageSize;
+extern __thread uint64_t pageSize;
 struct Page {
-    struct Page* next;
+    // Byte offset of the next page from the start of the partition, 0 if
+    // there is none. Pages don't store pointers so that a stream can be read
+    // back by a later process, see checkpoint.cpp
+    uint64_t next;
 };
 
 struct StreamArchiver {
@@ -17,7 +20,14 @@ struct StreamArchiver {
     } *header;
 };
 
+// Between these calls, new pages are carved from segments of up to 8 MiB of
+// consecutive clusters instead of being allocated one at a time. Stopping
+// returns the clusters of the last segment that are still unused.
+void startArchiverSegments();
+void stopArchiverSegments();
 void cutStreamArchiver(StreamArchiver* stream);
+void attachStreamArchiver(StreamArchiver* stream, Page* firstPage);
+Page* nextPage(Page* page);
 void* iterateStreamArchiver(StreamArchiver* stream, bool insert, uint64_t elementLength, uint64_t elementCount = 1);
 
 template <typename T>
@@ -1,15 +1,110 @@
 #!/usr/bin/env python3
+import filecmp
 import os
 import pathlib
+import random
 import shutil
+import struct
 import sys
 import tempfile
+import time
 import unittest
+import uuid
 
 from utils import FsType, ImageMounter, ToolRunner
 
 
 NOT_ENOUGH_CLUSTERS_MSG = 'WARNING: Not enough clusters for a 32 bit FAT!'
+# How often an interrupted conversion is killed before it may run to completion
+KILL_COUNT = 3
+# Partitions that ofs-convert takes from the partition table of a disk image
+MBR_FAT32_TYPES = (0x0B, 0x0C, 0x1B, 0x1C)
+MBR_EXTENDED_TYPES = (0x05, 0x0F, 0x85)
+MBR_GPT_PROTECTIVE_TYPE = 0xEE
+GPT_BASIC_DATA_TYPE = uuid.UUID('EBD0A0A2-B9E5-4433-87C0-68B6B72699C7').bytes_le
+COPY_CHUNK_SIZE = 1 << 20
+
+
+def _is_fat32_boot_sector(sector):
+    return sector[82:90] == b'FAT32   '
+
+
+def _mbr_entries(sector):
+    # (type, first LBA, sector count) of each of the four entries
+    return [struct.unpack_from('<4xB3xII', sector, 446 + 16 * i)
+            for i in range(4)]
+
+
+def _mbr_partitions(image, mbr):
+    partitions = [e for e in _mbr_entries(mbr)
+                  if e[0] and e[0] not in MBR_EXTENDED_TYPES]
+    extended_lba = next((e[1] for e in _mbr_entries(mbr)
+                         if e[0] in MBR_EXTENDED_TYPES), 0)
+    ebr_lba = extended_lba
+    while ebr_lba:
+        image.seek(ebr_lba * 512)
+        logical, link = _mbr_entries(image.read(512))[:2]
+        if logical[0]:
+            partitions.append((logical[0], ebr_lba + logical[1], logical[2]))
+        ebr_lba = (extended_lba + link[1]
+                   if link[0] in MBR_EXTENDED_TYPES else 0)
+    return [(lba * 512, count * 512) for type_, lba, count in partitions
+            if type_ in MBR_FAT32_TYPES]
+
+
+def _gpt_partitions(image):
+    for sector_size in (512, 4096):
+        image.seek(sector_size)
+        header = image.read(92)
+        if header[:8] == b'EFI PART':
+            break
+    else:
+        raise Exception('Disk image has no GPT')
+    entries_lba, entry_count, entry_size = struct.unpack_from('<QII', header,
+                                                              72)
+    image.seek(entries_lba * sector_size)
+    entries = image.read(entry_count * entry_size)
+    partitions = []
+    for i in range(entry_count):
+        entry = entries[i * entry_size:(i + 1) * entry_size]
+        if entry[:16] == GPT_BASIC_DATA_TYPE:
+            first_lba, last_lba = struct.unpack_from('<QQ', entry, 32)
+            partitions.append((first_lba * sector_size,
+                               (last_lba - first_lba + 1) * sector_size))
+    return partitions
+
+
+def fat_partitions(image_path):
+    """Byte ranges of the FAT32 partitions of a disk image, as ofs-convert
+    finds them, or None if the image is a single FAT file system"""
+    with open(str(image_path), 'rb') as image:
+        mbr = image.read(512)
+        if _is_fat32_boot_sector(mbr) or mbr[510:512] != b'\x55\xAA':
+            return None
+        if any(e[0] == MBR_GPT_PROTECTIVE_TYPE for e in _mbr_entries(mbr)):
+            ranges = _gpt_partitions(image)
+        else:
+            ranges = _mbr_partitions(image, mbr)
+        partitions = []
+        for offset, size in ranges:
+            image.seek(offset)
+            if _is_fat32_boot_sector(image.read(512)):
+                partitions.append((offset, size))
+        return partitions
+
+
+def extract_partition(image_path, offset, size, partition_path):
+    # Leaves holes for zeros, like the sparse images
+    with open(str(image_path), 'rb') as image, \
+            open(str(partition_path), 'wb') as partition:
+        image.seek(offset)
+        for chunk_offset in range(0, size, COPY_CHUNK_SIZE):
+            chunk = image.read(min(COPY_CHUNK_SIZE, size - chunk_offset))
+            if chunk.count(0) == len(chunk):
+                partition.seek(len(chunk), os.SEEK_CUR)
+            else:
+                partition.write(chunk)
+        partition.truncate(size)
 
 
 class OfsConvertTest(unittest.TestCase):
@@ -31,19 +126,41 @@ class OfsConvertTest(unittest.TestCase):
         if fat_image_path.exists():
             def create_fat_image(*_args):
                 return fat_image_path
+        elif (input_dir / 'fatgen.args').exists():
+            def create_fat_image(self, temp_dir, tool_runner, *_args):
+                return self._create_fat_image_from_fatgen(input_dir, temp_dir,
+                                                          tool_runner)
         else:
             def create_fat_image(self, *args):
                 return self._create_fat_image_from_gen_script(input_dir, *args)
 
         def test(self):
-            self._run_test(input_dir, create_fat_image, tool_timeout)
+            self._run_test(input_dir, create_fat_image, tool_timeout,
+                           self._convert_to_ext4)
+
+        def test_interrupted(self):
+            self._run_test(input_dir, create_fat_image, tool_timeout,
+                           self._convert_to_ext4_interrupted)
+
+        def test_undo(self):
+            self._run_test(input_dir, create_fat_image, tool_timeout,
+                           self._convert_to_ext4_with_undo, check_undo=True,
+                           single_partition=True)
 
         rel_path = input_dir.relative_to(tests_dir)
         parts = list(rel_path.parent.parts) + [rel_path.stem]
         meth_name = 'test_' + '__'.join(p.replace('-', '_') for p in parts)
         setattr(cls, meth_name, test)
+        if ((input_dir / 'corrupt.sh').exists()
+                or (input_dir / 'ofs-convert.fails').exists()):
+            # Only the result of the plain conversion is corrupted, and a
+            # refused conversion has no result to resume or undo
+            return
+        setattr(cls, meth_name + '__interrupted', test_interrupted)
+        setattr(cls, meth_name + '__undo', test_undo)
 
-    def _run_test(self, input_dir, create_fat_image, tool_timeout):
+    def _run_test(self, input_dir, create_fat_image, tool_timeout, convert,
+                  check_undo=False, single_partition=False):
         tool_runner = ToolRunner(self, input_dir, tool_timeout)
         tool_runner.clean()
         with tempfile.TemporaryDirectory() as temp_dir_name:
@@ -52,18 +169,172 @@ class OfsConvertTest(unittest.TestCase):
             try:
                 fat_image_path = create_fat_image(self, temp_dir, tool_runner,
                                                   image_mounter)
+                partitions = fat_partitions(fat_image_path)
+                if single_partition and partitions is not None:
+                    self.skipTest('--undo takes a single partition, not a '
+                                  'disk')
                 ext4_image_path = temp_dir / 'ext4.img'
                 shutil.copyfile(str(fat_image_path), str(ext4_image_path))
-                self._convert_to_ext4(tool_runner, ext4_image_path)
-                self._run_fsck_ext4(tool_runner, ext4_image_path)
-                self._check_contents(tool_runner, image_mounter, fat_image_path,
-                                     ext4_image_path)
+                if (input_dir / 'ofs-convert.fails').exists():
+                    self._check_conversion_refused(tool_runner, fat_image_path,
+                                                   ext4_image_path)
+                    return
+                convert(tool_runner, ext4_image_path)
+                if (input_dir / 'corrupt.sh').exists():
+                    self._check_corruption_found(tool_runner, ext4_image_path)
+                elif partitions is None:
+                    self._check_partition(tool_runner, image_mounter,
+                                          fat_image_path, ext4_image_path)
+                else:
+                    self._check_disk_partitions(tool_runner, image_mounter,
+                                                fat_image_path,
+                                                ext4_image_path, partitions)
+                if (input_dir / 'inspect.sh').exists():
+                    tool_runner.run([str(input_dir / 'inspect.sh'),
+                                     str(ext4_image_path)], 'inspect script')
+                if check_undo:
+                    self._check_undo(tool_runner, image_mounter,
+                                     fat_image_path, ext4_image_path)
+            except unittest.SkipTest:
+                raise
             except Exception:
                 tool_runner.write_output()
                 raise
 
+    def _check_partition(self, tool_runner, image_mounter, fat_image_path,
+                         ext4_image_path):
+        self._run_fsck_ext4(tool_runner, ext4_image_path)
+        self._check_contents(tool_runner, image_mounter, fat_image_path,
+                             ext4_image_path)
+
+    def _check_disk_partitions(self, tool_runner, image_mounter,
+                               fat_image_path, ext4_image_path, partitions):
+        # Each partition is checked on its own, extracted from both disks
+        self.assertTrue(partitions, 'Disk image has no FAT32 partition')
+        for i, (offset, size) in enumerate(partitions):
+            fat_partition_path = ext4_image_path.with_name(
+                'fat-{}.img'.format(i))
+            ext4_partition_path = ext4_image_path.with_name(
+                'ext4-{}.img'.format(i))
+            extract_partition(fat_image_path, offset, size,
+                              fat_partition_path)
+            extract_partition(ext4_image_path, offset, size,
+                              ext4_partition_path)
+            self._check_partition(tool_runner, image_mounter,
+                                  fat_partition_path, ext4_partition_path)
+            fat_partition_path.unlink()
+            ext4_partition_path.unlink()
+
+    def _ofs_convert_call(self, tool_runner, fat_image_path, undo_path=None,
+                          resumable=False):
+        args_file = tool_runner.input_dir / 'ofs-convert.args'
+        args = args_file.read_text().split() if args_file.exists() else []
+        if resumable:
+            # A resumed conversion refuses to verify, the FAT file system may
+            # already be partly overwritten
+            args = [arg for arg in args if arg not in ('-v', '--verify')]
+        if undo_path:
+            args += ['--undo', str(undo_path)]
+        call = [self._OFS_CONVERT] + args + [str(fat_image_path)]
+        stack_limit_file = tool_runner.input_dir / 'ofs-convert.stack-limit'
+        if stack_limit_file.exists():
+            # The shell execs ofs-convert, so that kills still reach it
+            stack_limit = int(stack_limit_file.read_text())
+            call = ['sh', '-c', 'ulimit -s {} && exec "$@"'.format(stack_limit),
+                    'sh'] + call
+        return call
+
     def _convert_to_ext4(self, tool_runner, fat_image_path):
-        tool_runner.run([self._OFS_CONVERT, str(fat_image_path)], 'ofs-convert')
+        expected_file = tool_runner.input_dir / 'ofs-convert.stdout'
+
+        def check_output(proc):
+            if expected_file.exists():
+                self.assertIn(expected_file.read_text().strip().encode('utf-8'),
+                              proc.stdout, 'ofs-convert printed something else')
+
+        tool_runner.run(self._ofs_convert_call(tool_runner, fat_image_path),
+                        'ofs-convert', custom_output_checker=check_output)
+
+    def _convert_to_ext4_interrupted(self, tool_runner, fat_image_path):
+        # Time an uninterrupted conversion of a scratch copy, so that the kills
+        # below are spread over the whole run
+        scratch_path = fat_image_path.with_name('scratch.img')
+        shutil.copyfile(str(fat_image_path), str(scratch_path))
+        start = time.monotonic()
+        self._convert_to_ext4(tool_runner, scratch_path)
+        duration = time.monotonic() - start
+        scratch_path.unlink()
+
+        for i in range(KILL_COUNT):
+            delay = random.uniform(0, duration)
+            name = 'ofs-convert killed after {:.3f}s'.format(delay)
+            if not tool_runner.run_killed(
+                    self._ofs_convert_call(tool_runner, fat_image_path,
+                                           resumable=True), name, delay):
+                break
+        # Resume (or recognize the finished conversion) until completion. It
+        # prints less than an uninterrupted one, so its output is not checked.
+        tool_runner.run(self._ofs_convert_call(tool_runner, fat_image_path,
+                                               resumable=True), 'ofs-convert')
+
+    @staticmethod
+    def _undo_file_path(image_path):
+        return image_path.with_name('ofs-convert.e2undo')
+
+    def _convert_to_ext4_with_undo(self, tool_runner, fat_image_path):
+        tool_runner.run(
+            self._ofs_convert_call(tool_runner, fat_image_path,
+                                   undo_path=self._undo_file_path(
+                                       fat_image_path)),
+            'ofs-convert')
+
+    def _check_undo(self, tool_runner, image_mounter, fat_image_path,
+                    ext4_image_path):
+        # Rolling back a copy of the converted image has to restore the
+        # contents of the FAT image
+        undone_path = ext4_image_path.with_name('undone.img')
+        shutil.copyfile(str(ext4_image_path), str(undone_path))
+        tool_runner.run(['e2undo', str(self._undo_file_path(ext4_image_path)),
+                         str(undone_path)], 'e2undo')
+        self._compare_contents(tool_runner, image_mounter, fat_image_path,
+                               undone_path, FsType.VFAT,
+                               self._check_rsync_output_empty)
+
+    def _handle_check_error(self, exc):
+        self.assertIn(b'Check failed: ', exc.stderr,
+                      'ofs-convert --check failed without finding a problem')
+        return False
+
+    def _check_corruption_found(self, tool_runner, ext4_image_path):
+        # Checking the converted image again has to find what the script broke
+        tool_runner.run([str(tool_runner.input_dir / 'corrupt.sh'),
+                         str(ext4_image_path)], 'corrupt script')
+        tool_runner.run(
+            [self._OFS_CONVERT, '--check', str(ext4_image_path)],
+            'ofs-convert --check',
+            custom_output_checker=lambda _: self.fail(
+                'ofs-convert --check did not find the corruption'),
+            custom_error_handler=self._handle_check_error)
+
+    def _check_conversion_refused(self, tool_runner, fat_image_path,
+                                  ext4_image_path):
+        # ofs-convert has to fail with the expected message, before writing
+        expected = (tool_runner.input_dir / 'ofs-convert.fails').read_text()
+
+        def handle_error(exc):
+            self.assertIn(expected.strip().encode('utf-8'), exc.stderr,
+                          'ofs-convert failed for another reason')
+            return False
+
+        tool_runner.run(
+            self._ofs_convert_call(tool_runner, ext4_image_path),
+            'ofs-convert',
+            custom_output_checker=lambda _: self.fail(
+                'ofs-convert converted the damaged image'),
+            custom_error_handler=handle_error)
+        self.assertTrue(filecmp.cmp(str(fat_image_path), str(ext4_image_path),
+                                    shallow=False),
+                        'ofs-convert modified the image it refused')
 
     def _handle_fsck_ext4_error(self, exc):
         if exc.returncode & ~12 == 0:
@@ -83,12 +354,21 @@ class OfsConvertTest(unittest.TestCase):
             proc.stdout.decode('utf-8'), r'^\.d\.\.t\.+\ \./' + '\n$',
             'rsync reported differences between fat and ext4 images')
 
+    def _check_rsync_output_empty(self, proc):
+        self.assertEqual(proc.stdout.decode('utf-8'), '',
+                         'rsync reported differences between fat images')
+
     def _check_contents(self, tool_runner, image_mounter, fat_image_path,
                         ext4_image_path):
+        self._compare_contents(tool_runner, image_mounter, fat_image_path,
+                               ext4_image_path, FsType.EXT4,
+                               self._check_rsync_output)
+
+    def _compare_contents(self, tool_runner, image_mounter, fat_image_path,
+                          image_path, fs_type, output_checker):
         with image_mounter.mount(fat_image_path,
                                  FsType.VFAT, True) as fat_mount:
-            with image_mounter.mount(ext4_image_path,
-                                     FsType.EXT4, True) as ext_mount:
+            with image_mounter.mount(image_path, fs_type, True) as image_mount:
                 # if the fat path doesn't end in a slash, rsync wants to copy
                 # the directory and not its contents
                 formatted_path_path = str(fat_mount)
@@ -97,9 +377,9 @@ class OfsConvertTest(unittest.TestCase):
                 args = ['rsync', '--dry-run', '--itemize-changes', '--archive',
                         '--checksum', '--no-perms', '--no-owner', '--no-group',
                         '--delete', '--exclude=/lost+found', formatted_path_path,
-                        str(ext_mount)]
+                        str(image_mount)]
                 tool_runner.run(args, 'rsync',
-                                custom_output_checker=self._check_rsync_output)
+                                custom_output_checker=output_checker)
 
     @staticmethod
     def _check_mkfs_fat_output(proc):
@@ -107,6 +387,15 @@ class OfsConvertTest(unittest.TestCase):
         if NOT_ENOUGH_CLUSTERS_MSG in stderr:
             raise Exception('Too few clusters for FAT32 specified in test case')
 
+    def _create_fat_image_from_fatgen(self, input_dir, temp_dir, tool_runner):
+        # fatgen is built next to ofs-convert
+        fatgen_path = pathlib.Path(self._OFS_CONVERT).with_name('fatgen')
+        image_file_path = temp_dir / 'fat.img'
+        args = (input_dir / 'fatgen.args').read_text().split()
+        tool_runner.run([str(fatgen_path)] + args + [str(image_file_path)],
+                        'fatgen')
+        return image_file_path
+
     def _create_fat_image_from_gen_script(self, input_dir, temp_dir,
                                           tool_runner, image_mounter):
         image_file_path = temp_dir / 'fat.img'
@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+# Sizes around the 4k blocks within a 16k cluster, and enough directory
+# entries to use several blocks of a directory cluster
+mkdir -p "$1/dir"
+for size in 1 4095 4096 4097 12288 16383 16384 16385 100000; do
+    head -c "$size" /dev/urandom > "$1/file_$size"
+done
+for i in $(seq 1 200); do
+    echo "$i" > "$1/dir/file with a rather long name number $i"
+done
+# Longer than the longest extent (32768 blocks)
+dd if=/dev/zero of="$1/dir/large_file" bs=16384 count=8193
@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir/dir2"
+head -c 1000 /dev/urandom > "$1/small_file"
+head -c 10000 /dev/urandom > "$1/dir/file"
+dd if=/dev/urandom of="$1/dir/dir2/large_file" bs=8192 count=16385
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir/subdir/subsubdir" "$1/many_files"
+for i in $(seq 1 300); do
+    echo "$i" > "$1/many_files/file_$i"
+done
+head -c 3000000 /dev/urandom > "$1/dir/subdir/large_file"
+touch "$1/dir/subdir/subsubdir/empty_file"
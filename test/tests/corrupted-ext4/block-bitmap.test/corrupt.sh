@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+# Marks a free block as used, without changing the free counters
+block=$(debugfs -R "ffb 1 1000" "$1" 2>/dev/null | sed -n 's/^Free blocks found: //p')
+debugfs -w -R "setb $block" "$1"
@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+# Turns the root directory's extent tree into an index of depth 1, whose only
+# child lies past the end of the file system
+debugfs -w -R "set_inode_field <2> block[1] 0x00010004" "$1"
+debugfs -w -R "set_inode_field <2> block[4] 0xFFFFFFF0" "$1"
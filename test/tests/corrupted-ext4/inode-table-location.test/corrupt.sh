@@ -0,0 +1,3 @@
+#!/usr/bin/env bash
+# The inode table of the first group lies past the end of the file system
+debugfs -w -R "set_bg 0 inode_table 4294967295" "$1"
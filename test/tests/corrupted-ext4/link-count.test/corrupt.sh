@@ -0,0 +1,3 @@
+#!/usr/bin/env bash
+# The root directory claims links that no directory entry makes
+debugfs -w -R "set_inode_field <2> links_count 100" "$1"
@@ -0,0 +1,3 @@
+#!/usr/bin/env bash
+# The superblock claims more blocks than the partition has
+debugfs -w -R "ssv blocks_count 4294967295" "$1"
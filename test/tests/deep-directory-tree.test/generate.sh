@@ -0,0 +1,10 @@
+#!/usr/bin/env bash
+# Deep enough to exercise the traversal stacks, shallow enough for rsync's
+# path length limit. With the stack limit of the test case, the recursive
+# traversal that the stacks replaced overflowed at this depth.
+cd "$1"
+for i in $(seq 1000); do
+    mkdir d
+    cd d
+done
+echo "bottom" > file
@@ -0,0 +1,4 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir"
+head -c 100000 /dev/urandom > "$1/dir/file"
+head -c 3000000 /dev/urandom > "$1/large_file"
@@ -0,0 +1,12 @@
+#!/usr/bin/env bash
+# Leaves 500 single cluster holes on an otherwise full file system, which are
+# then filled by a single file. Its extents don't fit into a single extent
+# tree level below the inode (4 * 84 extents for 1k blocks).
+for i in $(seq 0 999); do
+    head -c 1024 /dev/urandom > "$1/f$i"
+done
+dd if=/dev/zero of="$1/filler" bs=64k 2> /dev/null
+for i in $(seq 1 2 999); do
+    rm "$1/f$i"
+done
+head -c 512000 /dev/urandom > "$1/fragmented"
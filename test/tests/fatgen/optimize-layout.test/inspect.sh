@@ -0,0 +1,9 @@
+#!/usr/bin/env bash
+# The default layout would be a single group of 131072 blocks with 32768
+# inodes. The optimized one has two groups of 126976 blocks, which keep the
+# inode count, and the superblock backup stays in group 1.
+set -e
+header=$(dumpe2fs -h "$1" 2> /dev/null)
+grep -q "^Blocks per group: *126976$" <<< "$header"
+grep -q "^Inodes per group: *16384$" <<< "$header"
+grep -q "^Backup block groups: *1 *$" <<< "$header"
@@ -0,0 +1,3 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir"
+head -c 100000 /dev/urandom > "$1/dir/file"
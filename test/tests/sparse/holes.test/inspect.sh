@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+# The zeros became holes: the all-zero file has no blocks at all, and of the
+# partial one only the 13 blocks before and the 2 after its zeros are left
+set -e
+debugfs -R "stat /preallocated" "$1" 2> /dev/null | grep -q "Blockcount: 0$"
+debugfs -R "stat /dir/partial" "$1" 2> /dev/null | grep -q "Blockcount: 120$"
@@ -0,0 +1,6 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir"
+dd if=/dev/zero of="$1/preallocated" bs=4096 count=2000
+head -c 50000 /dev/urandom > "$1/dir/partial"
+dd if=/dev/zero bs=4096 count=20 >> "$1/dir/partial"
+head -c 5000 /dev/urandom >> "$1/dir/partial"
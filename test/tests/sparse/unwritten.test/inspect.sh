@@ -0,0 +1,5 @@
+#!/usr/bin/env bash
+# The zeros became unwritten extents, which debugfs flags as Uninit
+set -e
+debugfs -R "ex /preallocated" "$1" 2> /dev/null | grep -q " Uninit$"
+debugfs -R "ex /dir/partial" "$1" 2> /dev/null | grep -q " Uninit$"
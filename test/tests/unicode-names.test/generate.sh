@@ -0,0 +1,8 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir-中文"
+touch "$1/unicode-éè中文" "$1/ümlaut-ÄÖÜ"
+# Surrogate pairs: within the first 8 code units, straddling them, and
+# straddling two LFN entries (13 code units each)
+touch "$1/emoji-😀💩.txt" "$1/abcdefg😀" "$1/abcdefghijkl😀tail"
+echo "content" > "$1/dir-中文/$(printf 'x%.0s' {1..200})"
+echo "content" > "$1/dir-中文/𝄞 music"
@@ -0,0 +1,7 @@
+#!/usr/bin/env bash
+mkdir -p "$1/dir/subdir" "$1/empty_dir"
+head -c 100000 /dev/urandom > "$1/dir/file"
+head -c 3000000 /dev/urandom > "$1/dir/subdir/large_file"
+touch "$1/empty_file"
+echo "long name" > "$1/a file with a long name.txt"
+echo "unicode name" > "$1/dir/ünïcödé"
@@ -46,6 +46,30 @@ class ToolRunner:
             self._save_tool_output(stderr, name + '.err')
             self._save_tool_output(stdout, name + '.out')
 
+    def run_killed(self, args, name, delay):
+        """Runs a tool and kills it with SIGKILL after `delay` seconds.
+
+        Returns True if the tool had to be killed, False if it exited on its
+        own before that.
+        """
+        proc = subprocess.Popen(args, stderr=subprocess.PIPE,
+                                stdout=subprocess.PIPE)
+        try:
+            stdout, stderr = proc.communicate(timeout=delay)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            stdout, stderr = proc.communicate()
+            killed = True
+        else:
+            killed = False
+            if proc.returncode != 0:
+                raise subprocess.CalledProcessError(proc.returncode, args,
+                                                    stdout, stderr)
+        finally:
+            self._save_tool_output(stderr, name + '.err')
+            self._save_tool_output(stdout, name + '.out')
+        return killed
+
     def _save_tool_output(self, output, stem):
         if output:
             out_path = self.input_dir / (stem + '.txt')
@@ -109,7 +133,11 @@ class ImageMounter:
     elif sys.platform.startswith('linux'):
         def mount(self, image_path, fs_type, readonly):
             mount_point = self._make_mount_point(fs_type)
-            args = ['mount', '-o', 'loop', '-t', fs_type.name.lower()]
+            options = 'loop'
+            if fs_type == FsType.VFAT:
+                # Long names are UTF-16, don't depend on the default iocharset
+                options += ',utf8'
+            args = ['mount', '-o', options, '-t', fs_type.name.lower()]
             if readonly:
                 args.append('--read-only')
             args.extend([str(image_path), str(mount_point)])
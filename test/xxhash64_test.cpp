@@ -0,0 +1,61 @@
+#include "util.h"
+#include "xxhash64.h"
+
+#include <stdio.h>
+
+// The test buffer of the sanity check of xxhsum, and what the reference
+// implementation hashes its prefixes to
+constexpr uint32_t XXH64_TEST_BUFFER_SIZE = 2367;
+constexpr uint64_t XXH64_TEST_PRIME32 = 2654435761U;
+constexpr uint64_t XXH64_TEST_PRIME64 = 11400714785074694797ULL;
+
+struct xxh64_known_answer {
+    uint32_t length;
+    uint64_t seed;
+    uint64_t hash;
+};
+
+const xxh64_known_answer xxh64_known_answers[] = {
+    {0, 0, 0xEF46DB3751D8E999ULL},
+    {0, XXH64_TEST_PRIME32, 0xAC75FDA2929B17EFULL},
+    {1, 0, 0xE934A84ADB052768ULL},
+    {1, XXH64_TEST_PRIME32, 0x5014607643A9B4C3ULL},
+    {4, 0, 0x9136A0DCA57457EEULL},
+    {14, 0, 0x8282DCC4994E35C8ULL},
+    {14, XXH64_TEST_PRIME32, 0xC3BD6BF63DEB6DF0ULL},
+    {222, 0, 0xB641AE8CB691C174ULL},
+    {222, XXH64_TEST_PRIME32, 0x20CB8AB7AE10C14AULL},
+    {XXH64_TEST_BUFFER_SIZE, 0, 0xA82418DDEC0EA581ULL},
+    {XXH64_TEST_BUFFER_SIZE, XXH64_TEST_PRIME32, 0xA36A93C18052673AULL},
+};
+
+// Checks the known answers of the reference implementation, both hashed at
+// once and streamed in uneven pieces
+int main() {
+    uint8_t buffer[XXH64_TEST_BUFFER_SIZE];
+    uint64_t generator = XXH64_TEST_PRIME32;
+    for (uint32_t i = 0; i < XXH64_TEST_BUFFER_SIZE; i++) {
+        buffer[i] = static_cast<uint8_t>(generator >> 56);
+        generator *= XXH64_TEST_PRIME64;
+    }
+
+    for (const xxh64_known_answer& answer : xxh64_known_answers) {
+        if (xxh64(buffer, answer.length, answer.seed) != answer.hash) {
+            fprintf(stderr, "XXH64 of %u bytes with seed %llu is wrong\n", answer.length,
+                    static_cast<unsigned long long>(answer.seed));
+            return 1;
+        }
+        // Pieces of 1, 2, 3, ... bytes cross the stripes at every offset
+        xxh64_state state;
+        xxh64_init(&state, answer.seed);
+        for (uint32_t offset = 0, piece = 1; offset < answer.length; offset += piece, piece++) {
+            xxh64_update(&state, buffer + offset, min(piece, answer.length - offset));
+        }
+        if (xxh64_digest(&state) != answer.hash) {
+            fprintf(stderr, "Streamed XXH64 of %u bytes with seed %llu is wrong\n", answer.length,
+                    static_cast<unsigned long long>(answer.seed));
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -37,97 +37,172 @@ ext4_dentry *build_dot_dirs(uint32_t dir_inode_no, uint32_t parent_inode_no, uin
     return (ext4_dentry *) dot_dot_dentry_p;
 }
 
+// An unused directory block holds a single dentry without an inode
+void clear_dir_block(uint64_t block_no) {
+    ext4_dentry *dentry = (ext4_dentry *) block_start(block_no);
+    dentry->inode = 0;
+    dentry->rec_len = block_size();
+    dentry->name_len = 0;
+}
+
+// Directories are allocated in whole clusters, with blocks_per_cluster()
+// directory blocks each
+void clear_remaining_dir_blocks(uint64_t first_block_no) {
+    for (uint32_t i = 1; i < blocks_per_cluster(); i++) {
+        clear_dir_block(first_block_no + i);
+    }
+}
+
 void build_lost_found() {
     fat_extent root_dentry_extent = allocate_extent(1);
     ext4_extent last_root_extent = last_extent(EXT4_ROOT_INODE);
-    root_dentry_extent.logical_start = last_root_extent.ee_block + last_root_extent.ee_len;
+    root_dentry_extent.logical_start = (last_root_extent.ee_block + last_root_extent.ee_len) / blocks_per_cluster();
     register_extent(&root_dentry_extent, EXT4_ROOT_INODE);
 
     build_lost_found_inode();
-    ext4_dentry *dentry_address = (ext4_dentry *) cluster_start(root_dentry_extent.physical_start);
+    uint64_t root_dentry_block_no = fat_cl_to_e4blk(root_dentry_extent.physical_start);
+    ext4_dentry *dentry_address = (ext4_dentry *) block_start(root_dentry_block_no);
     ext4_dentry lost_found_dentry = build_lost_found_dentry();
     lost_found_dentry.rec_len = block_size();
     *dentry_address = lost_found_dentry;
-    set_size(EXT4_ROOT_INODE, get_size(EXT4_ROOT_INODE) + block_size());
+    clear_remaining_dir_blocks(root_dentry_block_no);
+    set_size(EXT4_ROOT_INODE, get_size(EXT4_ROOT_INODE) + meta_info.cluster_size);
 
     // Build . and .. dirs in lost+found
     fat_extent lost_found_dentry_extent = allocate_extent(1);
     lost_found_dentry_extent.logical_start = 0;
-    uint8_t *lost_found_dentry_p = cluster_start(lost_found_dentry_extent.physical_start);
-    ext4_dentry *dot_dot_dentry = build_dot_dirs(EXT4_LOST_FOUND_INODE, EXT4_ROOT_INODE, lost_found_dentry_p);
+    uint64_t lost_found_block_no = fat_cl_to_e4blk(lost_found_dentry_extent.physical_start);
+    ext4_dentry *dot_dot_dentry = build_dot_dirs(EXT4_LOST_FOUND_INODE, EXT4_ROOT_INODE, block_start(lost_found_block_no));
     dot_dot_dentry->rec_len = block_size() - EXT4_DOT_DENTRY_SIZE;
+    clear_remaining_dir_blocks(lost_found_block_no);
     register_extent(&lost_found_dentry_extent, EXT4_LOST_FOUND_INODE);
-    set_size(EXT4_LOST_FOUND_INODE, block_size());
+    set_size(EXT4_LOST_FOUND_INODE, meta_info.cluster_size);
 
-    visualizer_add_block_range({BlockRange::Ext4Dir, fat_cl_to_e4blk(root_dentry_extent.physical_start), 1});
-    visualizer_add_block_range({BlockRange::Ext4Dir, fat_cl_to_e4blk(lost_found_dentry_extent.physical_start), 1});
+    visualizer_add_block_range({BlockRange::Ext4Dir, root_dentry_block_no, blocks_per_cluster()});
+    visualizer_add_block_range({BlockRange::Ext4Dir, lost_found_block_no, blocks_per_cluster()});
 }
 
-uint64_t next_dir_block(extent_iterator *iterator) {
+// Returns the block following the first block_count directory blocks. All
+// blocks of a cluster are used before moving on to the next cluster.
+uint64_t next_dir_block(extent_iterator *iterator, uint64_t block_no, uint32_t block_count) {
+    if (block_count % blocks_per_cluster())
+        return block_no + 1;
+
     uint32_t cluster_no = next_cluster_no(iterator);
-    if (!cluster_no)
-        cluster_no = allocate_extent(1).physical_start;
+    if (!cluster_no)  // The directory grows, preferably right after its previous cluster
+        cluster_no = allocate_extent(1, block_no ? e4blk_to_fat_cl(block_no) : 0).physical_start;
 
     return fat_cl_to_e4blk(cluster_no);
 }
 
-void register_dir_extent(uint64_t block_no, uint32_t logical_no, uint32_t inode_no) {
-    fat_extent extent = {logical_no, 1, e4blk_to_fat_cl(block_no)};
+// Registers the cluster containing block_no, which holds the given directory block
+void register_dir_cluster(uint64_t block_no, uint32_t logical_no, uint32_t inode_no) {
+    fat_extent extent = {logical_no / blocks_per_cluster(), 1, e4blk_to_fat_cl(block_no), 0};
     register_extent(&extent, inode_no);
+    visualizer_add_block_range({BlockRange::Ext4Dir, fat_cl_to_e4blk(extent.physical_start), blocks_per_cluster()});
 }
 
-void build_ext4_metadata_tree(uint32_t dir_inode_no, uint32_t parent_inode_no, StreamArchiver *read_stream) {
-    StreamArchiver extent_stream = *read_stream;
-    extent_iterator iterator = init(&extent_stream);
-    uint64_t dentry_block_no = next_dir_block(&iterator);
-    uint8_t *dentry_block_start = block_start(dentry_block_no);
+// A directory whose ext4 dentries are being built. Like the metadata reader,
+// the tree builder keeps the directories from the root to the current one on
+// an explicit stack instead of recursing.
+struct dir_build_frame {
+    uint32_t dir_inode_no;
+    StreamArchiver extent_stream;  // The directory's FAT extents, read by iterator
+    extent_iterator iterator;
+    uint64_t dentry_block_no;
+    uint8_t *dentry_block_start;
+    uint32_t block_count;
+    uint32_t child_count, children_built;
+    ext4_dentry *previous_dentry;
+    int position_in_block;
+};
+
+struct dir_build_stack {
+    dir_build_frame *frames;
+    uint32_t size, capacity;
+};
+
+void push_dir(dir_build_stack *stack, uint32_t dir_inode_no, uint32_t parent_inode_no, StreamArchiver *read_stream) {
+    if (stack->size == stack->capacity) {
+        stack->capacity = stack->capacity ? 2 * stack->capacity : 64;
+        stack->frames = static_cast<dir_build_frame *>(context_realloc(stack->frames, stack->capacity * sizeof(dir_build_frame)));
+        // The iterators point into the frames, which may have moved
+        for (uint32_t i = 0; i < stack->size; i++) {
+            stack->frames[i].iterator.extent_stream = &stack->frames[i].extent_stream;
+        }
+    }
+    dir_build_frame& dir = stack->frames[stack->size++];
+    dir.dir_inode_no = dir_inode_no;
+    dir.extent_stream = *read_stream;
+    dir.iterator = init(&dir.extent_stream);
+    dir.dentry_block_no = next_dir_block(&dir.iterator, 0, 0);
+    dir.dentry_block_start = block_start(dir.dentry_block_no);
 
     skip_dir_extents(read_stream);
-    uint32_t child_count = *getNext<uint32_t>(read_stream);
+    dir.child_count = *getNext<uint32_t>(read_stream);
     getNext<uint32_t>(read_stream);  // consume cut
 
-    uint32_t block_count = 1;
+    dir.children_built = 0;
+    dir.block_count = 1;
+    dir.previous_dentry = build_dot_dirs(dir_inode_no, parent_inode_no, dir.dentry_block_start);
+    dir.position_in_block = 2 * EXT4_DOT_DENTRY_SIZE;
+}
+
+void finish_dir(dir_build_frame& dir) {
+    if (dir.previous_dentry) {
+        dir.previous_dentry->rec_len += block_size() - dir.position_in_block;
+    }
+
+    for (; dir.block_count % blocks_per_cluster(); dir.block_count++) {
+        clear_dir_block(++dir.dentry_block_no);
+    }
+    register_dir_cluster(dir.dentry_block_no, dir.block_count - 1, dir.dir_inode_no);
+    set_size(dir.dir_inode_no, dir.block_count * block_size());
+}
 
-    ext4_dentry *previous_dentry = build_dot_dirs(dir_inode_no, parent_inode_no, dentry_block_start);
-    int position_in_block = 2 * EXT4_DOT_DENTRY_SIZE;
+void build_ext4_metadata_tree(uint32_t dir_inode_no, uint32_t parent_inode_no, StreamArchiver *read_stream) {
+    dir_build_stack stack = {NULL, 0, 0};
+    push_dir(&stack, dir_inode_no, parent_inode_no, read_stream);
+
+    while (stack.size) {
+        dir_build_frame& dir = stack.frames[stack.size - 1];
+        if (dir.children_built == dir.child_count) {
+            finish_dir(dir);
+            stack.size--;
+            continue;
+        }
+        dir.children_built++;
 
-    for (uint32_t i = 0; i < child_count; i++) {
         fat_dentry *f_dentry = getNext<fat_dentry>(read_stream);
         getNext<fat_dentry>(read_stream);  // consume cut
 
         uint32_t inode_number = build_inode(f_dentry);
         ext4_dentry *e_dentry = build_dentry(inode_number, read_stream);
-        if (e_dentry->rec_len > block_size() - position_in_block) {
-            previous_dentry->rec_len += block_size() - position_in_block;
-
-            register_dir_extent(dentry_block_no, block_count - 1, dir_inode_no);
-            block_count++;
-            visualizer_add_block_range({BlockRange::Ext4Dir, dentry_block_no, 1});
-
-            dentry_block_no = next_dir_block(&iterator);
-            dentry_block_start = block_start(dentry_block_no);
-            position_in_block = 0;
+        if (e_dentry->rec_len > block_size() - dir.position_in_block) {
+            dir.previous_dentry->rec_len += block_size() - dir.position_in_block;
+
+            if (dir.block_count % blocks_per_cluster() == 0) {
+                register_dir_cluster(dir.dentry_block_no, dir.block_count - 1, dir.dir_inode_no);
+            }
+            dir.dentry_block_no = next_dir_block(&dir.iterator, dir.dentry_block_no, dir.block_count);
+            dir.dentry_block_start = block_start(dir.dentry_block_no);
+            dir.block_count++;
+            dir.position_in_block = 0;
         }
-        previous_dentry = (ext4_dentry *) (dentry_block_start + position_in_block);
-        position_in_block += e_dentry->rec_len;
+        dir.previous_dentry = (ext4_dentry *) (dir.dentry_block_start + dir.position_in_block);
+        dir.position_in_block += e_dentry->rec_len;
 
-        memcpy(previous_dentry, e_dentry, e_dentry->rec_len);
-        free(e_dentry);
+        memcpy(dir.previous_dentry, e_dentry, e_dentry->rec_len);
+        context_free(e_dentry);
 
         if (!is_dir(f_dentry)) {
             set_extents(inode_number, f_dentry, read_stream);
             skip_child_count(read_stream);
         } else {
-            incr_links_count(dir_inode_no);
-            build_ext4_metadata_tree(inode_number, dir_inode_no, read_stream);
+            incr_links_count(dir.dir_inode_no);
+            // dir is invalid once the stack has grown
+            push_dir(&stack, inode_number, dir.dir_inode_no, read_stream);
         }
     }
-
-    if (previous_dentry) {
-        previous_dentry->rec_len += block_size() - position_in_block;
-    }
-
-    register_dir_extent(dentry_block_no, block_count - 1, dir_inode_no);
-    visualizer_add_block_range({BlockRange::Ext4Dir, dentry_block_no, 1});
-    set_size(dir_inode_no, block_count * block_size());
+    context_free(stack.frames);
 }
@@ -0,0 +1,422 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ext4.h"
+#include "fat.h"
+#include "undo_file.h"
+
+// The undo file format of e2fsprogs (lib/ext2fs/undo_io.c): a header, a copy
+// of the superblock of the modified file system and then key blocks, each
+// followed by the saved data its keys describe. All fields are little endian.
+constexpr char E2UNDO_MAGIC[8] = {'E', '2', 'U', 'N', 'D', 'O', '0', '2'};
+constexpr uint32_t E2UNDO_KEYBLOCK_MAGIC = 0xCADECADE;
+constexpr uint32_t E2UNDO_STATE_FINISHED = 0x1;
+constexpr uint32_t E2UNDO_FEATURE_COMPAT_FS_OFFSET = 0x1;
+constexpr uint32_t E2UNDO_MAX_EXTENT_BLOCKS = 512;
+constexpr uint64_t E2UNDO_SUPERBLOCK_OFFSET = 1024;
+
+// Both the blocks of the undo file and the unit of the saved positions
+constexpr uint32_t UNDO_BLOCK_SIZE = 4096;
+constexpr uint64_t UNDO_SUPER_BLOCK = 1;
+constexpr uint64_t UNDO_FIRST_KEY_BLOCK = 2;
+// The first write to the mapping saves the whole chunk around it. Larger
+// chunks take fewer faults and split the mapping less, but save more.
+constexpr uint64_t UNDO_CHUNK_SIZE = 64 << 10;
+
+struct __attribute__((packed)) undo_header {
+    char magic[8];
+    uint64_t num_keys;
+    uint64_t super_offset;  // In blocks of the undo file
+    uint64_t key_offset;
+    uint32_t block_size;
+    uint32_t fs_block_size;  // Unit of undo_key::fsblk
+    uint32_t sb_crc;
+    uint32_t state;
+    uint32_t f_compat;
+    uint32_t f_incompat;
+    uint32_t f_rocompat;
+    uint32_t pad32;
+    uint64_t fs_offset;
+    uint8_t padding[436];
+    uint32_t header_crc;  // Of everything before it
+};
+
+struct __attribute__((packed)) undo_key {
+    uint64_t fsblk;
+    uint32_t blk_crc;
+    uint32_t size;  // In bytes, at most E2UNDO_MAX_EXTENT_BLOCKS blocks
+};
+
+constexpr uint32_t UNDO_KEYS_PER_BLOCK = (UNDO_BLOCK_SIZE - 16) / sizeof(undo_key);
+
+struct __attribute__((packed)) undo_key_block {
+    uint32_t magic;
+    uint32_t crc;  // Of the whole block with crc = 0
+    uint64_t reserved;
+    undo_key keys[UNDO_KEYS_PER_BLOCK];
+};
+
+static_assert(sizeof(undo_header) == 512, "e2undo expects a 512 byte header");
+static_assert(sizeof(undo_key_block) == UNDO_BLOCK_SIZE, "Key blocks have to fill a block");
+static_assert(sizeof(ext4_super_block) == 1024, "e2undo saves a 1024 byte superblock");
+
+struct undo_state {
+    Partition *partition;  // NULL unless an undo file is open
+    int file;
+    uint64_t size, chunk_count;
+    // The mapping starts this far before the partition, at a page boundary
+    uint64_t lead, page_mask;
+    uint8_t *saved_chunks;  // Bitmap of the chunks that are saved or need no saving
+    uint8_t *released_chunks;  // Bitmap of the chunks that are writable
+    uint64_t saved_bytes;
+    undo_header header;
+    undo_key_block key_block;  // The one the next key goes to
+    uint32_t keys_in_block;
+    uint64_t key_block_no, next_block_no;
+    uint32_t crc_table[256];
+    struct sigaction previous_segv, previous_bus;
+};
+__thread undo_state undo;
+
+
+void init_crc32c_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? crc >> 1 ^ 0x82F63B78 : crc >> 1;
+        }
+        undo.crc_table[i] = crc;
+    }
+}
+
+
+// Like ext2fs_crc32c_le(), without inverting the result
+uint32_t crc32c(uint32_t crc, const void *data, uint64_t length) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (uint64_t i = 0; i < length; i++) {
+        crc = undo.crc_table[(crc ^ bytes[i]) & 0xFF] ^ crc >> 8;
+    }
+    return crc;
+}
+
+
+bool is_saved(uint64_t chunk) {
+    return undo.saved_chunks[chunk / 8] & 1 << chunk % 8;
+}
+
+
+void mark_saved(uint64_t chunk) {
+    undo.saved_chunks[chunk / 8] |= static_cast<uint8_t>(1 << chunk % 8);
+}
+
+
+bool is_released(uint64_t chunk) {
+    return undo.released_chunks[chunk / 8] & 1 << chunk % 8;
+}
+
+
+bool write_undo(const void *data, uint64_t length, uint64_t offset) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (length) {
+        ssize_t written = pwrite(undo.file, bytes, length, static_cast<off_t>(offset));
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        offset += written;
+        length -= written;
+    }
+    return true;
+}
+
+
+bool write_header(uint32_t state) {
+    undo.header.state = state;
+    undo.header.header_crc = crc32c(~0u, &undo.header, offsetof(undo_header, header_crc));
+    return write_undo(&undo.header, sizeof undo.header, 0);
+}
+
+
+// Writes the current key block, and the header that counts its keys, so that
+// what was saved so far can be replayed even if the conversion is aborted
+bool write_key_block() {
+    undo.key_block.magic = E2UNDO_KEYBLOCK_MAGIC;
+    undo.key_block.crc = 0;
+    undo.key_block.crc = crc32c(~0u, &undo.key_block, sizeof undo.key_block);
+    return write_undo(&undo.key_block, sizeof undo.key_block, undo.key_block_no * UNDO_BLOCK_SIZE)
+           && write_header(0);
+}
+
+
+bool save_chunk(uint64_t chunk) {
+    uint64_t offset = chunk * UNDO_CHUNK_SIZE;
+    uint64_t length = undo.size - offset < UNDO_CHUNK_SIZE ? undo.size - offset : UNDO_CHUNK_SIZE;
+    const uint8_t *data = undo.partition->ptr + offset;
+
+    // The data of the last key is the last thing in the file, so the key can
+    // take the chunk if it continues it on the partition
+    undo_key *last = undo.keys_in_block ? &undo.key_block.keys[undo.keys_in_block - 1] : NULL;
+    bool is_continued = last && last->fsblk * UNDO_BLOCK_SIZE + last->size == offset
+                        && last->size + length <= E2UNDO_MAX_EXTENT_BLOCKS * UNDO_BLOCK_SIZE;
+    if (!is_continued && undo.keys_in_block == UNDO_KEYS_PER_BLOCK) {
+        if (!write_key_block()) {
+            return false;
+        }
+        memset(&undo.key_block, 0, sizeof undo.key_block);
+        undo.keys_in_block = 0;
+        undo.key_block_no = undo.next_block_no++;
+    }
+
+    if (!write_undo(data, length, undo.next_block_no * UNDO_BLOCK_SIZE)) {
+        return false;
+    }
+    undo.next_block_no += (length + UNDO_BLOCK_SIZE - 1) / UNDO_BLOCK_SIZE;
+    if (is_continued) {
+        last->blk_crc = crc32c(last->blk_crc, data, length);
+        last->size += static_cast<uint32_t>(length);
+    } else {
+        undo.key_block.keys[undo.keys_in_block++] = {offset / UNDO_BLOCK_SIZE, crc32c(~0u, data, length),
+                                                     static_cast<uint32_t>(length)};
+        undo.header.num_keys++;
+    }
+    undo.saved_bytes += length;
+    mark_saved(chunk);
+    return true;
+}
+
+
+// Saves the chunks [begin, end) unless they are, and makes their pages
+// writable. Unless the partition starts at a page boundary, the first and last
+// page are shared with the chunks next to them, so those are saved as well.
+bool unprotect_chunks(uint64_t begin, uint64_t end) {
+    uint64_t save_begin = undo.lead && begin ? begin - 1 : begin;
+    uint64_t save_end = undo.lead && end < undo.chunk_count ? end + 1 : end;
+    for (uint64_t i = save_begin; i < save_end; i++) {
+        if (!is_saved(i) && !save_chunk(i)) {
+            return false;
+        }
+    }
+    uint64_t offset = begin * UNDO_CHUNK_SIZE;
+    uint64_t length = (end * UNDO_CHUNK_SIZE < undo.size ? end * UNDO_CHUNK_SIZE : undo.size) - offset;
+    uint8_t *pages = undo.partition->ptr + offset - ((undo.lead + offset) & undo.page_mask);
+    if (mprotect(pages, undo.partition->ptr + offset + length - pages, PROT_READ | PROT_WRITE)) {
+        return false;
+    }
+    for (uint64_t i = begin; i < end; i++) {
+        undo.released_chunks[i / 8] |= static_cast<uint8_t>(1 << i % 8);
+    }
+    return true;
+}
+
+
+// Saves the chunk unless it is already, and lets the writes to it through.
+// Every mprotect() can split a mapping in the kernel, and once there are too
+// many, aligned groups of twice as many chunks are saved and let through
+// together instead.
+bool release_chunk(uint64_t chunk) {
+    for (uint64_t span = 1; ; span *= 2) {
+        uint64_t begin = chunk & ~(span - 1);
+        uint64_t end = begin + span < undo.chunk_count ? begin + span : undo.chunk_count;
+        errno = 0;
+        if (unprotect_chunks(begin, end)) {
+            return true;
+        }
+        if (errno != ENOMEM || (!begin && end == undo.chunk_count)) {
+            return false;
+        }
+    }
+}
+
+
+void handle_write_fault(int signal, siginfo_t *info, void *) {
+    uint8_t *address = static_cast<uint8_t *>(info->si_addr);
+    bool is_partition_fault = undo.partition && address >= undo.partition->ptr
+                              && address < undo.partition->ptr + undo.size;
+    // Released chunks are writable, so a fault in them has another cause.
+    // Returning with the previous handler repeats it there.
+    if (!is_partition_fault || is_released((address - undo.partition->ptr) / UNDO_CHUNK_SIZE)) {
+        sigaction(signal, signal == SIGSEGV ? &undo.previous_segv : &undo.previous_bus, NULL);
+        return;
+    }
+    // The faulting code may be about to look at errno
+    int saved_errno = errno;
+    if (!release_chunk((address - undo.partition->ptr) / UNDO_CHUNK_SIZE)) {
+        // The write must not happen without its original being saved. Only
+        // async-signal-safe calls from here on.
+        static const char message[] = "Failed to write the undo file\n";
+        write(STDERR_FILENO, message, sizeof message - 1);
+        _exit(1);
+    }
+    errno = saved_errno;
+}
+
+
+bool is_free_chunk(uint64_t chunk) {
+    uint8_t *begin = meta_info.fs_start + chunk * UNDO_CHUNK_SIZE;
+    uint32_t last_cluster = cluster_no_of(begin + UNDO_CHUNK_SIZE - 1);
+    for (uint32_t cluster = cluster_no_of(begin); cluster <= last_cluster; cluster++) {
+        if (!is_free_cluster(*fat_entry(cluster))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Lets the writes to chunks of free clusters through from the start. If the
+// kernel runs out of mappings for that, the rest is saved when written.
+void release_free_chunks() {
+    uint64_t data_offset = static_cast<uint64_t>(meta_info.data_start - meta_info.fs_start);
+    uint64_t data_end = data_offset + (static_cast<uint64_t>(data_cluster_count() - FAT_START_INDEX)
+                                       << meta_info.cluster_size_log2);
+    uint64_t first_chunk = (data_offset + UNDO_CHUNK_SIZE - 1) / UNDO_CHUNK_SIZE;
+    uint64_t end_chunk = data_end / UNDO_CHUNK_SIZE;
+    uint64_t run_begin = first_chunk;
+    for (uint64_t chunk = first_chunk; chunk <= end_chunk; chunk++) {
+        if (chunk < end_chunk && is_free_chunk(chunk)) {
+            continue;
+        }
+        if (chunk > run_begin) {
+            for (uint64_t i = run_begin; i < chunk; i++) {
+                mark_saved(i);
+            }
+            if (!unprotect_chunks(run_begin, chunk)) {
+                return;
+            }
+        }
+        run_begin = chunk + 1;
+    }
+}
+
+
+bool start_undo_file(Partition *partition, const char *path) {
+    // Truncating it would destroy the partition before anything is saved
+    if (isPartitionFile(partition, path)) {
+        fprintf(stderr, "The undo file must not be the partition\n");
+        return false;
+    }
+    memset(&undo, 0, sizeof undo);
+    init_crc32c_table();
+    undo.file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (undo.file < 0) {
+        perror("Failed to create the undo file");
+        return false;
+    }
+    undo.size = partition->size;
+    undo.chunk_count = (undo.size + UNDO_CHUNK_SIZE - 1) / UNDO_CHUNK_SIZE;
+    undo.page_mask = sysconf(_SC_PAGESIZE) - 1;
+    undo.lead = partition->offset & undo.page_mask;
+    undo.saved_chunks = static_cast<uint8_t *>(calloc((undo.chunk_count + 7) / 8, 1));
+    undo.released_chunks = static_cast<uint8_t *>(calloc((undo.chunk_count + 7) / 8, 1));
+
+    memcpy(undo.header.magic, E2UNDO_MAGIC, sizeof undo.header.magic);
+    undo.header.super_offset = UNDO_SUPER_BLOCK;
+    undo.header.key_offset = UNDO_FIRST_KEY_BLOCK;
+    undo.header.block_size = UNDO_BLOCK_SIZE;
+    undo.header.fs_block_size = UNDO_BLOCK_SIZE;
+    // The blocks of a partition of a disk count from its start
+    undo.header.fs_offset = partition->offset;
+    undo.header.f_compat = partition->offset ? E2UNDO_FEATURE_COMPAT_FS_OFFSET : 0;
+    undo.key_block_no = UNDO_FIRST_KEY_BLOCK;
+    undo.next_block_no = UNDO_FIRST_KEY_BLOCK + 1;
+    if (!write_header(0)) {
+        perror("Failed to write the undo file");
+        close(undo.file);
+        free(undo.saved_chunks);
+        free(undo.released_chunks);
+        return false;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = handle_write_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &undo.previous_segv);
+    sigaction(SIGBUS, &action, &undo.previous_bus);
+    undo.partition = partition;
+    setWriteDependency(undo.file);
+    // The page-aligned mapping around the partition, see openPartition()
+    if (mprotect(partition->ptr - undo.lead, undo.lead + undo.size, PROT_READ)) {
+        perror("Failed to protect the partition for the undo file");
+        stop_undo_file();
+        return false;
+    }
+    release_free_chunks();
+    return true;
+}
+
+
+bool save_undo_range(uint64_t offset, uint64_t length) {
+    if (!undo.partition || !length) {
+        return true;
+    }
+    for (uint64_t chunk = offset / UNDO_CHUNK_SIZE; chunk <= (offset + length - 1) / UNDO_CHUNK_SIZE; chunk++) {
+        if (!is_saved(chunk) && !release_chunk(chunk)) {
+            perror("Failed to write the undo file");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Lets all writes through again and closes the file
+void close_undo_file() {
+    if (mprotect(undo.partition->ptr - undo.lead, undo.lead + undo.size, PROT_READ | PROT_WRITE)) {
+        perror("mprotect");
+    }
+    sigaction(SIGSEGV, &undo.previous_segv, NULL);
+    sigaction(SIGBUS, &undo.previous_bus, NULL);
+    setWriteDependency(-1);
+    close(undo.file);
+    free(undo.saved_chunks);
+    free(undo.released_chunks);
+    undo.partition = NULL;
+}
+
+
+bool finish_undo_file() {
+    if (!undo.partition) {
+        return true;
+    }
+    // e2undo only replays onto the file system that has exactly this superblock
+    ext4_super_block super;
+    memcpy(&super, undo.partition->ptr + E2UNDO_SUPERBLOCK_OFFSET, sizeof super);
+    undo.header.sb_crc = crc32c(~0u, &super, sizeof super);
+    super.s_magic = static_cast<uint16_t>(~super.s_magic);  // Not to be taken for a file system itself
+
+    bool is_written = write_key_block()
+                      && write_undo(&super, sizeof super, UNDO_SUPER_BLOCK * UNDO_BLOCK_SIZE)
+                      && write_header(E2UNDO_STATE_FINISHED)
+                      && !fsync(undo.file);
+    if (is_written) {
+        printf("Saved %llu KiB of the partition in the undo file\n",
+               static_cast<unsigned long long>(undo.saved_bytes >> 10));
+    } else {
+        perror("Failed to write the undo file");
+    }
+    close_undo_file();
+    return is_written;
+}
+
+
+void stop_undo_file() {
+    if (!undo.partition) {
+        return;
+    }
+    if (!write_key_block() || fsync(undo.file)) {
+        perror("Failed to write the undo file");
+    }
+    close_undo_file();
+}
@@ -0,0 +1,26 @@
+#ifndef OFS_CONVERT_UNDO_FILE_H
+#define OFS_CONVERT_UNDO_FILE_H
+
+#include "partition.h"
+
+// Saves what the conversion overwrites to an undo file in the format of
+// e2fsprogs, so that e2undo can roll the partition back to FAT instead of
+// restoring a full backup. The mapping is write-protected, and the first write
+// to each chunk of it copies the chunk's original contents to the undo file
+// before letting the write through. Chunks of clusters that are free in the
+// FAT stay writable, their contents are not part of the FAT file system.
+//
+// Has to be started after set_meta_info() and before anything is written to
+// the mapping. Only one partition at a time can have an undo file.
+bool start_undo_file(Partition *partition, const char *path);
+// Saves a range of the partition that is about to change other than through
+// the mapping, like a discard. Does nothing without an undo file.
+bool save_undo_range(uint64_t offset, uint64_t length);
+// Completes the undo file once the conversion is done. e2undo only replays it
+// onto the file system the conversion produced. Returns false if it could not
+// be written, true if there is no undo file.
+bool finish_undo_file();
+// Closes the undo file of an aborted conversion, which e2undo -f still replays
+void stop_undo_file();
+
+#endif //OFS_CONVERT_UNDO_FILE_H
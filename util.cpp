@@ -1,5 +1,11 @@
 #include "util.h"
 
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 uint32_t log2(uint32_t value) {
     return sizeof(value) * 8 - __builtin_clz(value) - 1;
@@ -11,6 +17,11 @@ uint32_t min(uint32_t a, uint32_t b) {
 }
 
 
+fast_divisor init_fast_divisor(uint32_t divisor) {
+    return {UINT64_MAX / divisor + 1, divisor};
+}
+
+
 uint64_t from_lo_hi(uint32_t lo, uint32_t hi) {
     return static_cast<uint64_t>(hi) << 32 | lo;
 }
@@ -82,3 +93,37 @@ void bitmap_set_bits(uint8_t* bitmap, uint32_t begin, uint32_t end) {
     } else if(beginPtr == endPtr)
         *beginPtr |= (~fillLSBs(begin%segmentLength)) & fillLSBs(end%segmentLength);
 }
+
+
+bool is_zeroed(const uint8_t* data, uint64_t size) {
+    uint64_t i = 0;
+#ifdef __SSE2__
+    for(; i + 64 <= size; i += 64) {
+        const __m128i* chunk = reinterpret_cast<const __m128i*>(data + i);
+        __m128i ored = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(chunk), _mm_loadu_si128(chunk + 1)),
+                                    _mm_or_si128(_mm_loadu_si128(chunk + 2), _mm_loadu_si128(chunk + 3)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(ored, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+#endif
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof word);
+        if(word)
+            return false;
+    }
+    for(; i < size; ++i)
+        if(data[i])
+            return false;
+    return true;
+}
+
+
+__thread jmp_buf *conversion_failure;
+
+void fail_conversion() {
+    if (!conversion_failure) {
+        exit(1);
+    }
+    longjmp(*conversion_failure, 1);
+}
@@ -1,6 +1,7 @@
 #ifndef OFS_CONVERT_UTIL_H
 #define OFS_CONVERT_UTIL_H
 
+#include <setjmp.h>
 #include <stdint.h>
 
 uint32_t log2(uint32_t value);
@@ -28,8 +29,49 @@ uint32_t ceildiv(T a, T b) {
     return (a + b - 1) / b;
 }
 
+// Divides 32 bit numbers by a divisor > 1 known at runtime with two
+// multiplications instead of a division (Lemire et al., "Faster Remainder by
+// Direct Computation")
+struct fast_divisor {
+    uint64_t multiplier;
+    uint32_t divisor;
+};
+
+fast_divisor init_fast_divisor(uint32_t divisor);
+
+#ifdef __SIZEOF_INT128__
+inline uint32_t fast_div(uint32_t n, const fast_divisor& d) {
+    return static_cast<uint32_t>((static_cast<unsigned __int128>(d.multiplier) * n) >> 64);
+}
+
+inline uint32_t fast_mod(uint32_t n, const fast_divisor& d) {
+    uint64_t fraction = d.multiplier * n;
+    return static_cast<uint32_t>((static_cast<unsigned __int128>(fraction) * d.divisor) >> 64);
+}
+#else
+// Without 128 bit products, as on 32 bit targets, the division is cheaper
+inline uint32_t fast_div(uint32_t n, const fast_divisor& d) {
+    return n / d.divisor;
+}
+
+inline uint32_t fast_mod(uint32_t n, const fast_divisor& d) {
+    return n % d.divisor;
+}
+#endif
+
 void bitmap_set_bit(uint8_t* bitmap, uint32_t bit_num);
 
 void bitmap_set_bits(uint8_t* bitmap, uint32_t begin, uint32_t end);
 
+bool is_zeroed(const uint8_t* data, uint64_t size);
+
+// Where fail_conversion() returns to, set by convert_partition() for the
+// conversion running on this thread
+extern __thread jmp_buf *conversion_failure;
+
+// Ends the conversion running on this thread after an error too deep within it
+// to be returned, like running out of clusters. Without a conversion, as in
+// fatgen, it terminates the process.
+[[noreturn]] void fail_conversion();
+
 #endif //OFS_CONVERT_UTIL_H
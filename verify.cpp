@@ -0,0 +1,357 @@
+#include "ext4.h"
+#include "ext4_bg.h"
+#include "ext4_dentry.h"
+#include "ext4_extent.h"
+#include "ext4_inode.h"
+#include "fat.h"
+#include "util.h"
+#include "verify.h"
+#include "xxhash64.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+constexpr uint32_t VERIFY_NAME_UNITS = MAX_LFN_ENTRIES * LFN_ENTRY_LENGTH;
+
+// Content beyond the allocated data of a file reads as zeros
+static const uint8_t zeros[4096] = {};
+
+uint32_t add_record(verify_records& records, const verify_record& record) {
+    if (records.count == records.capacity) {
+        records.capacity = records.capacity ? 2 * records.capacity : 1024;
+        records.records = static_cast<verify_record *>(context_realloc(records.records, records.capacity * sizeof(verify_record)));
+    }
+    records.records[records.count] = record;
+    return records.count++;
+}
+
+void free_verify_records(verify_records& records) {
+    context_free(records.records);
+    records = {NULL, 0, 0};
+}
+
+verify_record root_record() {
+    verify_record record;
+    memset(&record, 0, sizeof record);
+    record.is_dir = true;
+    return record;
+}
+
+// A FAT directory whose entries are being read, see read_fat_tree
+struct fat_dir_frame {
+    fat_dir_reader reader;
+    uint32_t record;
+};
+
+// Reads a long or short name the same way the conversion does, returns the
+// dentry that follows the long name entries
+fat_dentry *read_fat_name(fat_dir_reader& dir, fat_dentry *dentry, uint16_t *name, uint32_t& name_units) {
+    if (!is_lfn(dentry)) {
+        read_short_name(dentry, name);
+        name_units = LFN_ENTRY_LENGTH;
+        return dentry;
+    }
+
+    int lfn_entry_count = lfn_entry_sequence_no(dentry);
+    name_units = lfn_entry_count * LFN_ENTRY_LENGTH;
+    for (int i = lfn_entry_count - 1; i >= 0 && dentry; i--) {
+        lfn_cpy(name + i * LFN_ENTRY_LENGTH, reinterpret_cast<uint8_t *>(dentry));
+        dentry = next_fat_dentry(dir);
+    }
+    return dentry;
+}
+
+uint64_t fat_file_hash(uint32_t cluster_no, uint64_t size) {
+    xxh64_state state;
+    xxh64_init(&state, 0);
+    while (size && cluster_no >= FAT_START_INDEX && cluster_no < FAT_END_OF_CHAIN) {
+        uint32_t length = size < meta_info.cluster_size ? static_cast<uint32_t>(size) : meta_info.cluster_size;
+        xxh64_update(&state, cluster_start(cluster_no), length);
+        size -= length;
+        cluster_no = *fat_entry(cluster_no) & CLUSTER_ENTRY_MASK;
+    }
+    return xxh64_digest(&state);
+}
+
+verify_records read_fat_tree() {
+    verify_records records = {NULL, 0, 0};
+    uint32_t stack_size = 1, stack_capacity = 64;
+    auto *stack = static_cast<fat_dir_frame *>(context_malloc(stack_capacity * sizeof(fat_dir_frame)));
+    stack[0] = {open_fat_dir(boot_sector.root_cluster_no), add_record(records, root_record())};
+
+    uint16_t name[VERIFY_NAME_UNITS];
+    uint8_t utf8_name[EXT4_NAME_LEN];
+    while (stack_size) {
+        fat_dir_frame& dir = stack[stack_size - 1];
+        fat_dentry *dentry = next_fat_dentry(dir.reader);
+        uint32_t name_units;
+        if (dentry) {
+            dentry = read_fat_name(dir.reader, dentry, name, name_units);
+        }
+        if (!dentry) {
+            stack_size--;
+            continue;
+        }
+        records.records[dir.record].child_count++;
+
+        verify_record record;
+        memset(&record, 0, sizeof record);
+        int name_length = utf16toutf8(utf8_name, utf8_name + EXT4_NAME_LEN, name, name_units);
+        record.name_hash = xxh64(utf8_name, name_length, 0);
+        record.atime = fat_time_to_unix(dentry->access_date, 0);
+        record.mtime = fat_time_to_unix(dentry->mod_date, dentry->mod_time);
+        record.crtime = fat_time_to_unix(dentry->create_date, dentry->create_time);
+        record.is_dir = is_dir(dentry);
+        if (!record.is_dir) {
+            record.size = dentry->file_size;
+            record.content_hash = fat_file_hash(file_cluster_no(dentry), dentry->file_size);
+        }
+        uint32_t record_no = add_record(records, record);
+
+        if (record.is_dir) {
+            if (stack_size == stack_capacity) {
+                stack_capacity *= 2;
+                stack = static_cast<fat_dir_frame *>(context_realloc(stack, stack_capacity * sizeof(fat_dir_frame)));
+            }
+            stack[stack_size++] = {open_fat_dir(file_cluster_no(dentry)), record_no};
+        }
+    }
+    context_free(stack);
+    return records;
+}
+
+bool is_within_fs(uint64_t first_block, uint64_t count) {
+    return first_block >= context->sb.s_first_data_block && first_block < block_count() && count <= block_count() - first_block;
+}
+
+// The ext4 side only uses what is on disk, not the in-memory group
+// descriptors. Returns NULL if the inode number or the inode table it leads
+// to is invalid.
+const ext4_inode *read_inode(uint32_t inode_no) {
+    if (!inode_no || inode_no > context->sb.s_inodes_count) {
+        return NULL;
+    }
+    uint32_t bg_num = fast_div(inode_no - 1, context->geometry.inodes_per_group);
+    uint32_t num_in_bg = fast_mod(inode_no - 1, context->geometry.inodes_per_group);
+    uint8_t *gdt = block_start(context->sb.s_first_data_block + 1);
+    auto *bg = reinterpret_cast<const ext4_group_desc *>(gdt + bg_num * context->sb.s_desc_size);
+    uint64_t inode_table_block = from_lo_hi(bg->bg_inode_table_lo, bg->bg_inode_table_hi);
+    if (!is_within_fs(inode_table_block, context->geometry.inode_table_blocks)) {
+        return NULL;
+    }
+    return reinterpret_cast<const ext4_inode *>(block_start(inode_table_block) + num_in_bg * context->sb.s_inode_size);
+}
+
+uint64_t inode_size(const ext4_inode *inode) {
+    return from_lo_hi(inode->i_size_lo, inode->i_size_high);
+}
+
+// Hashes a file the way it reads: holes and unwritten extents are zeros
+struct ext4_file_reader {
+    xxh64_state state;
+    uint64_t position, size;
+    bool is_valid;
+};
+
+void read_zeros(ext4_file_reader *reader, uint64_t end) {
+    if (end > reader->size) {
+        end = reader->size;
+    }
+    while (reader->position < end) {
+        uint64_t length = end - reader->position < sizeof zeros ? end - reader->position : sizeof zeros;
+        xxh64_update(&reader->state, zeros, length);
+        reader->position += length;
+    }
+}
+
+// Each level has to be one less deep than its parent, so a damaged tree
+// cannot lead back up
+void read_extent_tree(ext4_file_reader *reader, const ext4_extent_header *header, uint16_t depth) {
+    if (!is_valid_extent_node(header) || header->eh_depth != depth) {
+        reader->is_valid = false;
+        return;
+    }
+
+    if (header->eh_depth) {
+        auto *idx = reinterpret_cast<const ext4_extent_idx *>(header + 1);
+        for (uint16_t i = 0; i < header->eh_entries && reader->is_valid; i++) {
+            uint64_t child_block = from_lo_hi(idx[i].ei_leaf_lo, idx[i].ei_leaf_hi);
+            if (!is_within_fs(child_block, 1)) {
+                reader->is_valid = false;
+                return;
+            }
+            read_extent_tree(reader, reinterpret_cast<const ext4_extent_header *>(block_start(child_block)), depth - 1);
+        }
+        return;
+    }
+
+    auto *extents = reinterpret_cast<const ext4_extent *>(header + 1);
+    for (uint16_t i = 0; i < header->eh_entries; i++) {
+        bool is_unwritten = extents[i].ee_len > EXT4_MAX_INIT_EXTENT_LEN;
+        uint64_t length = is_unwritten ? extents[i].ee_len - EXT4_MAX_INIT_EXTENT_LEN : extents[i].ee_len;
+        uint64_t begin = static_cast<uint64_t>(extents[i].ee_block) * block_size();
+        // Extents have to be sorted, must not overlap and have to lie within the file system
+        if (begin < reader->position || !is_within_fs(from_lo_hi(extents[i].ee_start_lo, extents[i].ee_start_hi), length)) {
+            reader->is_valid = false;
+            return;
+        }
+
+        read_zeros(reader, begin);
+        uint64_t end = begin + length * block_size();
+        if (is_unwritten) {
+            read_zeros(reader, end);
+        } else if (reader->position < reader->size) {
+            uint64_t read_length = (end < reader->size ? end : reader->size) - reader->position;
+            xxh64_update(&reader->state, block_start(from_lo_hi(extents[i].ee_start_lo, extents[i].ee_start_hi)), read_length);
+            reader->position += read_length;
+        }
+    }
+}
+
+uint64_t ext4_file_hash(const ext4_inode *inode, bool& is_valid) {
+    ext4_file_reader reader;
+    xxh64_init(&reader.state, 0);
+    reader.position = 0;
+    reader.size = inode_size(inode);
+    reader.is_valid = inode->ext_header.eh_depth <= EXT4_MAX_EXTENT_DEPTH;
+    if (reader.is_valid) {
+        read_extent_tree(&reader, &inode->ext_header, inode->ext_header.eh_depth);
+    }
+    read_zeros(&reader, reader.size);
+    is_valid = reader.is_valid;
+    return xxh64_digest(&reader.state);
+}
+
+// An ext4 directory whose entries are being read, see verify_ext4_tree
+struct ext4_dir_frame {
+    uint32_t inode_no;
+    const ext4_inode *inode;
+    uint32_t block, block_count, position_in_block;
+    uint32_t record, child_count;
+};
+
+// Returns NULL at the end of the directory, sets is_valid to false if the
+// directory is corrupted
+const ext4_dentry *next_ext4_dentry(ext4_dir_frame& dir, bool& is_valid) {
+    while (dir.block < dir.block_count) {
+        uint64_t block_no = map_logical_block(dir.inode, dir.block);
+        if (!block_no) {
+            is_valid = false;
+            return NULL;
+        }
+        auto *dentry = reinterpret_cast<const ext4_dentry *>(block_start(block_no) + dir.position_in_block);
+        if (dentry->rec_len < 8 || dentry->rec_len > block_size() - dir.position_in_block) {
+            is_valid = false;
+            return NULL;
+        }
+
+        dir.position_in_block += dentry->rec_len;
+        if (dir.position_in_block == block_size()) {
+            dir.block++;
+            dir.position_in_block = 0;
+        }
+
+        bool is_dot_dir = (dentry->name_len == 1 && dentry->name[0] == '.')
+                          || (dentry->name_len == 2 && dentry->name[0] == '.' && dentry->name[1] == '.');
+        bool is_lost_found = dir.inode_no == EXT4_ROOT_INODE && dentry->inode == EXT4_LOST_FOUND_INODE;
+        if (dentry->inode && !is_dot_dir && !is_lost_found) {
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+const char *compare_records(const verify_record& fat, const verify_record& ext4) {
+    if (fat.is_dir != ext4.is_dir) return "type";
+    if (fat.name_hash != ext4.name_hash) return "name";
+    if (fat.size != ext4.size) return "size";
+    if (fat.content_hash != ext4.content_hash) return "content";
+    if (fat.atime != ext4.atime || fat.mtime != ext4.mtime || fat.crtime != ext4.crtime) return "timestamps";
+    return NULL;
+}
+
+ext4_dir_frame init_dir_frame(uint32_t inode_no, const ext4_inode *inode, uint32_t record) {
+    return {inode_no, inode, 0, static_cast<uint32_t>(inode_size(inode) / block_size()), 0, record, 0};
+}
+
+bool verify_ext4_tree(const verify_records& records) {
+    const ext4_inode *root = read_inode(EXT4_ROOT_INODE);
+    if (!root) {
+        fprintf(stderr, "Verification failed, the root directory inode is invalid\n");
+        return false;
+    }
+    uint32_t stack_size = 1, stack_capacity = 64;
+    auto *stack = static_cast<ext4_dir_frame *>(context_malloc(stack_capacity * sizeof(ext4_dir_frame)));
+    stack[0] = init_dir_frame(EXT4_ROOT_INODE, root, 0);
+    uint32_t next_record = 1;
+    bool is_valid = true;
+
+    while (stack_size && is_valid) {
+        ext4_dir_frame& dir = stack[stack_size - 1];
+        const ext4_dentry *dentry = next_ext4_dentry(dir, is_valid);
+        if (!is_valid) {
+            fprintf(stderr, "Verification failed, directory inode %u is corrupted\n", dir.inode_no);
+            break;
+        }
+        if (!dentry) {
+            if (dir.child_count != records.records[dir.record].child_count) {
+                fprintf(stderr, "Verification failed, directory inode %u has %u instead of %u entries\n",
+                        dir.inode_no, dir.child_count, records.records[dir.record].child_count);
+                is_valid = false;
+            }
+            stack_size--;
+            continue;
+        }
+        dir.child_count++;
+        if (next_record == records.count) {
+            fprintf(stderr, "Verification failed, \"%.*s\" does not exist in the FAT file system\n",
+                    dentry->name_len, dentry->name);
+            is_valid = false;
+            break;
+        }
+
+        const ext4_inode *inode = read_inode(dentry->inode);
+        if (!inode) {
+            fprintf(stderr, "Verification failed, \"%.*s\" refers to the invalid inode %u\n",
+                    dentry->name_len, dentry->name, dentry->inode);
+            is_valid = false;
+            break;
+        }
+        verify_record record;
+        memset(&record, 0, sizeof record);
+        record.name_hash = xxh64(dentry->name, dentry->name_len, 0);
+        record.atime = inode->i_atime;
+        record.mtime = inode->i_mtime;
+        record.crtime = inode->i_crtime;
+        record.is_dir = (inode->i_mode & 0xF000) == S_IFDIR;
+        if (!record.is_dir) {
+            record.size = inode_size(inode);
+            record.content_hash = ext4_file_hash(inode, is_valid);
+            if (!is_valid) {
+                fprintf(stderr, "Verification failed, the extent tree of \"%.*s\" is corrupted\n",
+                        dentry->name_len, dentry->name);
+                break;
+            }
+        }
+
+        uint32_t record_no = next_record++;
+        const char *difference = compare_records(records.records[record_no], record);
+        if (difference) {
+            fprintf(stderr, "Verification failed, the %s of \"%.*s\" differs\n", difference,
+                    dentry->name_len, dentry->name);
+            is_valid = false;
+            break;
+        }
+
+        if (record.is_dir) {
+            if (stack_size == stack_capacity) {
+                stack_capacity *= 2;
+                stack = static_cast<ext4_dir_frame *>(context_realloc(stack, stack_capacity * sizeof(ext4_dir_frame)));
+            }
+            stack[stack_size++] = init_dir_frame(dentry->inode, inode, record_no);
+        }
+    }
+    context_free(stack);
+    return is_valid;
+}
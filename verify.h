@@ -0,0 +1,32 @@
+#ifndef OFS_CONVERT_VERIFY_H
+#define OFS_CONVERT_VERIFY_H
+
+#include <stdint.h>
+
+// What is compared of a file or directory. The entries of the tree are stored
+// in depth-first order, each directory directly followed by its contents.
+struct verify_record {
+    uint64_t name_hash;
+    uint64_t size;  // 0 for directories
+    uint64_t content_hash;  // 0 for directories
+    uint32_t atime, mtime, crtime;
+    uint32_t child_count;  // Only for directories
+    bool is_dir;
+};
+
+struct verify_records {
+    verify_record *records;
+    uint32_t count, capacity;
+};
+
+// Reads the FAT directory tree and digests all file contents. Has to run
+// before the conversion changes anything.
+verify_records read_fat_tree();
+// Reads the ext4 directory tree back from the converted image, through the
+// on-disk group descriptors, inodes, extent trees and directory blocks, and
+// compares it to records. Prints the first difference and returns false if
+// there is one.
+bool verify_ext4_tree(const verify_records& records);
+void free_verify_records(verify_records& records);
+
+#endif //OFS_CONVERT_VERIFY_H
@@ -15,8 +15,9 @@ const char* type_colors[] = {
     #undef ENTRY
 };
 
-BlockRange* block_range = NULL;
-uint32_t resettled = 0, tag_count = 0, fragment_count = 0, pages_allocated = 0, archiver_pages = 0, group_header_pages = 0;
+__thread BlockRange* block_range = NULL;
+__thread uint32_t resettled = 0, tag_count = 0, fragment_count = 0, pages_allocated = 0, archiver_pages = 0, group_header_pages = 0,
+                  extents_added = 0, extents_coalesced = 0;
 
 void visualizer_add_allocated_extent(const fat_extent& extent) {
 #ifdef VISUALIZER
@@ -30,6 +31,13 @@ void visualizer_add_tag(uint64_t tag) {
 #endif  // VISUALIZER
 }
 
+void visualizer_add_extent(bool is_coalesced) {
+#ifdef VISUALIZER
+    ++extents_added;
+    extents_coalesced += is_coalesced;
+#endif  // VISUALIZER
+}
+
 void visualizer_add_block_range(BlockRange source) {
 #ifdef VISUALIZER
     BlockRange* destination = (BlockRange*)malloc(sizeof(BlockRange));
@@ -99,7 +107,7 @@ void visualizer_render_to_file(const char* path, uint32_t block_count) {
         fprintf(output, "\t\t<rect x=\"%d\" y=\"%d\" width=\"%f\" height=\"%f\" fill=\"%s\"/>\n", x, y, line_height*0.8, line_height*0.8, type_colors[type]);
         fprintf(output, "\t\t<text x=\"%d\" y=\"%d\" font-family=\"Verdana\">%s</text>\n", x+line_height, y+15, type_names[type]);
     }
-    fprintf(output, "\t\t<text x=\"5\" y=\"%d\" font-family=\"Verdana\">Blocks: %d x %d, Fragmentation: %d / %d, Pages allocated: %d (%d resettled, %d for archiver, %d for ext4 structures), Group headers: %d</text>\n", line_height*(line_count+1)+15, block_count/line_count, line_count, fragment_count, tag_count, pages_allocated, resettled, archiver_pages, pages_allocated - resettled - archiver_pages, group_header_pages);
+    fprintf(output, "\t\t<text x=\"5\" y=\"%d\" font-family=\"Verdana\">Blocks: %d x %d, Fragmentation: %d / %d, Pages allocated: %d (%d resettled, %d for archiver, %d for ext4 structures), Group headers: %d, Extents: %d (%d before coalescing)</text>\n", line_height*(line_count+1)+15, block_count/line_count, line_count, fragment_count, tag_count, pages_allocated, resettled, archiver_pages, pages_allocated - resettled - archiver_pages, group_header_pages, extents_added - extents_coalesced, extents_added);
     fputs("\t</g>\n\t<script type=\"text/javascript\" xlink:href=\"visualizer.js\"/>\n", output);
     fputs("</svg>\n", output);
     fclose(output);
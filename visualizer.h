@@ -18,6 +18,8 @@ struct BlockRange {
 
 void visualizer_add_allocated_extent(const fat_extent& extent);
 void visualizer_add_tag(uint64_t tag);
+// Counts an extent added to an inode, which may have extended the previous one
+void visualizer_add_extent(bool is_coalesced);
 void visualizer_add_block_range(BlockRange to_add);
 void visualizer_render_to_file(const char* path, uint32_t block_count);
 
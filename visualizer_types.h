@@ -5,3 +5,4 @@ ENTRY(ResettledPayload, "BurlyWood")
 ENTRY(Ext4Dir, "PaleVioletRed")
 ENTRY(IdxNode, "Indigo")
 ENTRY(StreamArchiverPage, "Black")  // TODO pretty color
+ENTRY(Journal, "Gold")
@@ -0,0 +1,130 @@
+#include "xxhash64.h"
+
+#include <string.h>
+
+constexpr uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// Unaligned little endian reads
+inline uint64_t read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+inline uint32_t read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof value);
+    return value;
+}
+
+inline uint64_t xxh64_round(uint64_t lane, uint64_t input) {
+    lane += input * PRIME64_2;
+    lane = rotl64(lane, 31);
+    return lane * PRIME64_1;
+}
+
+inline uint64_t xxh64_merge_round(uint64_t hash, uint64_t lane) {
+    hash ^= xxh64_round(0, lane);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+// Consumes whole 32 byte stripes, returns the number of bytes consumed
+size_t xxh64_consume_stripes(uint64_t lanes[4], const uint8_t *data, size_t length) {
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+    const uint8_t *p = data, *end = data + length - length % 32;
+    // The four lanes are independent, which lets the CPU work on them in parallel
+    for (; p < end; p += 32) {
+        v1 = xxh64_round(v1, read64(p));
+        v2 = xxh64_round(v2, read64(p + 8));
+        v3 = xxh64_round(v3, read64(p + 16));
+        v4 = xxh64_round(v4, read64(p + 24));
+    }
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+    return p - data;
+}
+
+void xxh64_init(xxh64_state *state, uint64_t seed) {
+    memset(state, 0, sizeof *state);
+    state->seed = seed;
+    state->lanes[0] = seed + PRIME64_1 + PRIME64_2;
+    state->lanes[1] = seed + PRIME64_2;
+    state->lanes[2] = seed;
+    state->lanes[3] = seed - PRIME64_1;
+}
+
+void xxh64_update(xxh64_state *state, const void *data, size_t length) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    state->total_length += length;
+
+    if (state->buffer_size) {
+        size_t missing = sizeof state->buffer - state->buffer_size;
+        if (length < missing) {
+            memcpy(state->buffer + state->buffer_size, p, length);
+            state->buffer_size += length;
+            return;
+        }
+        memcpy(state->buffer + state->buffer_size, p, missing);
+        xxh64_consume_stripes(state->lanes, state->buffer, sizeof state->buffer);
+        state->buffer_size = 0;
+        p += missing;
+        length -= missing;
+    }
+
+    size_t consumed = xxh64_consume_stripes(state->lanes, p, length);
+    memcpy(state->buffer, p + consumed, length - consumed);
+    state->buffer_size = length - consumed;
+}
+
+uint64_t xxh64_digest(const xxh64_state *state) {
+    uint64_t hash;
+    if (state->total_length >= 32) {
+        const uint64_t *v = state->lanes;
+        hash = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge_round(hash, v[i]);
+        }
+    } else {
+        hash = state->seed + PRIME64_5;
+    }
+    hash += state->total_length;
+
+    const uint8_t *p = state->buffer, *end = state->buffer + state->buffer_size;
+    for (; p + 8 <= end; p += 8) {
+        hash ^= xxh64_round(0, read64(p));
+        hash = rotl64(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        hash ^= read32(p) * PRIME64_1;
+        hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME64_5;
+        hash = rotl64(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t xxh64(const void *data, size_t length, uint64_t seed) {
+    xxh64_state state;
+    xxh64_init(&state, seed);
+    xxh64_update(&state, data, length);
+    return xxh64_digest(&state);
+}
@@ -0,0 +1,22 @@
+#ifndef OFS_CONVERT_XXHASH64_H
+#define OFS_CONVERT_XXHASH64_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash), a fast
+// non-cryptographic hash used to compare file contents
+struct xxh64_state {
+    uint64_t total_length;
+    uint64_t lanes[4];
+    uint8_t buffer[32];  // Input not yet consumed by the lanes
+    uint32_t buffer_size;
+    uint64_t seed;
+};
+
+void xxh64_init(xxh64_state *state, uint64_t seed);
+void xxh64_update(xxh64_state *state, const void *data, size_t length);
+uint64_t xxh64_digest(const xxh64_state *state);
+uint64_t xxh64(const void *data, size_t length, uint64_t seed);
+
+#endif //OFS_CONVERT_XXHASH64_H